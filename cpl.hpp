@@ -29,11 +29,38 @@ SOFTWARE.
 
 #pragma once
 
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <exception>
 #include <experimental/optional>
+#include <iterator>
 #include <memory>
+#include <new>
+#include <stdexcept>
+#include <thread>
+#include <tuple>
+#include <utility>
+
+#ifdef __cpp_impl_coroutine // {
+#include <coroutine>
+#endif // } __cpp_impl_coroutine
 
 #ifndef CPL_WITHOUT_COLLECTIONS // {
 
+// Used by the concurrency facilities which keep their state in collections.
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <shared_mutex>
+#include <unordered_map>
+#include <vector>
+
 #ifdef CPL_FAST // {
 #include <bitset>
 #include <map>
@@ -52,6 +79,10 @@ SOFTWARE.
 
 #endif // } CPL_WITHOUT_COLLECTIONS
 
+#ifdef __AVX2__ // {
+#include <immintrin.h>
+#endif // } __AVX2__
+
 /// The Git-derived version number.
 ///
 /// To update this, run `make version`. This should be done before every
@@ -72,6 +103,11 @@ SOFTWARE.
 
 /// If this is defined, do not provide the @ref cpl version of the standard
 /// collections, and do not even include their header files.
+///
+/// This also omits the concurrency facilities which keep their state in
+/// standard collections (everything except @ref cpl::atomic_sptr, @ref
+/// cpl::atomic_sref, @ref cpl::channel, @ref cpl::spsc_ring, @ref cpl::cell
+/// and @ref cpl::seqlock).
 #define CPL_WITHOUT_COLLECTIONS
 
 #else // } DOXYGEN {
@@ -111,6 +147,14 @@ SOFTWARE.
   throw(std::logic_error(MESSAGE))
 #endif // } CPL_ASSERT
 
+#ifndef CPL_CACHE_LINE_SIZE // {
+/// The size of a cache line (in bytes).
+///
+/// This is used to separate data accessed by different threads, to avoid
+/// false sharing. It may be overridden when targeting a different CPU.
+#define CPL_CACHE_LINE_SIZE 64
+#endif // } CPL_CACHE_LINE_SIZE
+
 #ifdef CPL_FAST // {
 #undef CPL_ASSERT
 #define CPL_ASSERT(CONDITION, MESSAGE)
@@ -178,10 +222,19 @@ SOFTWARE.
 /// | @ref cpl::uptr | Yes          | The `uptr` exists and is not reset | `std::unique_ptr<T>`             |
 /// | @ref cpl::sref | No           | The `sref` exists                  | `std::shared_ptr<T>`             |
 /// | @ref cpl::sptr | Yes          | The `sptr` exists                  | `std::shared_ptr<T>`             |
+/// | @ref cpl::rc   | No           | The `rc` exists                    | A non-atomic reference count     |
+/// | @ref cpl::rptr | Yes          | The `rptr` exists                  | A non-atomic reference count     |
 /// | @ref cpl::wptr | Yes          | Some `sptr` exists                 | `std::weak_ptr<T>`               |
 /// | @ref cpl::ref  | No           | One of the above holds the data    | `std::reference_wrapper`         |
 /// | @ref cpl::ptr  | Yes          | One of the above holds the data    | `T*`                             |
 ///
+/// The @ref cpl::rc and @ref cpl::rptr types are cheaper to copy than @ref
+/// cpl::sref and @ref cpl::sptr, since their reference count is not atomic.
+/// Hence they may only be used by the thread which created the value; in safe
+/// mode, this is verified. Similarly, a @ref cpl::bsref is biased towards the
+/// thread which created it from a `sref`, so copying it does not contend with
+/// other threads copying the same value.
+///
 /// ## Implementation
 ///
 /// The fast implementation has zero cost (assuming optimized compilation). In
@@ -229,6 +282,24 @@ SOFTWARE.
 /// least there's some comfort in knowing that `->` will always work to access
 /// the data members.
 ///
+/// ## Arrays
+///
+/// The @ref cpl::uref, @ref cpl::uptr and @ref cpl::sref types also have
+/// specializations for arrays (for example, `uref<T[]>`), which are created
+/// using `make_uref_array` and similar functions. These have a fixed size and
+/// no spare capacity, may be aligned to allow vectorization, may leave
+/// trivial elements uninitialized, and are bounds-checked in safe mode. They
+/// may be viewed using a @ref cpl::span.
+///
+/// ## Alignment
+///
+/// A @ref cpl::padded value occupies whole cache lines, which prevents false
+/// sharing between values used by different threads. More generally, @ref
+/// cpl::aligned values have any given alignment, and may be created using
+/// `make_uref_aligned` and `make_uptr_aligned`. The `make_sref_aligned` and
+/// `make_sptr_aligned` functions take the alignment at run-time. In safe
+/// mode, the lifetime of all these is tracked as usual.
+///
 /// ## Casting
 ///
 /// CPL provides @ref cpl::cast_static, @ref cpl::cast_dynamic, @ref
@@ -280,6 +351,100 @@ SOFTWARE.
 /// Using these types instead of the `std` types will provide additional checks
 /// in safe mode, detecting out-of-bounds and similar errors, while having zero
 /// impact on the fast mode.
+///
+/// The elements of a @ref cpl::vector may be borrowed using its `borrow`
+/// method. In safe mode, such borrows become invalid when the vector
+/// reallocates or moves its elements.
+///
+/// In addition, CPL provides @ref cpl::slot_map, a contiguous container whose
+/// values are accessed using stable handles. Using a stale handle is detected
+/// in safe mode.
+///
+/// A @ref cpl::soa_vector holds each field of its records in a separate
+/// column, which may be viewed as a @ref cpl::span.
+///
+/// The intrusive containers @ref cpl::intrusive_list and @ref
+/// cpl::intrusive_hash_set hold links inside their elements, so linking an
+/// element does not allocate anything. In safe mode, destroying an element
+/// while it is still linked is detected.
+///
+/// Finally, @ref cpl::dynamic_bitset is a bitset whose size is given at
+/// run-time, which (unlike `cpl::vector<bool>`) provides fast bulk operations.
+///
+/// ## Views
+///
+/// CPL provides @ref cpl::span for viewing a contiguous range of elements of
+/// some container. In fast mode this is just a raw pointer and a size. In safe
+/// mode the view is validated when it is created and whenever an iteration
+/// starts, but not on each element access, so that tight loops over the view
+/// remain tight.
+///
+/// Similarly, @ref cpl::string_view is a view of a sequence of characters
+/// (typically held in a @ref cpl::string) which, in safe mode, detects the
+/// viewed string was deleted or reallocated.
+///
+/// ## Concurrency
+///
+/// CPL provides @ref cpl::atomic_sptr and @ref cpl::atomic_sref for
+/// publishing shared values to many threads. Loading the value is lock-free,
+/// and returns a normal @ref cpl::sptr or @ref cpl::sref (which is tracked as
+/// usual in safe mode).
+///
+/// Lock-free data structures may hold their nodes using @ref cpl::uref, and
+/// use an @ref cpl::epoch_domain to defer deleting unlinked nodes until no
+/// reader (inside an @ref cpl::epoch_guard) may access them. In safe mode,
+/// using a node borrowed inside a guard after the guard ends is detected.
+/// Alternatively, a @ref cpl::hazard_domain bounds the memory held by
+/// retired nodes even when some readers stall, at the cost of publishing
+/// each accessed node in a @ref cpl::hazard_ptr.
+///
+/// For read-mostly values, @ref cpl::rcu provides read-copy-update on top of
+/// an epoch domain: reading the current version is just an atomic load, and
+/// updating it publishes a modified copy.
+///
+/// A @ref cpl::channel moves @ref cpl::uref values between threads without
+/// locking. In safe mode, sending a value revokes its borrows, so the sender
+/// can't keep using it. A @ref cpl::spsc_ring is faster when there is a
+/// single producer and a single consumer, and allows moving values in
+/// batches; safe mode verifies there is indeed only one of each.
+///
+/// A @ref cpl::concurrent_map divides its entries between shards with
+/// separate locks. Its lookups return a guard holding the shard lock, which
+/// allows borrowing the value; in safe mode, these borrows expire when the
+/// guard is released.
+///
+/// A @ref cpl::cell checks, in safe mode, that its value is either read by any
+/// number of `read` guards or modified by a single `write` guard, which
+/// detects unexpected aliasing and data races. In fast mode, it is just the
+/// value.
+///
+/// A @ref cpl::seqlock holds a small value which is written by one thread and
+/// read by many, where readers copy the value optimistically (retrying if it
+/// was concurrently modified) without writing to any shared memory.
+///
+/// A @ref cpl::sharded value has a separate instance for each thread, which
+/// may be combined (for example, to sum statistics counters). In safe mode,
+/// using the instance of one thread from another is detected.
+///
+/// A @ref cpl::thread_pool executes tasks using work stealing. Tasks may own
+/// their input using a @ref cpl::uref, and return their result (typically,
+/// also a `uref`) through a `std::future`.
+///
+/// The algorithms in @ref cpl::parallel (`for_each`, `transform`, `reduce`
+/// and `sort`) process a @ref cpl::span or a @ref cpl::vector in chunks of
+/// whole cache lines using a thread pool. In safe mode, each chunk may only
+/// access its own elements, and modifying the container during the algorithm
+/// is detected.
+///
+/// Handing a @ref cpl::uref to @ref cpl::defer_destroy (or to a @ref
+/// cpl::reclaimer) destroys the value on a background thread, so that a large
+/// destructor cascade doesn't stall the current thread. In safe mode, its
+/// borrows become invalid immediately.
+///
+/// When compiled with C++20 coroutine support, a @ref cpl::task is a lazy
+/// coroutine whose frame may be allocated from a @ref cpl::frame_arena. In
+/// safe mode, resuming a task holding a borrow whose target was deleted while
+/// the task was suspended is detected.
 namespace cpl {
   template <typename T> class sref;
   template <typename T> class uref;
@@ -796,6 +961,16 @@ namespace cpl {
     }
 #endif // } CPL_SAFE
 
+    /// Invalidate all the borrows of the value.
+    ///
+    /// This is used when transferring ownership of the value to a different
+    /// thread, so that (in safe mode) the old owner can't keep using it.
+    inline void revoke() {
+#ifdef CPL_SAFE // {
+      m_shared_ptr.reset(std::unique_ptr<T>::get(), no_delete<T>());
+#endif // } CPL_SAFE
+    }
+
     /// Track swap of the indirection.
     inline void swap(unique<T>& other) {
       std::unique_ptr<T>::swap(other);
@@ -930,687 +1105,7010 @@ namespace cpl {
     }
   };
 
-  /// An indirection for data whose lifetime is determined elsewhere.
-  template <typename T> class borrow {
-    template <typename U> friend class borrow;
+  /// Allocate storage whose start is aligned to `alignment`.
+  ///
+  /// The alignment must be a power of two. The storage must be freed using
+  /// @ref cpl::free_aligned.
+  inline void* allocate_aligned(size_t size, size_t alignment) {
+    CPL_ASSERT(alignment > 0 && (alignment & (alignment - 1)) == 0, "allocating with an invalid alignment");
+    size_t overhead = alignment - 1 + sizeof(void*);
+    if (size > size_t(-1) - overhead) {
+      throw std::bad_alloc();
+    }
+    void* storage = ::operator new(size + overhead);
+    uintptr_t address = (reinterpret_cast<uintptr_t>(storage) + sizeof(void*) + alignment - 1) & ~uintptr_t(alignment - 1);
+    reinterpret_cast<void**>(address)[-1] = storage;
+    return reinterpret_cast<void*>(address);
+  }
 
-  protected:
-#ifdef CPL_FAST // {
-    /// The raw pointer to the value.
-    T* m_raw_ptr;
-#endif          // } CPL_FAST
-#ifdef CPL_SAFE // {
-    /// If we hold a pointer created by `unsafe_ref` or `unsafe_ptr`, then
-    /// this will provide a lifetime to `m_weak_ptr`.
-    std::shared_ptr<T> m_unsafe_ptr;
+  /// Free storage allocated by @ref cpl::allocate_aligned.
+  inline void free_aligned(void* data) {
+    if (data) {
+      ::operator delete(reinterpret_cast<void**>(data)[-1]);
+    }
+  }
 
-    /// A weak pointer to the track the lifetime of the data.
-    std::weak_ptr<T> m_weak_ptr;
-#endif // } CPL_SAFE
+  /// Destroy a value and free its aligned storage.
+  template <typename T> struct aligned_deleter {
+    /// Default constructor.
+    inline aligned_deleter() = default;
+
+    /// Copy constructor.
+    template <typename U> inline aligned_deleter(const aligned_deleter<U>&) {
+    }
+
+    /// Destroy the value and free its storage.
+    inline void operator()(T* data) const {
+      data->~T();
+      free_aligned(data);
+    }
+  };
+
+  /// A value which is placed at some alignment, and occupies a multiple of it.
+  ///
+  /// This overrides `operator new` and `operator delete`, so a `uref<aligned<T,
+  /// A>>` (or an array of such values) is properly aligned even though C++14
+  /// `new` ignores alignments larger than that of `std::max_align_t`.
+  ///
+  /// Containers do not use these operators, so a container of aligned values
+  /// must use an @ref cpl::aligned_allocator (e.g., `cpl::vector<aligned<T,
+  /// A>, aligned_allocator<aligned<T, A>>>`) to actually be aligned.
+  template <typename T, size_t A> class alignas(A) aligned {
+    /// The aligned value.
+    T m_value;
+
+    /// Whether the constructor arguments are another aligned value.
+    template <typename... Args> struct is_aligned : std::false_type {};
+
+    /// Whether the constructor arguments are another aligned value.
+    template <typename Arg> struct is_aligned<Arg> : std::is_same<typename std::decay<Arg>::type, aligned> {};
 
   public:
-    /// Provide convenient access to the type of the data.
-    typedef T element_type;
+    /// Construct the value.
+    template <typename... Args, typename = typename std::enable_if<!is_aligned<Args...>::value>::type>
+    inline aligned(Args&&... args) : m_value(std::forward<Args>(args)...) {
+    }
 
-    /// Unsafe construction from a raw pointer.
-    inline borrow(T* raw_ptr, unsafe_raw_t)
-      :
-#ifdef CPL_FAST // {
-        m_raw_ptr(raw_ptr)
-#endif          // } CPL_FAST
-#ifdef CPL_SAFE // {
-        m_unsafe_ptr(raw_ptr, no_delete<T>()),
-        m_weak_ptr(m_unsafe_ptr)
-#endif // } CPL_SAFE
-    {
+    /// Access the value.
+    inline T& get() {
+      return m_value;
     }
 
-    /// Cast construction from a different type of borrow.
-    template <typename U, typename C>
-    inline borrow(borrow<U> other, C cast_type)
-      :
-#ifdef CPL_FAST // {
-        m_raw_ptr(cast_raw_ptr<T>(other.m_raw_ptr, cast_type))
-#endif          // } CPL_FAST
-#ifdef CPL_SAFE // {
-        m_unsafe_ptr(cast_shared_ptr<T, U>(other.m_unsafe_ptr, cast_type)),
-        m_weak_ptr(cast_weak_ptr(m_unsafe_ptr, other.m_weak_ptr, cast_type))
-#endif // } CPL_SAFE
-    {
+    /// Access the value.
+    inline const T& get() const {
+      return m_value;
     }
 
-    /// Copy a borrow.
-    template <typename U, typename = typename std::enable_if<std::is_convertible<U*, T*>::value>::type>
-    inline borrow(const borrow<U>& other)
-      :
-#ifdef CPL_FAST // {
-        m_raw_ptr(other.m_raw_ptr)
-#endif          // } CPL_FAST
-#ifdef CPL_SAFE // {
-        m_unsafe_ptr(other.m_unsafe_ptr ? std::shared_ptr<T>(other.m_unsafe_ptr.get(), no_delete<T>())
-                                        : std::shared_ptr<T>(nullptr)),
-        m_weak_ptr(m_unsafe_ptr ? m_unsafe_ptr : other.m_weak_ptr.lock())
-#endif // } CPL_SAFE
-    {
+    /// Access the value.
+    inline T& operator*() {
+      return m_value;
     }
 
-    /// Move a borrow.
-    template <typename U, typename = typename std::enable_if<std::is_convertible<U*, T*>::value>::type>
-    inline borrow& operator=(borrow<U>&& other) {
-#ifdef CPL_FAST // {
-      m_raw_ptr = other.m_raw_ptr;
-      other.m_raw_ptr = nullptr;
-#endif          // } CPL_FAST
-#ifdef CPL_SAFE // {
-      m_unsafe_ptr = std::move(other.m_unsafe_ptr);
-      m_weak_ptr = std::move(other.m_weak_ptr);
-#endif // } CPL_SAFE
-      return *this;
+    /// Access the value.
+    inline const T& operator*() const {
+      return m_value;
     }
 
-    /// Construction from a held value.
-    template <typename U, typename = typename std::enable_if<std::is_convertible<U*, T*>::value>::type>
-    inline borrow(is<U>& other)
-      :
-#ifdef CPL_FAST // {
-        m_raw_ptr((T*)&other)
-#endif          // } CPL_FAST
-#ifdef CPL_SAFE // {
-        m_unsafe_ptr(),
-        m_weak_ptr(other.m_shared_ptr)
-#endif // } CPL_SAFE
-    {
+    /// Access a data member.
+    inline T* operator->() {
+      return &m_value;
     }
 
-    /// Construction from a held value.
-    template <typename U, typename = typename std::enable_if<std::is_const<T>::value && std::is_convertible<U*, T*>::value>::type>
-    inline borrow(const is<U>& other)
-      : borrow(*const_cast<is<U>*>(&other)) {
+    /// Access a data member.
+    inline const T* operator->() const {
+      return &m_value;
     }
 
-    /// Construction from an optional value.
-    template <typename U, typename = typename std::enable_if<std::is_convertible<U*, T*>::value>::type>
-    inline borrow(opt<U>& other)
-      :
-#ifdef CPL_FAST // {
-        m_raw_ptr((T*)&other)
-#endif          // } CPL_FAST
-#ifdef CPL_SAFE // {
-        m_unsafe_ptr(),
-        m_weak_ptr(other.m_shared_ptr)
-#endif // } CPL_SAFE
-    {
+    /// Allocate aligned storage.
+    static inline void* operator new(size_t size) {
+      return allocate_aligned(size, A);
     }
 
-    /// Construction from a held value.
-    template <typename U, typename = typename std::enable_if<std::is_const<T>::value && std::is_convertible<U*, T*>::value>::type>
-    inline borrow(const opt<U>& other)
-      : borrow(*const_cast<opt<U>*>(&other)) {
+    /// Free aligned storage.
+    static inline void operator delete(void* data) {
+      free_aligned(data);
     }
 
-    /// Construction from a shared indirection.
-    template <typename U, typename = typename std::enable_if<std::is_convertible<U*, T*>::value>::type>
-    inline borrow(const shared<U>& other)
-      :
-#ifdef CPL_FAST // {
-        m_raw_ptr(other.get())
-#endif          // } CPL_FAST
+    /// Allocate aligned storage.
+    static inline void* operator new[](size_t size) {
+      return allocate_aligned(size, A);
+    }
+
+    /// Free aligned storage.
+    static inline void operator delete[](void* data) {
+      free_aligned(data);
+    }
+  };
+
+  /// A value which occupies whole cache lines.
+  ///
+  /// This prevents false sharing between per-thread values (counters, queue
+  /// indices, etc.) placed next to each other.
+  template <typename T> using padded = aligned<T, CPL_CACHE_LINE_SIZE>;
+
+  /// An allocator which respects the alignment of the allocated type.
+  ///
+  /// In C++14, `std::allocator` ignores alignments larger than that of
+  /// `std::max_align_t`, so containers of over-aligned values (such as @ref
+  /// cpl::padded) need this allocator to actually be aligned.
+  template <typename T> struct aligned_allocator {
+    /// The type of the allocated values.
+    typedef T value_type;
+
+    /// Default constructor.
+    inline aligned_allocator() = default;
+
+    /// Copy constructor.
+    template <typename U> inline aligned_allocator(const aligned_allocator<U>&) {
+    }
+
+    /// Allocate aligned storage for some values.
+    inline T* allocate(size_t size) {
+      if (size > size_t(-1) / sizeof(T)) {
+        throw std::bad_array_new_length();
+      }
+      return static_cast<T*>(allocate_aligned(size * sizeof(T), alignof(T)));
+    }
+
+    /// Free aligned storage.
+    inline void deallocate(T* data, size_t) {
+      free_aligned(data);
+    }
+
+    /// All aligned allocators are interchangeable.
+    template <typename U> inline bool operator==(const aligned_allocator<U>&) const {
+      return true;
+    }
+
+    /// All aligned allocators are interchangeable.
+    template <typename U> inline bool operator!=(const aligned_allocator<U>&) const {
+      return false;
+    }
+  };
+
+  /// Destroy the elements of an array and free its storage.
+  ///
+  /// This is used by the array specializations of @ref cpl::unique and @ref
+  /// cpl::shared, which allocate the storage themselves so they may align it.
+  template <typename T> struct array_deleter {
+    /// The allocated storage (which may start before the first element).
+    void* storage = nullptr;
+
+    /// The number of elements.
+    size_t size = 0;
+
+    /// Destroy the elements (in reverse order) and free the storage.
+    inline void operator()(T* data) const {
+      for (size_t index = size; index > 0; --index) {
+        data[index - 1].~T();
+      }
+      ::operator delete(storage);
+    }
+  };
+
+  /// Allocate an array of elements.
+  ///
+  /// The elements are value-initialized if `initialize` is true, and
+  /// default-initialized otherwise (which leaves trivial elements
+  /// uninitialized). The first element is aligned to `alignment`, which must
+  /// be a power of two.
+  template <typename T> inline T* allocate_array(size_t size, size_t alignment, bool initialize, array_deleter<T>& deleter) {
+    CPL_ASSERT(alignment >= alignof(T) && (alignment & (alignment - 1)) == 0, "allocating an array with an invalid alignment");
+    size_t padding = alignment > alignof(std::max_align_t) ? alignment - 1 : 0;
+    if (size > (size_t(-1) - padding) / sizeof(T)) {
+      throw std::bad_array_new_length();
+    }
+    deleter.storage = ::operator new(size * sizeof(T) + padding);
+    T* data = reinterpret_cast<T*>((reinterpret_cast<uintptr_t>(deleter.storage) + padding) & ~uintptr_t(padding));
+    try {
+      for (deleter.size = 0; deleter.size < size; ++deleter.size) {
+        if (initialize) {
+          new (data + deleter.size) T();
+        } else {
+          new (data + deleter.size) T;
+        }
+      }
+    } catch (...) {
+      deleter(data);
+      throw;
+    }
+    return data;
+  }
+
+  /// An indirection that deletes an array of elements when it is deleted.
+  ///
+  /// Unlike a @ref cpl::vector, the array has a fixed size and no spare
+  /// capacity. Accessing an element by its index is bounds-checked in safe
+  /// mode.
+  template <typename T> class unique<T[]> : public std::unique_ptr<T[], array_deleter<T>> {
+    template <typename U> friend class shared;
+    template <typename U> friend class span;
+
 #ifdef CPL_SAFE // {
-        m_unsafe_ptr(),
-        m_weak_ptr(other)
+  protected:
+    /// Track the lifetime of the elements.
+    std::shared_ptr<T> m_shared_ptr;
 #endif // } CPL_SAFE
-    {
-    }
 
-    /// Construction from a unique indirection.
-    template <typename U, typename = typename std::enable_if<std::is_convertible<U*, T*>::value>::type>
-    inline borrow(const unique<U>& other)
-      :
-#ifdef CPL_FAST // {
-        m_raw_ptr(other.get())
-#endif          // } CPL_FAST
+  public:
+    /// Unsafe construction from a raw pointer to an allocated array.
+    inline unique(T* raw_ptr, const array_deleter<T>& deleter, unsafe_raw_t)
+      : std::unique_ptr<T[], array_deleter<T>>(raw_ptr, deleter)
 #ifdef CPL_SAFE // {
-        m_unsafe_ptr(),
-        m_weak_ptr(other.m_shared_ptr)
+        ,
+        m_shared_ptr(raw_ptr, no_delete<T>())
 #endif // } CPL_SAFE
     {
     }
 
-    /// Access the raw pointer.
-    ///
-    /// In safe mode, this isn't as safe as we'd like it to be, since another
-    /// thread may delete the value between the time we `return` and the time
-    /// the caller uses the value.
-    inline T* get() const {
-#ifdef CPL_FAST // {
-      return m_raw_ptr;
-#endif          // } CPL_FAST
+    /// Forbid copy construction.
+    inline unique(const unique<T[]>&) = delete;
+
+    /// Take ownership from another unique array.
+    inline unique(unique<T[]>&& other) = default;
+
+    /// Take ownership from another unique array.
+    inline unique<T[]>& operator=(unique<T[]>&& other) = default;
+
+    /// Track swap of the indirection.
+    inline void swap(unique<T[]>& other) {
+      std::unique_ptr<T[], array_deleter<T>>::swap(other);
 #ifdef CPL_SAFE // {
-      return m_weak_ptr.lock().get();
+      m_shared_ptr.swap(other.m_shared_ptr);
 #endif // } CPL_SAFE
     }
 
-    /// Access the value.
-    inline T& operator*() const {
-#ifdef CPL_FAST // {
-      return *get();
-#endif          // } CPL_FAST
+    /// Delete the elements, invalidating their borrows.
+    inline void reset() {
+      std::unique_ptr<T[], array_deleter<T>>::reset();
+      this->get_deleter() = array_deleter<T>();
 #ifdef CPL_SAFE // {
-      T* raw_ptr = get();
-      CPL_ASSERT(raw_ptr, "dereferencing a null borrow");
-      return *raw_ptr;
+      m_shared_ptr.reset();
 #endif // } CPL_SAFE
     }
 
-    /// Access a data member.
-    inline T* operator->() const {
-#ifdef CPL_FAST // {
-      return get();
-#endif          // } CPL_FAST
-#ifdef CPL_SAFE // {
-      T* raw_ptr = get();
-      CPL_ASSERT(raw_ptr, "dereferencing a null borrow");
-      return raw_ptr;
-#endif // } CPL_SAFE
+    /// Forbid adopting a raw array (which would not match the deleter).
+    template <typename U> void reset(U* raw_ptr) = delete;
+
+    /// Forbid releasing the raw array (which can't be freed correctly).
+    T* release() = delete;
+
+    /// The number of elements.
+    inline size_t size() const {
+      return std::unique_ptr<T[], array_deleter<T>>::get() ? this->get_deleter().size : 0;
     }
-  };
 
-/// Compare borrowed indirections.
-#define CPL_COMPARE_BORROW(OPERATOR)                                                                                     \
-  template <typename T, typename U> inline bool operator OPERATOR(const borrow<T>& lhs, const borrow<U>& rhs) noexcept { \
-    return lhs.get() OPERATOR rhs.get();                                                                                 \
-  }                                                                                                                      \
-  template <typename T, typename U> inline bool operator OPERATOR(const borrow<T>& lhs, U* rhs) noexcept {               \
-    return lhs.get() OPERATOR rhs;                                                                                       \
-  }                                                                                                                      \
-  template <typename T, typename U> inline bool operator OPERATOR(T* lhs, const borrow<U>& rhs) noexcept {               \
-    return lhs OPERATOR rhs.get();                                                                                       \
-  }                                                                                                                      \
-  template <typename T> inline bool operator OPERATOR(const borrow<T>& lhs, std::nullptr_t) noexcept {                   \
-    return lhs.get() OPERATOR nullptr;                                                                                   \
-  }                                                                                                                      \
-  template <typename T> inline bool operator OPERATOR(std::nullptr_t, const borrow<T>& rhs) noexcept {                   \
-    return nullptr OPERATOR rhs.get();                                                                                   \
-  }
+    /// Access the elements.
+    inline T* data() const {
+      return std::unique_ptr<T[], array_deleter<T>>::get();
+    }
 
-  CPL_COMPARE_BORROW(> )
-  CPL_COMPARE_BORROW(< )
-  CPL_COMPARE_BORROW(>= )
-  CPL_COMPARE_BORROW(== )
-  CPL_COMPARE_BORROW(!= )
-  CPL_COMPARE_BORROW(<= )
+    /// Access an element.
+    inline T& operator[](size_t index) const {
+      CPL_ASSERT(index < size(), "accessing an array element out of bounds");
+      return data()[index];
+    }
 
-  // Forward declare for the `ref` method.
-  template <typename T> class ref;
+    /// Start iterating on the elements.
+    inline T* begin() const {
+      return data();
+    }
 
-  /// A pointer for data whose lifetime is determined elsewhere.
-  template <typename T> class ptr : public borrow<T> {
-    using borrow<T>::borrow;
+    /// Stop iterating on the elements.
+    inline T* end() const {
+      return data() + size();
+    }
+  };
+
+  /// A pointer that deletes an array of elements when it is deleted.
+  template <typename T> class uptr<T[]> : public unique<T[]> {
+    using unique<T[]>::unique;
 
   public:
-    /// Deterministic null default constructor.
-    ///
-    /// This is slower from the `T*` default constructor, for sanity.
-    inline ptr() : borrow<T>(nullptr, unsafe_raw_t(0)) {
+    /// Null default constructor.
+    inline uptr() : unique<T[]>(nullptr, array_deleter<T>(), unsafe_raw_t(0)) {
     }
 
     /// Explicit null constructor.
-    inline ptr(std::nullptr_t) : ptr() {
-    }
-
-    /// Test whether the pointer is not null.
-    inline operator bool() const {
-      return !!borrow<T>::get();
+    inline uptr(std::nullptr_t) : uptr() {
     }
 
-    /// Provide a reference to the value (which must exist).
-    inline ::cpl::ref<T> ref() const {
-      return ::cpl::ref<T>(*this);
+    /// Take ownership from another unique array.
+    inline uptr(unique<T[]>&& other) : unique<T[]>(std::move(other)) {
     }
 
-    /// Access the current value or, if empty, a default value.
-    inline ::cpl::ref<T> ref_or(const ::cpl::ref<T>& if_empty) const {
-      return *this ? ref() : if_empty;
+    /// Take ownership from another unique array.
+    inline uptr& operator=(unique<T[]>&& other) {
+      unique<T[]>::operator=(std::move(other));
+      return *this;
     }
   };
 
-  /// A reference for data whose lifetime is determined elsewhere.
-  template <typename T> class ref : public borrow<T> {
+  /// A reference that deletes an array of elements when it is deleted.
+  template <typename T> class uref<T[]> : public unique<T[]> {
   public:
-    /// Unsafe construction from a raw pointer.
-    inline ref(T* raw_ptr, unsafe_raw_t) : borrow<T>(raw_ptr, unsafe_raw_t(0)) {
-      CPL_ASSERT(borrow<T>::m_weak_ptr.lock().get(), "constructing a null reference");
+    /// Unsafe construction from a raw pointer to an allocated array.
+    inline uref(T* raw_ptr, const array_deleter<T>& deleter, unsafe_raw_t)
+      : unique<T[]>(raw_ptr, deleter, unsafe_raw_t(0)) {
+      CPL_ASSERT(unique<T[]>::get(), "constructing a null reference");
     }
 
-    /// Cast construction from a different type of borrow.
-    template <typename U, typename C> inline ref(const borrow<U>& other, C cast_type) : borrow<T>(other, cast_type) {
-      CPL_ASSERT(borrow<T>::m_weak_ptr.lock().get(), "constructing a null reference");
+    /// Take ownership from another unique array reference.
+    inline uref(uref<T[]>&& other) : unique<T[]>(std::move(other)) {
+      CPL_ASSERT(unique<T[]>::get(), "constructing a null reference");
     }
 
-    /// Copy a reference.
-    template <typename U, typename = typename std::enable_if<std::is_convertible<U*, T*>::value>::type>
-    inline ref(const ref<U>& other)
-      : borrow<T>(other) {
-      CPL_ASSERT(borrow<T>::m_weak_ptr.lock().get(), "constructing a null reference");
+    /// Take ownership from another unique array reference.
+    inline uref& operator=(uref<T[]>&& other) {
+      unique<T[]>::operator=(std::move(other));
+      CPL_ASSERT(unique<T[]>::get(), "assigning a null reference");
+      return *this;
     }
 
-    /// Copy a pointer.
-    template <typename U, typename = typename std::enable_if<std::is_convertible<U*, T*>::value>::type>
-    explicit inline ref(const ptr<U>& other)
-      : borrow<T>(other) {
-      CPL_ASSERT(borrow<T>::m_weak_ptr.lock().get(), "constructing a null reference");
+    /// Take ownership from a unique array pointer.
+    explicit inline uref(uptr<T[]>&& other) : unique<T[]>(std::move(other)) {
+      CPL_ASSERT(unique<T[]>::get(), "constructing a null reference");
     }
 
-    /// Construct from a held value.
-    template <typename U, typename = typename std::enable_if<std::is_convertible<U*, T*>::value>::type>
-    inline ref(is<U>& other)
-      : borrow<T>(other) {
-    }
+    /// Forbid testing for null.
+    operator bool() const = delete;
 
-    /// Construct from a held value.
-    template <typename U, typename = typename std::enable_if<std::is_const<T>::value && std::is_convertible<U*, T*>::value>::type>
-    inline ref(const is<U>& other)
-      : borrow<T>(*const_cast<is<U>*>(&other)) {
-    }
+    /// Forbid clearing the reference.
+    void reset() = delete;
+  };
 
-    /// Construct from an optional value.
-    template <typename U, typename = typename std::enable_if<std::is_convertible<U*, T*>::value>::type>
-    explicit inline ref(opt<U>& other)
-      : borrow<T>(other) {
-      CPL_ASSERT(borrow<T>::m_weak_ptr.lock().get(), "constructing a null reference");
+  /// An indirection that uses reference counting for an array of elements.
+  ///
+  /// Accessing an element by its index is bounds-checked in safe mode.
+  template <typename T> class shared<T[]> : public std::shared_ptr<T> {
+    /// The number of elements.
+    size_t m_size;
+
+  public:
+    /// Unsafe construction from a raw pointer to an allocated array.
+    inline shared(T* raw_ptr, const array_deleter<T>& deleter, unsafe_raw_t)
+      : std::shared_ptr<T>(raw_ptr, deleter), m_size(raw_ptr ? deleter.size : 0) {
     }
 
-    /// Construct from an optional value.
-    template <typename U, typename = typename std::enable_if<std::is_const<T>::value && std::is_convertible<U*, T*>::value>::type>
-    inline ref(const opt<U>& other)
-      : borrow<T>(*const_cast<opt<U>*>(&other)) {
+    /// Take ownership from a unique array.
+    inline shared(unique<T[]>&& other)
+      : std::shared_ptr<T>(other.std::unique_ptr<T[], array_deleter<T>>::release(), other.get_deleter()),
+        m_size(std::shared_ptr<T>::get() ? std::get_deleter<array_deleter<T>>(*this)->size : 0) {
+#ifdef CPL_SAFE // {
+      other.m_shared_ptr.reset();
+#endif // } CPL_SAFE
     }
 
-    /// Copy a shared reference.
-    template <typename U, typename = typename std::enable_if<std::is_convertible<U*, T*>::value>::type>
-    inline ref(const sref<U>& other)
-      : borrow<T>(other) {
-      CPL_ASSERT(borrow<T>::m_weak_ptr.lock().get(), "constructing a null reference");
+    /// The number of elements.
+    inline size_t size() const {
+      return m_size;
     }
 
-    /// Copy a shared pointer.
-    template <typename U, typename = typename std::enable_if<std::is_convertible<U*, T*>::value>::type>
-    explicit inline ref(const sptr<U>& other)
-      : borrow<T>(other) {
-      CPL_ASSERT(borrow<T>::m_weak_ptr.lock().get(), "constructing a null reference");
+    /// Access the elements.
+    inline T* data() const {
+      return std::shared_ptr<T>::get();
     }
 
-    /// Copy a unique reference.
-    template <typename U, typename = typename std::enable_if<std::is_convertible<U*, T*>::value>::type>
-    inline ref(const uref<U>& other)
-      : borrow<T>(other) {
-      CPL_ASSERT(borrow<T>::m_weak_ptr.lock().get(), "constructing a null reference");
+    /// Access an element.
+    inline T& operator[](size_t index) const {
+      CPL_ASSERT(index < m_size, "accessing an array element out of bounds");
+      return data()[index];
     }
 
-    /// Copy a unique pointer.
-    template <typename U, typename = typename std::enable_if<std::is_convertible<U*, T*>::value>::type>
-    explicit inline ref(const uptr<U>& other)
-      : borrow<T>(other) {
-      CPL_ASSERT(borrow<T>::m_weak_ptr.lock().get(), "constructing a null reference");
+    /// Start iterating on the elements.
+    inline T* begin() const {
+      return data();
     }
 
-    /// Access the value.
-    inline operator T&() const {
-      return *borrow<T>::get();
+    /// Stop iterating on the elements.
+    inline T* end() const {
+      return data() + m_size;
     }
-  };
 
-  /// @file
-  /// Implement the unsafe creation of pointers and references.inters and
-  /// references.
+    /// Forbid access as a single value.
+    T& operator*() const = delete;
 
-  /// Create some value owned by a shared reference.
-  template <typename T, typename... Args> inline sref<T> make_sref(Args&&... args) {
-    return sref<T>{ new T(std::forward<Args>(args)...), unsafe_raw_t(0) };
-  }
+    /// Forbid access as a single value.
+    T* operator->() const = delete;
+  };
 
-  /// Create some value owned by a shared pointer.
-  template <typename T, typename... Args> inline sptr<T> make_sptr(Args&&... args) {
-    return sptr<T>{ new T(std::forward<Args>(args)...), unsafe_raw_t(0) };
-  }
+  /// A reference that uses reference counting for an array of elements.
+  template <typename T> class sref<T[]> : public shared<T[]> {
+  public:
+    /// Unsafe construction from a raw pointer to an allocated array.
+    inline sref(T* raw_ptr, const array_deleter<T>& deleter, unsafe_raw_t)
+      : shared<T[]>(raw_ptr, deleter, unsafe_raw_t(0)) {
+      CPL_ASSERT(shared<T[]>::get(), "constructing a null reference");
+    }
 
-  /// Create some value owned by a unique reference.
-  template <typename T, typename... Args> inline uref<T> make_uref(Args&&... args) {
-    return uref<T>{ new T(std::forward<Args>(args)...), unsafe_raw_t(0) };
-  }
+    /// Take ownership from a unique array reference.
+    inline sref(uref<T[]>&& other) : shared<T[]>(std::move(other)) {
+    }
 
-  /// Create some value owned by a unique pointer.
-  template <typename T, typename... Args> inline uptr<T> make_uptr(Args&&... args) {
-    return uptr<T>{ new T(std::forward<Args>(args)...), unsafe_raw_t(0) };
-  }
+    /// Forbid testing for null.
+    explicit operator bool() const = delete;
 
-  /// Create an unsafe reference to raw data.
-  ///
-  /// This is playing with fire. It is OK if the data is static, but there's
-  /// no way to ask the compiler to ensure that.
-  template <typename T> inline ref<T> unsafe_ref(T& data) {
-    return ref<T>{ &data, unsafe_raw_t(0) };
-  }
+    /// Forbid clearing the reference.
+    void reset() = delete;
+  };
 
-  /// Create an unsafe pointer to raw data.
+  /// The control block of a @ref cpl::counted indirection.
   ///
-  /// This is playing with fire. It is OK if the data is static, but there's
-  /// no way to ask the compiler to ensure that.
-  template <typename T> inline ptr<T> unsafe_ptr(T& data) {
-    return ptr<T>{ &data, unsafe_raw_t(0) };
-  }
+  /// The count is a plain (non-atomic) integer, so all the indirections
+  /// sharing a value must be used by the same thread. In safe mode, this is
+  /// verified whenever the count is changed or the value is accessed.
+  struct rc_control {
+    /// The number of indirections sharing the value.
+    size_t m_count;
+
+    /// Destroy the value and free the block.
+    void (*m_destroy)(rc_control*);
 
-  /// A clever cast between reference types.
-  ///
-  /// In safe mode, this verifies that the raw pointer value did not change,
-  /// which will always be true unless you use virtual base classes.
-  template <typename T, typename U> inline sref<T> cast_clever(const sref<U>& from_ref) {
 #ifdef CPL_SAFE // {
-    U* from_raw = const_cast<U*>(from_ref.get());
-    T* to_dynamic = dynamic_cast<T*>(from_raw);
-    T* to_raw = static_cast<T*>(from_raw);
-    CPL_ASSERT(to_dynamic == to_raw, "clever cast gave the wrong result");
+    /// The thread owning the value.
+    std::thread::id m_thread;
+
+    /// Track the lifetime of the value for borrows.
+    std::shared_ptr<void> m_lifetime;
 #endif // } CPL_SAFE
-    return sref<T>{ from_ref, unsafe_static_t(0) };
-  }
 
-  /// A clever cast between pointer types.
-  ///
-  /// In safe mode, this verifies that the raw pointer value did not change,
-  /// which will always be true unless you use virtual base classes.
-  template <typename T, typename U> inline sptr<T> cast_clever(const sptr<U>& from_ptr) {
+    /// A control block for a value used by a single indirection.
+    inline explicit rc_control(void (*destroy)(rc_control*))
+      : m_count(1), m_destroy(destroy)
 #ifdef CPL_SAFE // {
-    U* from_raw = from_ptr.get();
-    T* to_dynamic = dynamic_cast<T*>(from_raw);
-    T* to_raw = static_cast<T*>(from_raw);
-    CPL_ASSERT(to_dynamic == to_raw, "clever cast gave the wrong result");
+        ,
+        m_thread(std::this_thread::get_id())
 #endif // } CPL_SAFE
-    return sptr<T>{ from_ptr, unsafe_static_t(0) };
-  }
+    {
+    }
 
-  /// A clever cast between pointer types.
-  ///
-  /// In safe mode, this verifies that the raw pointer value did not change,
-  /// which will always be true unless you use virtual base classes.
-  template <typename T, typename U> inline wptr<T> cast_clever(const wptr<U>& from_ptr) {
+    /// Verify the value is accessed by its owning thread.
+    inline void verify_thread() const {
 #ifdef CPL_SAFE // {
-    U* from_raw = from_ptr.lock().get();
-    T* to_dynamic = dynamic_cast<T*>(from_raw);
-    T* to_raw = static_cast<T*>(from_raw);
-    CPL_ASSERT(to_dynamic == to_raw, "clever cast gave the wrong result");
+      CPL_ASSERT(m_thread == std::this_thread::get_id(), "accessing a reference counted value from a different thread");
 #endif // } CPL_SAFE
-    return wptr<T>{ from_ptr, unsafe_static_t(0) };
-  }
+    }
 
-  /// A clever cast between reference types.
-  ///
-  /// In safe mode, this verifies that the raw pointer value did not change,
-  /// which will always be true unless you use virtual base classes.
-  template <typename T, typename U> inline uref<T> cast_clever(uref<U>&& from_ref) {
+    /// Share the value with one more indirection.
+    inline void acquire() {
+      verify_thread();
+      ++m_count;
+    }
+
+    /// Stop sharing the value with one indirection, destroying it if this was
+    /// the last one.
+    inline void release() {
+      verify_thread();
+      if (--m_count == 0) {
 #ifdef CPL_SAFE // {
-    U* from_raw = from_ref.get();
-    T* to_dynamic = dynamic_cast<T*>(from_raw);
-    T* to_raw = static_cast<T*>(from_raw);
-    CPL_ASSERT(to_dynamic == to_raw, "clever cast gave the wrong result");
+        m_lifetime.reset();
 #endif // } CPL_SAFE
-    return uref<T>{ std::move(from_ref), unsafe_static_t(0) };
-  }
+        m_destroy(this);
+      }
+    }
+  };
 
-  /// A clever cast between pointer types.
-  ///
-  /// In safe mode, this verifies that the raw pointer value did not change,
-  /// which will always be true unless you use virtual base classes.
-  template <typename T, typename U> inline uptr<T> cast_clever(uptr<U>&& from_ptr) {
+  /// A control block holding the value itself (allocated together).
+  template <typename T> struct rc_block : rc_control {
+    /// The shared value.
+    T m_value;
+
+    /// Construct the value in place.
+    template <typename... Args>
+    inline explicit rc_block(Args&&... args) : rc_control(&rc_block::destroy), m_value(std::forward<Args>(args)...) {
 #ifdef CPL_SAFE // {
-    U* from_raw = from_ptr.get();
-    T* to_dynamic = dynamic_cast<T*>(from_raw);
-    T* to_raw = static_cast<T*>(from_raw);
-    CPL_ASSERT(to_dynamic == to_raw, "clever cast gave the wrong result");
+      m_lifetime = std::shared_ptr<T>(&m_value, no_delete<T>());
 #endif // } CPL_SAFE
-    return uptr<T>{ std::move(from_ptr), unsafe_static_t(0) };
-  }
+    }
 
-  /// A clever cast between reference types.
-  ///
-  /// In safe mode, this verifies that the raw pointer value did not change,
-  /// which will always be true unless you use virtual base classes.
-  template <typename T, typename U> inline ref<T> cast_clever(const ref<U>& from_ref) {
+    /// Destroy a block.
+    static inline void destroy(rc_control* control) {
+      delete static_cast<rc_block*>(control);
+    }
+  };
+
+  /// A control block holding a count of a value owned by a @ref cpl::shared
+  /// indirection.
+  struct rc_shared_block : rc_control {
+    /// The count of the value.
+    std::shared_ptr<const void> m_shared;
+
+    /// Hold a count of a value.
+    inline explicit rc_shared_block(std::shared_ptr<const void> shared)
+      : rc_control(&rc_shared_block::destroy), m_shared(std::move(shared)) {
 #ifdef CPL_SAFE // {
-    U* from_raw = const_cast<U*>(from_ref.get());
-    T* to_dynamic = dynamic_cast<T*>(from_raw);
+      m_lifetime = std::const_pointer_cast<void>(m_shared);
+#endif // } CPL_SAFE
+    }
+
+    /// Destroy a block.
+    static inline void destroy(rc_control* control) {
+      delete static_cast<rc_shared_block*>(control);
+    }
+  };
+
+  // Forward declare for `friend`.
+  template <typename T> class borrow;
+
+  /// An indirection that uses non-atomic reference counting.
+  ///
+  /// This is cheaper to copy than @ref cpl::shared, but may only be used by a
+  /// single thread.
+  template <typename T> class counted {
+    template <typename U> friend class counted;
+    template <typename U> friend class borrow;
+
+  protected:
+    /// The raw pointer to the value.
+    T* m_raw_ptr;
+
+    /// The control block of the value.
+    rc_control* m_control;
+
+  public:
+    /// Provide convenient access to the type of the data.
+    typedef T element_type;
+
+    /// Null construction.
+    inline counted(std::nullptr_t) : m_raw_ptr(nullptr), m_control(nullptr) {
+    }
+
+    /// Unsafe construction from a raw pointer and a control block (whose
+    /// count already includes this indirection).
+    inline counted(T* raw_ptr, rc_control* control, unsafe_raw_t) : m_raw_ptr(raw_ptr), m_control(control) {
+    }
+
+    /// Construct a new value in place.
+    template <typename... Args> inline explicit counted(in_place_t, Args&&... args) {
+      rc_block<T>* block = new rc_block<T>(std::forward<Args>(args)...);
+      m_raw_ptr = &block->m_value;
+      m_control = block;
+    }
+
+    /// Cast construction from a different type of counted indirection.
+    template <typename U, typename C>
+    inline counted(const counted<U>& other, C cast_type)
+      : m_raw_ptr(cast_raw_ptr<T>(other.m_raw_ptr, cast_type)), m_control(m_raw_ptr ? other.m_control : nullptr) {
+      if (m_control) {
+        m_control->acquire();
+      }
+    }
+
+    /// Copy construction.
+    inline counted(const counted& other) : counted(other, unsafe_raw_t(0)) {
+    }
+
+    /// Copy construction from a compatible type of counted indirection.
+    template <typename U, typename = typename std::enable_if<std::is_convertible<U*, T*>::value>::type>
+    inline counted(const counted<U>& other)
+      : m_raw_ptr(other.m_raw_ptr), m_control(other.m_control) {
+      if (m_control) {
+        m_control->acquire();
+      }
+    }
+
+    /// Move construction.
+    inline counted(counted&& other) noexcept : m_raw_ptr(other.m_raw_ptr), m_control(other.m_control) {
+      other.m_raw_ptr = nullptr;
+      other.m_control = nullptr;
+    }
+
+    /// Move construction from a compatible type of counted indirection.
+    template <typename U, typename = typename std::enable_if<std::is_convertible<U*, T*>::value>::type>
+    inline counted(counted<U>&& other) noexcept
+      : m_raw_ptr(other.m_raw_ptr), m_control(other.m_control) {
+      other.m_raw_ptr = nullptr;
+      other.m_control = nullptr;
+    }
+
+    /// Stop sharing the value.
+    inline ~counted() {
+      if (m_control) {
+        m_control->release();
+      }
+    }
+
+    /// Copy assignment.
+    inline counted& operator=(const counted& other) {
+      counted copy(other);
+      swap(copy);
+      return *this;
+    }
+
+    /// Move assignment.
+    inline counted& operator=(counted&& other) {
+      counted moved(std::move(other));
+      swap(moved);
+      return *this;
+    }
+
+    /// Swap with another indirection.
+    inline void swap(counted& other) noexcept {
+      std::swap(m_raw_ptr, other.m_raw_ptr);
+      std::swap(m_control, other.m_control);
+    }
+
+    /// Access the raw pointer.
+    inline T* get() const {
+      return m_raw_ptr;
+    }
+
+    /// The number of indirections sharing the value.
+    inline size_t use_count() const {
+      return m_control ? m_control->m_count : 0;
+    }
+
+    /// Access the value.
+    inline T& operator*() const {
+#ifdef CPL_SAFE // {
+      CPL_ASSERT(m_raw_ptr, "dereferencing a null pointer");
+      m_control->verify_thread();
+#endif // } CPL_SAFE
+      return *m_raw_ptr;
+    }
+
+    /// Access a data member.
+    inline T* operator->() const {
+#ifdef CPL_SAFE // {
+      CPL_ASSERT(m_raw_ptr, "dereferencing a null pointer");
+      m_control->verify_thread();
+#endif // } CPL_SAFE
+      return m_raw_ptr;
+    }
+  };
+
+/// Compare counted indirections.
+#define CPL_COMPARE_COUNTED(OPERATOR)                                                                                      \
+  template <typename T, typename U> inline bool operator OPERATOR(const counted<T>& lhs, const counted<U>& rhs) noexcept { \
+    return lhs.get() OPERATOR rhs.get();                                                                                   \
+  }                                                                                                                        \
+  template <typename T> inline bool operator OPERATOR(const counted<T>& lhs, std::nullptr_t) noexcept {                   \
+    return lhs.get() OPERATOR nullptr;                                                                                     \
+  }                                                                                                                        \
+  template <typename T> inline bool operator OPERATOR(std::nullptr_t, const counted<T>& rhs) noexcept {                   \
+    return nullptr OPERATOR rhs.get();                                                                                     \
+  }
+
+  CPL_COMPARE_COUNTED(== )
+  CPL_COMPARE_COUNTED(!= )
+
+  // Forward declare for the `rc` method.
+  template <typename T> class rc;
+
+  /// A pointer that uses non-atomic reference counting.
+  template <typename T> class rptr : public counted<T> {
+    using counted<T>::counted;
+
+  public:
+    /// Null default constructor.
+    inline rptr() : counted<T>(nullptr) {
+    }
+
+    /// Explicit null constructor.
+    inline rptr(std::nullptr_t) : rptr() {
+    }
+
+    /// Share with another counted indirection.
+    template <typename U, typename = typename std::enable_if<std::is_convertible<U*, T*>::value>::type>
+    inline rptr(const counted<U>& other)
+      : counted<T>(other) {
+    }
+
+    /// Share with another counted indirection.
+    template <typename U, typename = typename std::enable_if<std::is_convertible<U*, T*>::value>::type>
+    inline rptr(counted<U>&& other)
+      : counted<T>(std::move(other)) {
+    }
+
+    /// Test whether the pointer is not null.
+    inline explicit operator bool() const {
+      return !!counted<T>::get();
+    }
+
+    /// Provide a reference to the value (which must exist).
+    inline ::cpl::ref<T> ref() const {
+      return ::cpl::ref<T>(*this);
+    }
+
+    /// Access the current value or, if empty, a default value.
+    inline ::cpl::ref<T> ref_or(const ::cpl::ref<T>& if_empty) const {
+      return *this ? ref() : if_empty;
+    }
+
+    /// Convert the pointer to a reference.
+    inline cpl::rc<T> rc() const {
+      return cpl::rc<T>(*this);
+    }
+  };
+
+  /// A reference that uses non-atomic reference counting.
+  template <typename T> class rc : public counted<T> {
+  public:
+    /// Construct a new value in place.
+    template <typename... Args>
+    inline explicit rc(in_place_t, Args&&... args)
+      : counted<T>(in_place, std::forward<Args>(args)...) {
+    }
+
+    /// Cast construction from a different type of counted indirection.
+    template <typename U, typename C> inline rc(const counted<U>& other, C cast_type) : counted<T>(other, cast_type) {
+      CPL_ASSERT(counted<T>::get(), "constructing a null reference");
+    }
+
+    /// Copy a reference.
+    template <typename U, typename = typename std::enable_if<std::is_convertible<U*, T*>::value>::type>
+    inline rc(const rc<U>& other)
+      : counted<T>(other) {
+      CPL_ASSERT(counted<T>::get(), "constructing a null reference");
+    }
+
+    /// Copy a pointer.
+    template <typename U, typename = typename std::enable_if<std::is_convertible<U*, T*>::value>::type>
+    explicit inline rc(const rptr<U>& other)
+      : counted<T>(other) {
+      CPL_ASSERT(counted<T>::get(), "constructing a null reference");
+    }
+
+    /// Share with another counted reference.
+    template <typename U, typename = typename std::enable_if<std::is_convertible<U*, T*>::value>::type>
+    inline rc(rc<U>&& other)
+      : counted<T>(std::move(other)) {
+    }
+
+    /// Unsafe construction from a raw pointer and a control block (whose
+    /// count already includes this reference).
+    inline rc(T* raw_ptr, rc_control* control, unsafe_raw_t) : counted<T>(raw_ptr, control, unsafe_raw_t(0)) {
+      CPL_ASSERT(counted<T>::get(), "constructing a null reference");
+    }
+
+    /// Forbid testing for null.
+    explicit operator bool() const = delete;
+
+    /// Access the value.
+    inline operator T&() const {
+      return **this;
+    }
+  };
+
+  /// A shared reference biased towards the thread which created it.
+  ///
+  /// This holds a single count of a value owned by a @ref cpl::sref. Copying
+  /// it only increments a non-atomic count, so copying it is as cheap as
+  /// copying a @ref cpl::rc, and many threads may copy the same value without
+  /// contending on its atomic count. It may only be used by the thread which
+  /// created it; other threads should be given a `sref` to create their own.
+  template <typename T> class bsref : public rc<T> {
+  public:
+    /// Bias a shared reference towards the current thread.
+    template <typename U, typename = typename std::enable_if<std::is_convertible<U*, T*>::value>::type>
+    inline explicit bsref(const cpl::sref<U>& other)
+      : rc<T>(other.get(), new rc_shared_block(other), unsafe_raw_t(0)) {
+    }
+
+    /// Share the value with a different thread.
+    inline cpl::sref<T> sref() const {
+      CPL_ASSERT(counted<T>::m_control, "sharing a moved biased reference");
+      counted<T>::m_control->verify_thread();
+      const std::shared_ptr<const void>& owner = static_cast<rc_shared_block*>(counted<T>::m_control)->m_shared;
+      return cpl::sref<T>(shared<T>(std::shared_ptr<T>(owner, counted<T>::get())), unsafe_raw_t(0));
+    }
+  };
+
+  /// An indirection for data whose lifetime is determined elsewhere.
+  template <typename T> class borrow {
+    template <typename U> friend class borrow;
+    template <typename U> friend class span;
+    friend class intrusive_container;
+    friend class coroutine_borrows;
+
+  protected:
+#ifdef CPL_FAST // {
+    /// The raw pointer to the value.
+    T* m_raw_ptr;
+#endif          // } CPL_FAST
+#ifdef CPL_SAFE // {
+    /// If we hold a pointer created by `unsafe_ref` or `unsafe_ptr`, then
+    /// this will provide a lifetime to `m_weak_ptr`.
+    std::shared_ptr<T> m_unsafe_ptr;
+
+    /// A weak pointer to the track the lifetime of the data.
+    std::weak_ptr<T> m_weak_ptr;
+#endif // } CPL_SAFE
+
+  public:
+    /// Provide convenient access to the type of the data.
+    typedef T element_type;
+
+    /// Unsafe construction from a raw pointer.
+    inline borrow(T* raw_ptr, unsafe_raw_t)
+      :
+#ifdef CPL_FAST // {
+        m_raw_ptr(raw_ptr)
+#endif          // } CPL_FAST
+#ifdef CPL_SAFE // {
+        m_unsafe_ptr(raw_ptr, no_delete<T>()),
+        m_weak_ptr(m_unsafe_ptr)
+#endif // } CPL_SAFE
+    {
+    }
+
+    /// Cast construction from a different type of borrow.
+    template <typename U, typename C>
+    inline borrow(borrow<U> other, C cast_type)
+      :
+#ifdef CPL_FAST // {
+        m_raw_ptr(cast_raw_ptr<T>(other.m_raw_ptr, cast_type))
+#endif          // } CPL_FAST
+#ifdef CPL_SAFE // {
+        m_unsafe_ptr(cast_shared_ptr<T, U>(other.m_unsafe_ptr, cast_type)),
+        m_weak_ptr(cast_weak_ptr(m_unsafe_ptr, other.m_weak_ptr, cast_type))
+#endif // } CPL_SAFE
+    {
+    }
+
+    /// Copy a borrow.
+    template <typename U, typename = typename std::enable_if<std::is_convertible<U*, T*>::value>::type>
+    inline borrow(const borrow<U>& other)
+      :
+#ifdef CPL_FAST // {
+        m_raw_ptr(other.m_raw_ptr)
+#endif          // } CPL_FAST
+#ifdef CPL_SAFE // {
+        m_unsafe_ptr(other.m_unsafe_ptr ? std::shared_ptr<T>(other.m_unsafe_ptr.get(), no_delete<T>())
+                                        : std::shared_ptr<T>(nullptr)),
+        m_weak_ptr(m_unsafe_ptr ? m_unsafe_ptr : other.m_weak_ptr.lock())
+#endif // } CPL_SAFE
+    {
+    }
+
+    /// Move a borrow.
+    template <typename U, typename = typename std::enable_if<std::is_convertible<U*, T*>::value>::type>
+    inline borrow& operator=(borrow<U>&& other) {
+#ifdef CPL_FAST // {
+      m_raw_ptr = other.m_raw_ptr;
+      other.m_raw_ptr = nullptr;
+#endif          // } CPL_FAST
+#ifdef CPL_SAFE // {
+      m_unsafe_ptr = std::move(other.m_unsafe_ptr);
+      m_weak_ptr = std::move(other.m_weak_ptr);
+#endif // } CPL_SAFE
+      return *this;
+    }
+
+    /// Construction from a held value.
+    template <typename U, typename = typename std::enable_if<std::is_convertible<U*, T*>::value>::type>
+    inline borrow(is<U>& other)
+      :
+#ifdef CPL_FAST // {
+        m_raw_ptr((T*)&other)
+#endif          // } CPL_FAST
+#ifdef CPL_SAFE // {
+        m_unsafe_ptr(),
+        m_weak_ptr(other.m_shared_ptr)
+#endif // } CPL_SAFE
+    {
+    }
+
+    /// Construction from a held value.
+    template <typename U, typename = typename std::enable_if<std::is_const<T>::value && std::is_convertible<U*, T*>::value>::type>
+    inline borrow(const is<U>& other)
+      : borrow(*const_cast<is<U>*>(&other)) {
+    }
+
+    /// Construction from an optional value.
+    template <typename U, typename = typename std::enable_if<std::is_convertible<U*, T*>::value>::type>
+    inline borrow(opt<U>& other)
+      :
+#ifdef CPL_FAST // {
+        m_raw_ptr((T*)&other)
+#endif          // } CPL_FAST
+#ifdef CPL_SAFE // {
+        m_unsafe_ptr(),
+        m_weak_ptr(other.m_shared_ptr)
+#endif // } CPL_SAFE
+    {
+    }
+
+    /// Construction from a held value.
+    template <typename U, typename = typename std::enable_if<std::is_const<T>::value && std::is_convertible<U*, T*>::value>::type>
+    inline borrow(const opt<U>& other)
+      : borrow(*const_cast<opt<U>*>(&other)) {
+    }
+
+    /// Construction from a shared indirection.
+    template <typename U, typename = typename std::enable_if<std::is_convertible<U*, T*>::value>::type>
+    inline borrow(const shared<U>& other)
+      :
+#ifdef CPL_FAST // {
+        m_raw_ptr(other.get())
+#endif          // } CPL_FAST
+#ifdef CPL_SAFE // {
+        m_unsafe_ptr(),
+        m_weak_ptr(other)
+#endif // } CPL_SAFE
+    {
+    }
+
+    /// Construction from a counted indirection.
+    template <typename U, typename = typename std::enable_if<std::is_convertible<U*, T*>::value>::type>
+    inline borrow(const counted<U>& other)
+      :
+#ifdef CPL_FAST // {
+        m_raw_ptr(other.get())
+#endif          // } CPL_FAST
+#ifdef CPL_SAFE // {
+        m_unsafe_ptr(),
+        m_weak_ptr(other.m_control ? std::shared_ptr<T>(other.m_control->m_lifetime, other.get()) : std::shared_ptr<T>())
+#endif // } CPL_SAFE
+    {
+#ifdef CPL_SAFE // {
+      if (other.m_control) {
+        other.m_control->verify_thread();
+      }
+#endif // } CPL_SAFE
+    }
+
+    /// Construction from a unique indirection.
+    template <typename U, typename = typename std::enable_if<std::is_convertible<U*, T*>::value>::type>
+    inline borrow(const unique<U>& other)
+      :
+#ifdef CPL_FAST // {
+        m_raw_ptr(other.get())
+#endif          // } CPL_FAST
+#ifdef CPL_SAFE // {
+        m_unsafe_ptr(),
+        m_weak_ptr(other.m_shared_ptr)
+#endif // } CPL_SAFE
+    {
+    }
+
+    /// Access the raw pointer.
+    ///
+    /// In safe mode, this isn't as safe as we'd like it to be, since another
+    /// thread may delete the value between the time we `return` and the time
+    /// the caller uses the value.
+    inline T* get() const {
+#ifdef CPL_FAST // {
+      return m_raw_ptr;
+#endif          // } CPL_FAST
+#ifdef CPL_SAFE // {
+      return m_weak_ptr.lock().get();
+#endif // } CPL_SAFE
+    }
+
+    /// Access the value.
+    inline T& operator*() const {
+#ifdef CPL_FAST // {
+      return *get();
+#endif          // } CPL_FAST
+#ifdef CPL_SAFE // {
+      T* raw_ptr = get();
+      CPL_ASSERT(raw_ptr, "dereferencing a null borrow");
+      return *raw_ptr;
+#endif // } CPL_SAFE
+    }
+
+    /// Access a data member.
+    inline T* operator->() const {
+#ifdef CPL_FAST // {
+      return get();
+#endif          // } CPL_FAST
+#ifdef CPL_SAFE // {
+      T* raw_ptr = get();
+      CPL_ASSERT(raw_ptr, "dereferencing a null borrow");
+      return raw_ptr;
+#endif // } CPL_SAFE
+    }
+  };
+
+/// Compare borrowed indirections.
+#define CPL_COMPARE_BORROW(OPERATOR)                                                                                     \
+  template <typename T, typename U> inline bool operator OPERATOR(const borrow<T>& lhs, const borrow<U>& rhs) noexcept { \
+    return lhs.get() OPERATOR rhs.get();                                                                                 \
+  }                                                                                                                      \
+  template <typename T, typename U> inline bool operator OPERATOR(const borrow<T>& lhs, U* rhs) noexcept {               \
+    return lhs.get() OPERATOR rhs;                                                                                       \
+  }                                                                                                                      \
+  template <typename T, typename U> inline bool operator OPERATOR(T* lhs, const borrow<U>& rhs) noexcept {               \
+    return lhs OPERATOR rhs.get();                                                                                       \
+  }                                                                                                                      \
+  template <typename T> inline bool operator OPERATOR(const borrow<T>& lhs, std::nullptr_t) noexcept {                   \
+    return lhs.get() OPERATOR nullptr;                                                                                   \
+  }                                                                                                                      \
+  template <typename T> inline bool operator OPERATOR(std::nullptr_t, const borrow<T>& rhs) noexcept {                   \
+    return nullptr OPERATOR rhs.get();                                                                                   \
+  }
+
+  CPL_COMPARE_BORROW(> )
+  CPL_COMPARE_BORROW(< )
+  CPL_COMPARE_BORROW(>= )
+  CPL_COMPARE_BORROW(== )
+  CPL_COMPARE_BORROW(!= )
+  CPL_COMPARE_BORROW(<= )
+
+  // Forward declare for the `ref` method.
+  template <typename T> class ref;
+
+  /// A pointer for data whose lifetime is determined elsewhere.
+  template <typename T> class ptr : public borrow<T> {
+    using borrow<T>::borrow;
+
+  public:
+    /// Deterministic null default constructor.
+    ///
+    /// This is slower from the `T*` default constructor, for sanity.
+    inline ptr() : borrow<T>(nullptr, unsafe_raw_t(0)) {
+    }
+
+    /// Explicit null constructor.
+    inline ptr(std::nullptr_t) : ptr() {
+    }
+
+    /// Test whether the pointer is not null.
+    inline operator bool() const {
+      return !!borrow<T>::get();
+    }
+
+    /// Provide a reference to the value (which must exist).
+    inline ::cpl::ref<T> ref() const {
+      return ::cpl::ref<T>(*this);
+    }
+
+    /// Access the current value or, if empty, a default value.
+    inline ::cpl::ref<T> ref_or(const ::cpl::ref<T>& if_empty) const {
+      return *this ? ref() : if_empty;
+    }
+  };
+
+  /// A reference for data whose lifetime is determined elsewhere.
+  template <typename T> class ref : public borrow<T> {
+  public:
+    /// Unsafe construction from a raw pointer.
+    inline ref(T* raw_ptr, unsafe_raw_t) : borrow<T>(raw_ptr, unsafe_raw_t(0)) {
+      CPL_ASSERT(borrow<T>::m_weak_ptr.lock().get(), "constructing a null reference");
+    }
+
+    /// Cast construction from a different type of borrow.
+    template <typename U, typename C> inline ref(const borrow<U>& other, C cast_type) : borrow<T>(other, cast_type) {
+      CPL_ASSERT(borrow<T>::m_weak_ptr.lock().get(), "constructing a null reference");
+    }
+
+    /// Copy a reference.
+    template <typename U, typename = typename std::enable_if<std::is_convertible<U*, T*>::value>::type>
+    inline ref(const ref<U>& other)
+      : borrow<T>(other) {
+      CPL_ASSERT(borrow<T>::m_weak_ptr.lock().get(), "constructing a null reference");
+    }
+
+    /// Copy a pointer.
+    template <typename U, typename = typename std::enable_if<std::is_convertible<U*, T*>::value>::type>
+    explicit inline ref(const ptr<U>& other)
+      : borrow<T>(other) {
+      CPL_ASSERT(borrow<T>::m_weak_ptr.lock().get(), "constructing a null reference");
+    }
+
+    /// Construct from a held value.
+    template <typename U, typename = typename std::enable_if<std::is_convertible<U*, T*>::value>::type>
+    inline ref(is<U>& other)
+      : borrow<T>(other) {
+    }
+
+    /// Construct from a held value.
+    template <typename U, typename = typename std::enable_if<std::is_const<T>::value && std::is_convertible<U*, T*>::value>::type>
+    inline ref(const is<U>& other)
+      : borrow<T>(*const_cast<is<U>*>(&other)) {
+    }
+
+    /// Construct from an optional value.
+    template <typename U, typename = typename std::enable_if<std::is_convertible<U*, T*>::value>::type>
+    explicit inline ref(opt<U>& other)
+      : borrow<T>(other) {
+      CPL_ASSERT(borrow<T>::m_weak_ptr.lock().get(), "constructing a null reference");
+    }
+
+    /// Construct from an optional value.
+    template <typename U, typename = typename std::enable_if<std::is_const<T>::value && std::is_convertible<U*, T*>::value>::type>
+    inline ref(const opt<U>& other)
+      : borrow<T>(*const_cast<opt<U>*>(&other)) {
+    }
+
+    /// Copy a shared reference.
+    template <typename U, typename = typename std::enable_if<std::is_convertible<U*, T*>::value>::type>
+    inline ref(const sref<U>& other)
+      : borrow<T>(other) {
+      CPL_ASSERT(borrow<T>::m_weak_ptr.lock().get(), "constructing a null reference");
+    }
+
+    /// Copy a shared pointer.
+    template <typename U, typename = typename std::enable_if<std::is_convertible<U*, T*>::value>::type>
+    explicit inline ref(const sptr<U>& other)
+      : borrow<T>(other) {
+      CPL_ASSERT(borrow<T>::m_weak_ptr.lock().get(), "constructing a null reference");
+    }
+
+    /// Copy a counted reference.
+    template <typename U, typename = typename std::enable_if<std::is_convertible<U*, T*>::value>::type>
+    inline ref(const rc<U>& other)
+      : borrow<T>(other) {
+      CPL_ASSERT(borrow<T>::m_weak_ptr.lock().get(), "constructing a null reference");
+    }
+
+    /// Copy a counted pointer.
+    template <typename U, typename = typename std::enable_if<std::is_convertible<U*, T*>::value>::type>
+    explicit inline ref(const rptr<U>& other)
+      : borrow<T>(other) {
+      CPL_ASSERT(borrow<T>::m_weak_ptr.lock().get(), "constructing a null reference");
+    }
+
+    /// Copy a unique reference.
+    template <typename U, typename = typename std::enable_if<std::is_convertible<U*, T*>::value>::type>
+    inline ref(const uref<U>& other)
+      : borrow<T>(other) {
+      CPL_ASSERT(borrow<T>::m_weak_ptr.lock().get(), "constructing a null reference");
+    }
+
+    /// Copy a unique pointer.
+    template <typename U, typename = typename std::enable_if<std::is_convertible<U*, T*>::value>::type>
+    explicit inline ref(const uptr<U>& other)
+      : borrow<T>(other) {
+      CPL_ASSERT(borrow<T>::m_weak_ptr.lock().get(), "constructing a null reference");
+    }
+
+    /// Access the value.
+    inline operator T&() const {
+      return *borrow<T>::get();
+    }
+  };
+
+  /// @file
+  /// Implement the unsafe creation of pointers and references.inters and
+  /// references.
+
+  /// Create some value owned by a shared reference.
+  template <typename T, typename... Args> inline sref<T> make_sref(Args&&... args) {
+    return sref<T>{ new T(std::forward<Args>(args)...), unsafe_raw_t(0) };
+  }
+
+  /// Create some value owned by a shared pointer.
+  template <typename T, typename... Args> inline sptr<T> make_sptr(Args&&... args) {
+    return sptr<T>{ new T(std::forward<Args>(args)...), unsafe_raw_t(0) };
+  }
+
+  /// Create some value owned by a counted reference.
+  template <typename T, typename... Args> inline rc<T> make_rc(Args&&... args) {
+    return rc<T>(in_place, std::forward<Args>(args)...);
+  }
+
+  /// Create some value owned by a counted pointer.
+  template <typename T, typename... Args> inline rptr<T> make_rptr(Args&&... args) {
+    return rptr<T>(in_place, std::forward<Args>(args)...);
+  }
+
+  /// Create some value owned by a unique reference.
+  template <typename T, typename... Args> inline uref<T> make_uref(Args&&... args) {
+    return uref<T>{ new T(std::forward<Args>(args)...), unsafe_raw_t(0) };
+  }
+
+  /// Create some value owned by a unique pointer.
+  template <typename T, typename... Args> inline uptr<T> make_uptr(Args&&... args) {
+    return uptr<T>{ new T(std::forward<Args>(args)...), unsafe_raw_t(0) };
+  }
+
+  /// Create an array of value-initialized elements owned by a unique
+  /// reference.
+  ///
+  /// The first element is aligned to `alignment`, which may be larger than
+  /// `alignof(T)` (for example, to allow vectorizing loops on the elements).
+  template <typename T> inline uref<T[]> make_uref_array(size_t size, size_t alignment = alignof(T)) {
+    array_deleter<T> deleter;
+    T* data = allocate_array<T>(size, alignment, true, deleter);
+    return uref<T[]>{ data, deleter, unsafe_raw_t(0) };
+  }
+
+  /// Create an array of uninitialized trivial elements owned by a unique
+  /// reference.
+  template <typename T> inline uref<T[]> make_uref_array_uninitialized(size_t size, size_t alignment = alignof(T)) {
+    static_assert(std::is_trivially_default_constructible<T>::value, "uninitialized array of non-trivial elements");
+    array_deleter<T> deleter;
+    T* data = allocate_array<T>(size, alignment, false, deleter);
+    return uref<T[]>{ data, deleter, unsafe_raw_t(0) };
+  }
+
+  /// Create an array of value-initialized elements owned by a unique pointer.
+  template <typename T> inline uptr<T[]> make_uptr_array(size_t size, size_t alignment = alignof(T)) {
+    return uptr<T[]>(make_uref_array<T>(size, alignment));
+  }
+
+  /// Create an array of uninitialized trivial elements owned by a unique
+  /// pointer.
+  template <typename T> inline uptr<T[]> make_uptr_array_uninitialized(size_t size, size_t alignment = alignof(T)) {
+    return uptr<T[]>(make_uref_array_uninitialized<T>(size, alignment));
+  }
+
+  /// Create an array of value-initialized elements owned by a shared
+  /// reference.
+  template <typename T> inline sref<T[]> make_sref_array(size_t size, size_t alignment = alignof(T)) {
+    return sref<T[]>(make_uref_array<T>(size, alignment));
+  }
+
+  /// Create an array of uninitialized trivial elements owned by a shared
+  /// reference.
+  template <typename T> inline sref<T[]> make_sref_array_uninitialized(size_t size, size_t alignment = alignof(T)) {
+    return sref<T[]>(make_uref_array_uninitialized<T>(size, alignment));
+  }
+
+  /// Create some value aligned to `A` owned by a unique reference.
+  ///
+  /// The alignment is given at compile time since it is part of the type, so
+  /// that deleting the value will properly free its storage.
+  template <typename T, size_t A = CPL_CACHE_LINE_SIZE, typename... Args>
+  inline uref<aligned<T, A>> make_uref_aligned(Args&&... args) {
+    return make_uref<aligned<T, A>>(std::forward<Args>(args)...);
+  }
+
+  /// Create some value aligned to `A` owned by a unique pointer.
+  template <typename T, size_t A = CPL_CACHE_LINE_SIZE, typename... Args>
+  inline uptr<aligned<T, A>> make_uptr_aligned(Args&&... args) {
+    return make_uptr<aligned<T, A>>(std::forward<Args>(args)...);
+  }
+
+  /// Create some value aligned to `alignment` owned by a shared pointer.
+  template <typename T, typename... Args> inline sptr<T> make_sptr_aligned(size_t alignment, Args&&... args) {
+    CPL_ASSERT(alignment >= alignof(T), "allocating with an invalid alignment");
+    void* storage = allocate_aligned(sizeof(T), alignment);
+    T* data;
+    try {
+      data = new (storage) T(std::forward<Args>(args)...);
+    } catch (...) {
+      free_aligned(storage);
+      throw;
+    }
+    return sptr<T>(std::shared_ptr<T>(data, aligned_deleter<T>()));
+  }
+
+  /// Create some value aligned to `alignment` owned by a shared reference.
+  template <typename T, typename... Args> inline sref<T> make_sref_aligned(size_t alignment, Args&&... args) {
+    return sref<T>(make_sptr_aligned<T>(alignment, std::forward<Args>(args)...));
+  }
+
+  /// Create an unsafe reference to raw data.
+  ///
+  /// This is playing with fire. It is OK if the data is static, but there's
+  /// no way to ask the compiler to ensure that.
+  template <typename T> inline ref<T> unsafe_ref(T& data) {
+    return ref<T>{ &data, unsafe_raw_t(0) };
+  }
+
+  /// Create an unsafe pointer to raw data.
+  ///
+  /// This is playing with fire. It is OK if the data is static, but there's
+  /// no way to ask the compiler to ensure that.
+  template <typename T> inline ptr<T> unsafe_ptr(T& data) {
+    return ptr<T>{ &data, unsafe_raw_t(0) };
+  }
+
+  /// A clever cast between reference types.
+  ///
+  /// In safe mode, this verifies that the raw pointer value did not change,
+  /// which will always be true unless you use virtual base classes.
+  template <typename T, typename U> inline sref<T> cast_clever(const sref<U>& from_ref) {
+#ifdef CPL_SAFE // {
+    U* from_raw = const_cast<U*>(from_ref.get());
+    T* to_dynamic = dynamic_cast<T*>(from_raw);
+    T* to_raw = static_cast<T*>(from_raw);
+    CPL_ASSERT(to_dynamic == to_raw, "clever cast gave the wrong result");
+#endif // } CPL_SAFE
+    return sref<T>{ from_ref, unsafe_static_t(0) };
+  }
+
+  /// A clever cast between pointer types.
+  ///
+  /// In safe mode, this verifies that the raw pointer value did not change,
+  /// which will always be true unless you use virtual base classes.
+  template <typename T, typename U> inline sptr<T> cast_clever(const sptr<U>& from_ptr) {
+#ifdef CPL_SAFE // {
+    U* from_raw = from_ptr.get();
+    T* to_dynamic = dynamic_cast<T*>(from_raw);
+    T* to_raw = static_cast<T*>(from_raw);
+    CPL_ASSERT(to_dynamic == to_raw, "clever cast gave the wrong result");
+#endif // } CPL_SAFE
+    return sptr<T>{ from_ptr, unsafe_static_t(0) };
+  }
+
+  /// A clever cast between reference types.
+  ///
+  /// In safe mode, this verifies that the raw pointer value did not change,
+  /// which will always be true unless you use virtual base classes.
+  template <typename T, typename U> inline rc<T> cast_clever(const rc<U>& from_ref) {
+#ifdef CPL_SAFE // {
+    U* from_raw = const_cast<U*>(from_ref.get());
+    T* to_dynamic = dynamic_cast<T*>(from_raw);
+    T* to_raw = static_cast<T*>(from_raw);
+    CPL_ASSERT(to_dynamic == to_raw, "clever cast gave the wrong result");
+#endif // } CPL_SAFE
+    return rc<T>{ from_ref, unsafe_static_t(0) };
+  }
+
+  /// A clever cast between pointer types.
+  ///
+  /// In safe mode, this verifies that the raw pointer value did not change,
+  /// which will always be true unless you use virtual base classes.
+  template <typename T, typename U> inline rptr<T> cast_clever(const rptr<U>& from_ptr) {
+#ifdef CPL_SAFE // {
+    U* from_raw = from_ptr.get();
+    T* to_dynamic = dynamic_cast<T*>(from_raw);
+    T* to_raw = static_cast<T*>(from_raw);
+    CPL_ASSERT(to_dynamic == to_raw, "clever cast gave the wrong result");
+#endif // } CPL_SAFE
+    return rptr<T>{ from_ptr, unsafe_static_t(0) };
+  }
+
+  /// A clever cast between pointer types.
+  ///
+  /// In safe mode, this verifies that the raw pointer value did not change,
+  /// which will always be true unless you use virtual base classes.
+  template <typename T, typename U> inline wptr<T> cast_clever(const wptr<U>& from_ptr) {
+#ifdef CPL_SAFE // {
+    U* from_raw = from_ptr.lock().get();
+    T* to_dynamic = dynamic_cast<T*>(from_raw);
+    T* to_raw = static_cast<T*>(from_raw);
+    CPL_ASSERT(to_dynamic == to_raw, "clever cast gave the wrong result");
+#endif // } CPL_SAFE
+    return wptr<T>{ from_ptr, unsafe_static_t(0) };
+  }
+
+  /// A clever cast between reference types.
+  ///
+  /// In safe mode, this verifies that the raw pointer value did not change,
+  /// which will always be true unless you use virtual base classes.
+  template <typename T, typename U> inline uref<T> cast_clever(uref<U>&& from_ref) {
+#ifdef CPL_SAFE // {
+    U* from_raw = from_ref.get();
+    T* to_dynamic = dynamic_cast<T*>(from_raw);
+    T* to_raw = static_cast<T*>(from_raw);
+    CPL_ASSERT(to_dynamic == to_raw, "clever cast gave the wrong result");
+#endif // } CPL_SAFE
+    return uref<T>{ std::move(from_ref), unsafe_static_t(0) };
+  }
+
+  /// A clever cast between pointer types.
+  ///
+  /// In safe mode, this verifies that the raw pointer value did not change,
+  /// which will always be true unless you use virtual base classes.
+  template <typename T, typename U> inline uptr<T> cast_clever(uptr<U>&& from_ptr) {
+#ifdef CPL_SAFE // {
+    U* from_raw = from_ptr.get();
+    T* to_dynamic = dynamic_cast<T*>(from_raw);
+    T* to_raw = static_cast<T*>(from_raw);
+    CPL_ASSERT(to_dynamic == to_raw, "clever cast gave the wrong result");
+#endif // } CPL_SAFE
+    return uptr<T>{ std::move(from_ptr), unsafe_static_t(0) };
+  }
+
+  /// A clever cast between reference types.
+  ///
+  /// In safe mode, this verifies that the raw pointer value did not change,
+  /// which will always be true unless you use virtual base classes.
+  template <typename T, typename U> inline ref<T> cast_clever(const ref<U>& from_ref) {
+#ifdef CPL_SAFE // {
+    U* from_raw = const_cast<U*>(from_ref.get());
+    T* to_dynamic = dynamic_cast<T*>(from_raw);
     T* to_raw = static_cast<T*>(from_raw);
     CPL_ASSERT(to_dynamic == to_raw, "clever cast gave the wrong result");
 #endif // } CPL_SAFE
-    return ref<T>{ from_ref, unsafe_static_t(0) };
+    return ref<T>{ from_ref, unsafe_static_t(0) };
+  }
+
+  /// A clever cast between pointer types.
+  ///
+  /// In safe mode, this verifies that the raw pointer value did not change,
+  /// which will always be true unless you use virtual base classes.
+  template <typename T, typename U> inline ptr<T> cast_clever(const ptr<U>& from_ptr) {
+#ifdef CPL_SAFE // {
+    U* from_raw = from_ptr.get();
+    T* to_dynamic = dynamic_cast<T*>(from_raw);
+    T* to_raw = static_cast<T*>(from_raw);
+    CPL_ASSERT(to_dynamic == to_raw, "clever cast gave the wrong result");
+#endif // } CPL_SAFE
+    return ptr<T>{ from_ptr, unsafe_static_t(0) };
+  }
+
+  /// A reinterpret cast between reference types.
+  template <typename T, typename U> inline sref<T> cast_reinterpret(const sref<U>& from_ref) {
+    return sref<T>{ from_ref, unsafe_raw_t(0) };
+  }
+
+  /// A reinterpret cast between pointer types.
+  template <typename T, typename U> inline sptr<T> cast_reinterpret(const sptr<U>& from_ptr) {
+    return sptr<T>{ from_ptr, unsafe_raw_t(0) };
+  }
+
+  /// A reinterpret cast between reference types.
+  template <typename T, typename U> inline rc<T> cast_reinterpret(const rc<U>& from_ref) {
+    return rc<T>{ from_ref, unsafe_raw_t(0) };
+  }
+
+  /// A reinterpret cast between pointer types.
+  template <typename T, typename U> inline rptr<T> cast_reinterpret(const rptr<U>& from_ptr) {
+    return rptr<T>{ from_ptr, unsafe_raw_t(0) };
+  }
+
+  /// A reinterpret cast between pointer types.
+  template <typename T, typename U> inline wptr<T> cast_reinterpret(const wptr<U>& from_ptr) {
+    return wptr<T>{ from_ptr, unsafe_raw_t(0) };
+  }
+
+  /// A reinterpret cast between reference types.
+  template <typename T, typename U> inline uref<T> cast_reinterpret(uref<U>&& from_ref) {
+    return uref<T>{ std::move(from_ref), unsafe_raw_t(0) };
+  }
+
+  /// A reinterpret cast between pointer types.
+  template <typename T, typename U> inline uptr<T> cast_reinterpret(uptr<U>&& from_ptr) {
+    return uptr<T>{ std::move(from_ptr), unsafe_raw_t(0) };
+  }
+
+  /// A reinterpret cast between reference types.
+  template <typename T, typename U> inline ref<T> cast_reinterpret(const ref<U>& from_ref) {
+    return ref<T>{ from_ref, unsafe_raw_t(0) };
+  }
+
+  /// A reinterpret cast between pointer types.
+  template <typename T, typename U> inline ptr<T> cast_reinterpret(const ptr<U>& from_ptr) {
+    return ptr<T>{ from_ptr, unsafe_raw_t(0) };
+  }
+
+  /// A dynamic cast between reference types.
+  template <typename T, typename U> inline sref<T> cast_dynamic(const sref<U>& from_ref) {
+    return sref<T>{ from_ref, unsafe_dynamic_t(0) };
+  }
+
+  /// A dynamic cast between pointer types.
+  template <typename T, typename U> inline sptr<T> cast_dynamic(const sptr<U>& from_ptr) {
+    return sptr<T>{ from_ptr, unsafe_dynamic_t(0) };
+  }
+
+  /// A dynamic cast between reference types.
+  template <typename T, typename U> inline rc<T> cast_dynamic(const rc<U>& from_ref) {
+    return rc<T>{ from_ref, unsafe_dynamic_t(0) };
+  }
+
+  /// A dynamic cast between pointer types.
+  template <typename T, typename U> inline rptr<T> cast_dynamic(const rptr<U>& from_ptr) {
+    return rptr<T>{ from_ptr, unsafe_dynamic_t(0) };
+  }
+
+  /// A dynamic cast between pointer types.
+  template <typename T, typename U> inline wptr<T> cast_dynamic(const wptr<U>& from_ptr) {
+    return wptr<T>{ from_ptr, unsafe_dynamic_t(0) };
+  }
+
+  /// A dynamic cast between reference types.
+  template <typename T, typename U> inline uref<T> cast_dynamic(uref<U>&& from_ref) {
+    return uref<T>{ std::move(from_ref), unsafe_dynamic_t(0) };
+  }
+
+  /// A dynamic cast between pointer types.
+  template <typename T, typename U> inline uptr<T> cast_dynamic(uptr<U>&& from_ptr) {
+    return uptr<T>{ std::move(from_ptr), unsafe_dynamic_t(0) };
+  }
+
+  /// A dynamic cast between reference types.
+  template <typename T, typename U> inline ref<T> cast_dynamic(const ref<U>& from_ref) {
+    return ref<T>{ from_ref, unsafe_dynamic_t(0) };
+  }
+
+  /// A dynamic cast between pointer types.
+  template <typename T, typename U> inline ptr<T> cast_dynamic(const ptr<U>& from_ptr) {
+    return ptr<T>{ from_ptr, unsafe_dynamic_t(0) };
+  }
+
+  /// A static cast between reference types.
+  template <typename T, typename U> inline sref<T> cast_static(const sref<U>& from_ref) {
+    return sref<T>{ from_ref, unsafe_static_t(0) };
+  }
+
+  /// A static cast between pointer types.
+  template <typename T, typename U> inline sptr<T> cast_static(const sptr<U>& from_ptr) {
+    return sptr<T>{ from_ptr, unsafe_static_t(0) };
+  }
+
+  /// A static cast between reference types.
+  template <typename T, typename U> inline rc<T> cast_static(const rc<U>& from_ref) {
+    return rc<T>{ from_ref, unsafe_static_t(0) };
+  }
+
+  /// A static cast between pointer types.
+  template <typename T, typename U> inline rptr<T> cast_static(const rptr<U>& from_ptr) {
+    return rptr<T>{ from_ptr, unsafe_static_t(0) };
+  }
+
+  /// A static cast between pointer types.
+  template <typename T, typename U> inline wptr<T> cast_static(const wptr<U>& from_ptr) {
+    return wptr<T>{ from_ptr, unsafe_static_t(0) };
+  }
+
+  /// A static cast between reference types.
+  template <typename T, typename U> inline uref<T> cast_static(uref<U>&& from_ref) {
+    return uref<T>{ std::move(from_ref), unsafe_static_t(0) };
+  }
+
+  /// A static cast between pointer types.
+  template <typename T, typename U> inline uptr<T> cast_static(uptr<U>&& from_ptr) {
+    return uptr<T>{ std::move(from_ptr), unsafe_static_t(0) };
+  }
+
+  /// A static cast between reference types.
+  template <typename T, typename U> inline ref<T> cast_static(const ref<U>& from_ref) {
+    return ref<T>{ from_ref, unsafe_static_t(0) };
+  }
+
+  /// A static cast between pointer types.
+  template <typename T, typename U> inline ptr<T> cast_static(const ptr<U>& from_ptr) {
+    return ptr<T>{ from_ptr, unsafe_static_t(0) };
+  }
+
+  /// A const cast between reference types.
+  template <typename T, typename U> inline sref<T> cast_const(const sref<U>& from_ref) {
+    return sref<T>{ from_ref, unsafe_const_t(0) };
+  }
+
+  /// A const cast between pointer types.
+  template <typename T, typename U> inline sptr<T> cast_const(const sptr<U>& from_ptr) {
+    return sptr<T>{ from_ptr, unsafe_const_t(0) };
+  }
+
+  /// A const cast between reference types.
+  template <typename T, typename U> inline rc<T> cast_const(const rc<U>& from_ref) {
+    return rc<T>{ from_ref, unsafe_const_t(0) };
+  }
+
+  /// A const cast between pointer types.
+  template <typename T, typename U> inline rptr<T> cast_const(const rptr<U>& from_ptr) {
+    return rptr<T>{ from_ptr, unsafe_const_t(0) };
+  }
+
+  /// A const cast between pointer types.
+  template <typename T, typename U> inline wptr<T> cast_const(const wptr<U>& from_ptr) {
+    return wptr<T>{ from_ptr, unsafe_const_t(0) };
+  }
+
+  /// A const cast between reference types.
+  template <typename T, typename U> inline uref<T> cast_const(uref<U>&& from_ref) {
+    return uref<T>{ std::move(from_ref), unsafe_const_t(0) };
+  }
+
+  /// A const cast between pointer types.
+  template <typename T, typename U> inline uptr<T> cast_const(uptr<U>&& from_ptr) {
+    return uptr<T>{ std::move(from_ptr), unsafe_const_t(0) };
+  }
+
+  /// A const cast between reference types.
+  template <typename T, typename U> inline ref<T> cast_const(const ref<U>& from_ref) {
+    return ref<T>{ from_ref, unsafe_const_t(0) };
+  }
+
+  /// A const cast between pointer types.
+  template <typename T, typename U> inline ptr<T> cast_const(const ptr<U>& from_ptr) {
+    return ptr<T>{ from_ptr, unsafe_const_t(0) };
+  }
+
+  /// A non-owning view of a contiguous range of elements.
+  ///
+  /// The fast implementation is just a raw pointer and a size. The safe
+  /// implementation also tracks the lifetime of the viewed container, but only
+  /// verifies it when the span is created and whenever an iteration starts
+  /// (that is, in `begin` and `data`). Indexing only checks the index against
+  /// the size recorded at creation. This allows the compiler to optimize
+  /// (vectorize) loops over the span in both variants.
+  ///
+  /// The viewed container is anything providing `data()` and `size()`, such as
+  /// @ref cpl::vector. It is given as a @ref cpl::is, or using any of the CPL
+  /// indirections. In safe mode, if the container is deleted, or is modified
+  /// such that the span's range is no longer inside it, then the next
+  /// iteration over the span will detect this.
+  template <typename T> class span {
+    template <typename U> friend class span;
+
+    /// Whether a container with elements of type `U` may be viewed.
+    template <typename U> using is_viewable = std::is_convertible<U (*)[], T (*)[]>;
+
+    /// The type of the elements of a container.
+    template <typename C> using element_of = typename std::remove_pointer<decltype(std::declval<C&>().data())>::type;
+
+#ifdef CPL_SAFE // {
+    /// Track the lifetime of the viewed container.
+    std::weak_ptr<const void> m_owner;
+
+    /// Verify that the viewed container still holds the viewed range.
+    ///
+    /// This is null if the span was created from raw data, in which case we
+    /// can't validate anything.
+    bool (*m_covers)(const void* container, const void* data, size_t size);
+
+    /// Whether the viewed container holds the viewed range.
+    template <typename C> static bool covers(const void* container, const void* data, size_t size) {
+      const C& raw_container = *static_cast<const C*>(container);
+      auto begin = raw_container.data();
+      auto first = static_cast<decltype(begin)>(data);
+      std::less_equal<decltype(begin)> less_equal;
+      return less_equal(begin, first) && less_equal(first + size, begin + raw_container.size());
+    }
+
+    /// A fixed-size array always holds the viewed range.
+    static bool covers_fixed(const void*, const void*, size_t) {
+      return true;
+    }
+#endif // } CPL_SAFE
+
+  protected:
+    /// The first viewed element.
+    T* m_data;
+
+    /// The number of viewed elements.
+    size_t m_size;
+
+  public:
+    /// Provide convenient access to the type of the elements.
+    typedef T element_type;
+
+    /// Provide convenient access to the type of the elements.
+    typedef typename std::remove_cv<T>::type value_type;
+
+    /// Iterate on the elements.
+    typedef T* iterator;
+
+    /// Empty default constructor.
+    inline span()
+      :
+#ifdef CPL_SAFE // {
+        m_covers(nullptr),
+#endif // } CPL_SAFE
+        m_data(nullptr),
+        m_size(0) {
+    }
+
+    /// Unsafe construction from a raw pointer and a size.
+    inline span(T* raw_ptr, size_t size, unsafe_raw_t)
+      :
+#ifdef CPL_SAFE // {
+        m_covers(nullptr),
+#endif // } CPL_SAFE
+        m_data(raw_ptr),
+        m_size(size) {
+    }
+
+    /// View some of the elements of a borrowed container.
+    template <typename C, typename = typename std::enable_if<is_viewable<element_of<C>>::value>::type>
+    inline span(const borrow<C>& container, size_t offset, size_t count)
+      :
+#ifdef CPL_SAFE // {
+        m_owner(container.m_unsafe_ptr ? std::weak_ptr<C>() : container.m_weak_ptr),
+        m_covers(container.m_unsafe_ptr ? nullptr : &covers<C>),
+#endif // } CPL_SAFE
+        m_data(container->data() + offset),
+        m_size(count) {
+      CPL_ASSERT(offset <= container->size() && count <= container->size() - offset, "creating a span out of bounds");
+    }
+
+    /// View all the elements of a borrowed container.
+    template <typename C, typename = typename std::enable_if<is_viewable<element_of<C>>::value>::type>
+    inline span(const borrow<C>& container)
+      : span(container, 0, container->size()) {
+    }
+
+    /// View all the elements of a held container.
+    template <typename C, typename = typename std::enable_if<is_viewable<element_of<C>>::value>::type>
+    inline span(is<C>& container)
+      : span(borrow<C>(container)) {
+    }
+
+    /// View all the elements of a held container.
+    template <typename C, typename = typename std::enable_if<is_viewable<element_of<const C>>::value>::type>
+    inline span(const is<C>& container)
+      : span(borrow<const C>(container)) {
+    }
+
+    /// View all the elements of a uniquely owned container.
+    template <typename C, typename = typename std::enable_if<is_viewable<element_of<C>>::value>::type>
+    inline span(const unique<C>& container)
+      : span(borrow<C>(container)) {
+    }
+
+    /// View all the elements of a shared container.
+    template <typename C, typename = typename std::enable_if<is_viewable<element_of<C>>::value>::type>
+    inline span(const shared<C>& container)
+      : span(borrow<C>(container)) {
+    }
+
+    /// View all the elements of a uniquely owned array.
+    template <typename U, typename = typename std::enable_if<is_viewable<U>::value>::type>
+    inline span(const unique<U[]>& array)
+      :
+#ifdef CPL_SAFE // {
+        m_owner(array.m_shared_ptr),
+        m_covers(&covers_fixed),
+#endif // } CPL_SAFE
+        m_data(array.data()),
+        m_size(array.size()) {
+    }
+
+    /// View all the elements of a shared array.
+    template <typename U, typename = typename std::enable_if<is_viewable<U>::value>::type>
+    inline span(const shared<U[]>& array)
+      :
+#ifdef CPL_SAFE // {
+        m_owner(array),
+        m_covers(&covers_fixed),
+#endif // } CPL_SAFE
+        m_data(array.data()),
+        m_size(array.size()) {
+    }
+
+    /// Copy a compatible span.
+    template <typename U, typename = typename std::enable_if<is_viewable<U>::value>::type>
+    inline span(const span<U>& other)
+      :
+#ifdef CPL_SAFE // {
+        m_owner(other.m_owner),
+        m_covers(other.m_covers),
+#endif // } CPL_SAFE
+        m_data(other.m_data),
+        m_size(other.m_size) {
+    }
+
+    /// Verify the span may be used.
+    ///
+    /// In fast mode, this does nothing. In safe mode, this verifies that the
+    /// viewed container is still alive and still holds the viewed range. This
+    /// is done automatically by `begin` and `data`.
+    inline void validate() const {
+#ifdef CPL_SAFE // {
+      if (m_covers) {
+        std::shared_ptr<const void> owner = m_owner.lock();
+        CPL_ASSERT(owner, "using a span of a deleted container");
+        CPL_ASSERT(m_covers(owner.get(), m_data, m_size), "using a span of a modified container");
+      }
+#endif // } CPL_SAFE
+    }
+
+    /// The number of viewed elements.
+    inline size_t size() const {
+      return m_size;
+    }
+
+    /// Whether there are no viewed elements.
+    inline bool empty() const {
+      return m_size == 0;
+    }
+
+    /// Access the raw viewed elements (after validating them).
+    inline T* data() const {
+      validate();
+      return m_data;
+    }
+
+    /// Start iterating on the elements (after validating them).
+    inline T* begin() const {
+      validate();
+      return m_data;
+    }
+
+    /// Stop iterating on the elements.
+    inline T* end() const {
+      return m_data + m_size;
+    }
+
+    /// Access an element by its index.
+    ///
+    /// In safe mode, this only verifies the index is within the size, not
+    /// that the viewed container is still valid.
+    inline T& operator[](size_t index) const {
+      CPL_ASSERT(index < m_size, "accessing a span out of bounds");
+      return m_data[index];
+    }
+
+    /// Access the first element.
+    inline T& front() const {
+      CPL_ASSERT(m_size > 0, "accessing the front of an empty span");
+      return m_data[0];
+    }
+
+    /// Access the last element.
+    inline T& back() const {
+      CPL_ASSERT(m_size > 0, "accessing the back of an empty span");
+      return m_data[m_size - 1];
+    }
+
+    /// View some of the elements of this span.
+    inline span<T> subspan(size_t offset, size_t count) const {
+      validate();
+      CPL_ASSERT(offset <= m_size && count <= m_size - offset, "creating a span out of bounds");
+      span<T> result(*this);
+      result.m_data += offset;
+      result.m_size = count;
+      return result;
+    }
+
+    /// View the first elements of this span.
+    inline span<T> first(size_t count) const {
+      return subspan(0, count);
+    }
+
+    /// View the last elements of this span.
+    inline span<T> last(size_t count) const {
+      CPL_ASSERT(count <= m_size, "creating a span out of bounds");
+      return subspan(m_size - count, count);
+    }
+  };
+
+  /// A non-owning view of a sequence of characters.
+  ///
+  /// This is a @ref cpl::span of constant characters, with the addition of the
+  /// familiar `std::string_view` operations. Therefore in fast mode it is just
+  /// a raw pointer and a size. In safe mode it is validated by each operation,
+  /// detecting the viewed string was deleted or reallocated.
+  template <typename C> class basic_string_view : public span<const C> {
+    using span<const C>::m_data;
+    using span<const C>::m_size;
+
+  public:
+    using span<const C>::span;
+
+    /// The position used to indicate "no position".
+    static constexpr size_t npos = size_t(-1);
+
+    /// Empty default constructor.
+    inline basic_string_view() = default;
+
+    /// View the same characters as a span.
+    inline basic_string_view(const span<const C>& other) : span<const C>(other) {
+    }
+
+    /// The number of viewed characters.
+    inline size_t length() const {
+      return m_size;
+    }
+
+    /// View some of the characters.
+    inline basic_string_view<C> substr(size_t position, size_t count = npos) const {
+      CPL_ASSERT(position <= m_size, "creating a string view out of bounds");
+      return span<const C>::subspan(position, std::min(count, m_size - position));
+    }
+
+    /// Stop viewing some characters at the start.
+    inline void remove_prefix(size_t count) {
+      CPL_ASSERT(count <= m_size, "removing too many characters from a string view");
+      *this = span<const C>::last(m_size - std::min(count, m_size));
+    }
+
+    /// Stop viewing some characters at the end.
+    inline void remove_suffix(size_t count) {
+      CPL_ASSERT(count <= m_size, "removing too many characters from a string view");
+      *this = span<const C>::first(m_size - std::min(count, m_size));
+    }
+
+    /// Find the first position of a character.
+    inline size_t find(C character, size_t position = 0) const {
+      span<const C>::validate();
+      if (position >= m_size) {
+        return npos;
+      }
+      const C* found = std::char_traits<C>::find(m_data + position, m_size - position, character);
+      return found ? size_t(found - m_data) : npos;
+    }
+
+    /// Find the first position of a sequence of characters.
+    inline size_t find(const basic_string_view<C>& needle, size_t position = 0) const {
+      span<const C>::validate();
+      needle.validate();
+      if (position > m_size || needle.m_size > m_size - position) {
+        return npos;
+      }
+      const C* end = m_data + m_size;
+      const C* found = std::search(m_data + position, end, needle.m_data, needle.m_data + needle.m_size);
+      return found == end && needle.m_size > 0 ? npos : size_t(found - m_data);
+    }
+
+    /// Compare with another view, like `strcmp`.
+    inline int compare(const basic_string_view<C>& other) const {
+      span<const C>::validate();
+      other.validate();
+      int result = std::char_traits<C>::compare(m_data, other.m_data, std::min(m_size, other.m_size));
+      return result != 0 ? result : m_size < other.m_size ? -1 : m_size > other.m_size ? 1 : 0;
+    }
+
+    /// Whether the view starts with some characters.
+    inline bool starts_with(const basic_string_view<C>& prefix) const {
+      return m_size >= prefix.m_size && substr(0, prefix.m_size).compare(prefix) == 0;
+    }
+
+    /// Whether the view ends with some characters.
+    inline bool ends_with(const basic_string_view<C>& suffix) const {
+      return m_size >= suffix.m_size && substr(m_size - suffix.m_size).compare(suffix) == 0;
+    }
+  };
+
+  template <typename C> constexpr size_t basic_string_view<C>::npos;
+
+/// Compare string views.
+#define CPL_COMPARE_STRING_VIEW(OPERATOR)                                                                                 \
+  template <typename C> inline bool operator OPERATOR(const basic_string_view<C>& lhs, const basic_string_view<C>& rhs) { \
+    return lhs.compare(rhs) OPERATOR 0;                                                                                   \
+  }
+
+  CPL_COMPARE_STRING_VIEW(> )
+  CPL_COMPARE_STRING_VIEW(< )
+  CPL_COMPARE_STRING_VIEW(>= )
+  CPL_COMPARE_STRING_VIEW(== )
+  CPL_COMPARE_STRING_VIEW(!= )
+  CPL_COMPARE_STRING_VIEW(<= )
+
+  /// A non-owning view of a sequence of characters.
+  typedef basic_string_view<char> string_view;
+
+  /// Create an unsafe view of a raw null-terminated string.
+  ///
+  /// This is playing with fire. It is OK if the data is static (such as a
+  /// string literal), but there's no way to ask the compiler to ensure that.
+  inline string_view unsafe_string_view(const char* c_str) {
+    return string_view{ c_str, std::char_traits<char>::length(c_str), unsafe_raw_t(0) };
+  }
+
+  /// The common implementation of @ref cpl::atomic_sptr and @ref
+  /// cpl::atomic_sref.
+  ///
+  /// This uses split reference counting. The held value lives in a node,
+  /// and the atomic word packs the node pointer (in the low 48 bits) together
+  /// with an "external" count of the readers currently accessing the node (in
+  /// the high 16 bits). A reader increments the external count, copies the
+  /// held value, and then decrements the count. A writer which replaces the
+  /// node moves the external count into the node's "internal" count, which
+  /// the remaining readers decrement instead; whoever brings it to zero
+  /// deletes the node. Thus neither readers nor writers ever take a lock.
+  ///
+  /// Packing the word requires node addresses to fit in 48 bits. Publishing a
+  /// value whose node does not (e.g., when the kernel hands out 57-bit
+  /// addresses) throws `std::bad_alloc`, in both modes. At most 65535 threads
+  /// may be in the middle of reading the value at the same time; additional
+  /// readers wait (yielding) until one of these is done.
+  template <typename T> class atomic_shared {
+    /// Hold a published value.
+    struct node {
+      /// The published value.
+      const std::shared_ptr<T> value;
+
+      /// The number of references to the node once it is no longer published.
+      std::atomic<int64_t> internal_count;
+
+      /// Construct a node holding a value.
+      inline node(const std::shared_ptr<T>& value) : value(value), internal_count(0) {
+      }
+    };
+
+    /// The increment of the external count in the atomic word.
+    static constexpr uint64_t external_unit = uint64_t(1) << 48;
+
+    /// The mask of the node pointer in the atomic word.
+    static constexpr uint64_t node_mask = external_unit - 1;
+
+    /// The packed node pointer and external count.
+    mutable std::atomic<uint64_t> m_word;
+
+    /// Access the node of an atomic word.
+    static inline node* node_of(uint64_t word) {
+      return reinterpret_cast<node*>(word & node_mask);
+    }
+
+    /// Create an atomic word for holding a value.
+    static inline uint64_t word_for(const std::shared_ptr<T>& value) {
+      if (!value) {
+        return 0;
+      }
+      node* held = new node(value);
+      uint64_t word = reinterpret_cast<uintptr_t>(held);
+      if ((word & ~node_mask) != 0) {
+        delete held;
+        throw std::bad_alloc();
+      }
+      return word;
+    }
+
+    /// Delete an unused atomic word (which was never published).
+    static inline void discard(uint64_t word) {
+      delete node_of(word);
+    }
+
+    /// Start accessing the current node, returning the incremented word.
+    inline uint64_t acquire() const {
+      uint64_t word = m_word.load();
+      while (node_of(word)) {
+        if (word >= ~node_mask) {
+          std::this_thread::yield();
+          word = m_word.load();
+        } else if (m_word.compare_exchange_weak(word, word + external_unit)) {
+          return word + external_unit;
+        }
+      }
+      return word;
+    }
+
+    /// Stop accessing a node obtained by `acquire`.
+    inline void release(uint64_t acquired) const {
+      node* acquired_node = node_of(acquired);
+      if (!acquired_node) {
+        return;
+      }
+      uint64_t word = m_word.load();
+      while (node_of(word) == acquired_node) {
+        if (m_word.compare_exchange_weak(word, word - external_unit)) {
+          return;
+        }
+      }
+      if (acquired_node->internal_count.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        delete acquired_node;
+      }
+    }
+
+    /// Stop publishing the node of a word, giving up `held` references to it.
+    static inline void retire(uint64_t word, int64_t held) {
+      node* retired_node = node_of(word);
+      if (!retired_node) {
+        return;
+      }
+      int64_t external_count = int64_t(word >> 48);
+      if (retired_node->internal_count.fetch_add(external_count - held, std::memory_order_acq_rel) == held - external_count) {
+        delete retired_node;
+      }
+    }
+
+  protected:
+    /// Publish an initial value.
+    inline atomic_shared(const std::shared_ptr<T>& value) : m_word(word_for(value)) {
+    }
+
+    /// Stop publishing the value.
+    inline ~atomic_shared() {
+      retire(m_word.load(), 0);
+    }
+
+    /// Access the published value.
+    inline std::shared_ptr<T> load_shared() const {
+      uint64_t acquired = acquire();
+      std::shared_ptr<T> value = node_of(acquired) ? node_of(acquired)->value : std::shared_ptr<T>();
+      release(acquired);
+      return value;
+    }
+
+    /// Publish a new value, returning the previous one.
+    inline std::shared_ptr<T> exchange_shared(const std::shared_ptr<T>& value) {
+      uint64_t previous = m_word.exchange(word_for(value));
+      std::shared_ptr<T> previous_value = node_of(previous) ? node_of(previous)->value : std::shared_ptr<T>();
+      retire(previous, 0);
+      return previous_value;
+    }
+
+    /// Whether two values are equivalent, that is, have the same pointer and
+    /// share ownership (or are both empty), as in `std::atomic<std::shared_ptr>`.
+    static inline bool is_equivalent(const std::shared_ptr<T>& lhs, const std::shared_ptr<T>& rhs) {
+      return lhs.get() == rhs.get() && !lhs.owner_before(rhs) && !rhs.owner_before(lhs);
+    }
+
+    /// Publish a new value if the published value is equivalent to the
+    /// expected one.
+    ///
+    /// Otherwise, update the expected value to the published one.
+    inline bool compare_exchange_shared(std::shared_ptr<T>& expected, const std::shared_ptr<T>& desired) {
+      uint64_t desired_word = word_for(desired);
+      for (;;) {
+        uint64_t acquired = acquire();
+        node* acquired_node = node_of(acquired);
+        if (!is_equivalent(acquired_node ? acquired_node->value : std::shared_ptr<T>(), expected)) {
+          expected = acquired_node ? acquired_node->value : std::shared_ptr<T>();
+          release(acquired);
+          discard(desired_word);
+          return false;
+        }
+        if (m_word.compare_exchange_strong(acquired, desired_word)) {
+          retire(acquired, acquired_node ? 1 : 0);
+          return true;
+        }
+        release(acquired);
+      }
+    }
+
+  public:
+    /// Forbid copying.
+    atomic_shared(const atomic_shared&) = delete;
+
+    /// Forbid copying.
+    atomic_shared& operator=(const atomic_shared&) = delete;
+
+    /// Whether the operations are lock-free (barring memory allocation).
+    inline bool is_lock_free() const {
+      return m_word.is_lock_free();
+    }
+  };
+
+  template <typename T> constexpr uint64_t atomic_shared<T>::external_unit;
+  template <typename T> constexpr uint64_t atomic_shared<T>::node_mask;
+
+  /// An atomic holder of a @ref cpl::sptr.
+  ///
+  /// Unlike `std::atomic_load` and friends on a `std::shared_ptr` (which are
+  /// implemented using a global lock table), all operations are lock-free, so
+  /// many threads may read a published snapshot without contention. Publishing
+  /// a new value allocates a small node. See @ref cpl::atomic_shared for the
+  /// limits on node addresses and the number of concurrent readers.
+  ///
+  /// As in `std::atomic<std::shared_ptr>`, comparing with the expected value
+  /// requires both the same pointer and shared ownership.
+  template <typename T> class atomic_sptr : public atomic_shared<T> {
+  public:
+    /// Hold a null pointer.
+    inline atomic_sptr() : atomic_shared<T>(std::shared_ptr<T>()) {
+    }
+
+    /// Hold an initial value.
+    inline atomic_sptr(const sptr<T>& value) : atomic_shared<T>(value) {
+    }
+
+    /// Access the held value.
+    inline sptr<T> load() const {
+      return sptr<T>(atomic_shared<T>::load_shared());
+    }
+
+    /// Access the held value.
+    inline operator sptr<T>() const {
+      return load();
+    }
+
+    /// Replace the held value.
+    inline void store(const sptr<T>& value) {
+      atomic_shared<T>::exchange_shared(value);
+    }
+
+    /// Replace the held value.
+    inline atomic_sptr& operator=(const sptr<T>& value) {
+      store(value);
+      return *this;
+    }
+
+    /// Replace the held value, returning the previous one.
+    inline sptr<T> exchange(const sptr<T>& value) {
+      return sptr<T>(atomic_shared<T>::exchange_shared(value));
+    }
+
+    /// Replace the held value if it is the expected one.
+    ///
+    /// Otherwise, update the expected value to the held one.
+    inline bool compare_exchange_strong(sptr<T>& expected, const sptr<T>& desired) {
+      return atomic_shared<T>::compare_exchange_shared(expected, desired);
+    }
+
+    /// Replace the held value if it is the expected one.
+    ///
+    /// This never fails spuriously, and is provided for compatibility with
+    /// `std::atomic`.
+    inline bool compare_exchange_weak(sptr<T>& expected, const sptr<T>& desired) {
+      return atomic_shared<T>::compare_exchange_shared(expected, desired);
+    }
+  };
+
+  /// An atomic holder of a @ref cpl::sref.
+  ///
+  /// This is identical to @ref cpl::atomic_sptr, except that the held value
+  /// may never be null.
+  template <typename T> class atomic_sref : public atomic_shared<T> {
+  public:
+    /// Hold an initial value.
+    inline atomic_sref(const sref<T>& value) : atomic_shared<T>(value) {
+    }
+
+    /// Access the held value.
+    inline sref<T> load() const {
+      return sref<T>(sptr<T>(atomic_shared<T>::load_shared()));
+    }
+
+    /// Access the held value.
+    inline operator sref<T>() const {
+      return load();
+    }
+
+    /// Replace the held value.
+    inline void store(const sref<T>& value) {
+      atomic_shared<T>::exchange_shared(value);
+    }
+
+    /// Replace the held value.
+    inline atomic_sref& operator=(const sref<T>& value) {
+      store(value);
+      return *this;
+    }
+
+    /// Replace the held value, returning the previous one.
+    inline sref<T> exchange(const sref<T>& value) {
+      return sref<T>(sptr<T>(atomic_shared<T>::exchange_shared(value)));
+    }
+
+    /// Replace the held value if it is the expected one.
+    ///
+    /// Otherwise, update the expected value to the held one.
+    inline bool compare_exchange_strong(sref<T>& expected, const sref<T>& desired) {
+      std::shared_ptr<T> raw_expected = expected;
+      bool did_exchange = atomic_shared<T>::compare_exchange_shared(raw_expected, desired);
+      if (!did_exchange) {
+        expected = sref<T>(sptr<T>(raw_expected));
+      }
+      return did_exchange;
+    }
+
+    /// Replace the held value if it is the expected one.
+    ///
+    /// This never fails spuriously, and is provided for compatibility with
+    /// `std::atomic`.
+    inline bool compare_exchange_weak(sref<T>& expected, const sref<T>& desired) {
+      return compare_exchange_strong(expected, desired);
+    }
+  };
+
+#ifndef CPL_WITHOUT_COLLECTIONS // {
+
+  /// Remember the per-thread records a thread has claimed.
+  ///
+  /// This is used by @ref cpl::thread_registry. When the thread exits, all the
+  /// records it claimed are released, so other threads may reuse them.
+  class thread_cache {
+    /// A record claimed by the thread.
+    struct entry {
+      /// The unique identifier of the registry.
+      uint64_t registry_id;
+
+      /// Track the lifetime of the registry's records.
+      std::weak_ptr<void> records;
+
+      /// Whether the record is claimed.
+      std::atomic<bool>* is_claimed;
+
+      /// The claimed record.
+      void* record;
+    };
+
+    /// The claimed records.
+    std::vector<entry> m_entries;
+
+  public:
+    /// Access the cache of the current thread.
+    static inline thread_cache& local() {
+      static thread_local thread_cache cache;
+      return cache;
+    }
+
+    /// Release all the claimed records.
+    inline ~thread_cache() {
+      for (entry& claimed : m_entries) {
+        std::shared_ptr<void> records = claimed.records.lock();
+        if (records) {
+          claimed.is_claimed->store(false, std::memory_order_release);
+        }
+      }
+    }
+
+    /// Find the record claimed from some registry, if any.
+    inline void* find(uint64_t registry_id) const {
+      for (const entry& claimed : m_entries) {
+        if (claimed.registry_id == registry_id) {
+          return claimed.record;
+        }
+      }
+      return nullptr;
+    }
+
+    /// Remember a newly claimed record.
+    inline void add(uint64_t registry_id, const std::shared_ptr<void>& records, std::atomic<bool>& is_claimed, void* record) {
+      m_entries.erase(std::remove_if(m_entries.begin(),
+                                     m_entries.end(),
+                                     [](const entry& claimed) { return claimed.records.expired(); }),
+                      m_entries.end());
+      m_entries.push_back(entry{ registry_id, records, &is_claimed, record });
+    }
+  };
+
+  /// A registry of per-thread records.
+  ///
+  /// Each thread accessing the registry claims its own record (on its first
+  /// access), which it keeps until it exits. The record is then released, and
+  /// may be claimed by another thread, but is never deleted until the registry
+  /// is. Records are placed in separate cache lines to avoid false sharing.
+  ///
+  /// This is the basis of several of the concurrency mechanisms provided by
+  /// CPL, such as @ref cpl::epoch_domain.
+  template <typename R> class thread_registry {
+    /// Hold a record.
+    struct alignas(CPL_CACHE_LINE_SIZE) node {
+      /// The record.
+      R record;
+
+      /// Whether the record is claimed by some thread.
+      std::atomic<bool> is_claimed{ true };
+
+      /// The next node in the registry.
+      node* next = nullptr;
+
+      /// Allocate aligned storage.
+      static inline void* operator new(size_t size) {
+        return allocate_aligned(size, CPL_CACHE_LINE_SIZE);
+      }
+
+      /// Free aligned storage.
+      static inline void operator delete(void* data) {
+        free_aligned(data);
+      }
+    };
+
+    /// The list of all the nodes.
+    struct node_list {
+      /// The first node.
+      std::atomic<node*> head{ nullptr };
+
+      /// Delete all the nodes.
+      inline ~node_list() {
+        node* next = head.load();
+        while (next) {
+          node* deleted = next;
+          next = next->next;
+          delete deleted;
+        }
+      }
+    };
+
+    /// The nodes (tracked so that exiting threads know whether they exist).
+    std::shared_ptr<node_list> m_nodes;
+
+    /// A unique identifier for the registry.
+    uint64_t m_id;
+
+    /// Generate a unique registry identifier.
+    static inline uint64_t next_id() {
+      static std::atomic<uint64_t> last_id{ 0 };
+      return ++last_id;
+    }
+
+    /// Claim a released node, or create a new one.
+    inline node* claim() {
+      for (node* claimed = m_nodes->head.load(); claimed; claimed = claimed->next) {
+        bool is_claimed = false;
+        if (!claimed->is_claimed.load(std::memory_order_relaxed)
+            && claimed->is_claimed.compare_exchange_strong(is_claimed, true, std::memory_order_acquire)) {
+          return claimed;
+        }
+      }
+      node* created = new node();
+      created->next = m_nodes->head.load();
+      while (!m_nodes->head.compare_exchange_weak(created->next, created)) {
+      }
+      return created;
+    }
+
+  public:
+    /// An empty registry.
+    inline thread_registry() : m_nodes(std::make_shared<node_list>()), m_id(next_id()) {
+    }
+
+    /// Forbid copying.
+    thread_registry(const thread_registry&) = delete;
+
+    /// Forbid copying.
+    thread_registry& operator=(const thread_registry&) = delete;
+
+    /// Access the record of the current thread.
+    inline R& local() {
+      thread_cache& cache = thread_cache::local();
+      void* record = cache.find(m_id);
+      if (record) {
+        return *static_cast<R*>(record);
+      }
+      node* claimed = claim();
+      cache.add(m_id, m_nodes, claimed->is_claimed, &claimed->record);
+      return claimed->record;
+    }
+
+    /// Invoke a function on all the records (claimed or not).
+    ///
+    /// Other threads may be concurrently accessing their records, and new
+    /// records may be concurrently added (and will be skipped).
+    template <typename F> inline void for_each(F function) const {
+      for (node* visited = m_nodes->head.load(); visited; visited = visited->next) {
+        function(visited->record);
+      }
+    }
+  };
+
+  /// A retired @ref cpl::uref, waiting to be deleted.
+  ///
+  /// This erases the type of the owned node, so that reclamation domains may
+  /// hold nodes of different types. It is a plain value; the node is only
+  /// deleted by an explicit call to `destroy`.
+  class retired_uref {
+    /// The node.
+    void* m_node;
+
+    /// Delete the node.
+    void (*m_delete)(void* node);
+
+    /// Delete a typed node.
+    template <typename T> static inline void delete_node(void* node) {
+      delete static_cast<T*>(node);
+    }
+
+  public:
+    /// Take ownership of a node.
+    ///
+    /// This does not allocate. When emplaced into a container, the node is
+    /// therefore only released once there is room for it; if growing the
+    /// container fails, the node remains owned by the original @ref
+    /// cpl::uref.
+    template <typename T>
+    inline explicit retired_uref(uref<T>&& node) noexcept
+      : m_node(const_cast<typename std::remove_cv<T>::type*>(node.get())), m_delete(&delete_node<T>) {
+      node.release();
+    }
+
+    /// The address of the node.
+    inline const void* address() const {
+      return m_node;
+    }
+
+    /// Delete the node.
+    inline void destroy() {
+      m_delete(m_node);
+    }
+  };
+
+  // Forward declare for the domain.
+  class epoch_guard;
+
+  /// A domain of epoch-based memory reclamation.
+  ///
+  /// This allows lock-free data structures to be built from nodes owned by
+  /// @ref cpl::uref. A reader enters an @ref cpl::epoch_guard, and may then
+  /// access any node it reaches (using `protect`) without any reference
+  /// counting. A writer which unlinks a node from the data structure passes
+  /// its ownership to `retire`, which deletes the node only after all the
+  /// readers which may have reached it have left their guards.
+  ///
+  /// Retired nodes are reclaimed in batches, either automatically when
+  /// enough of them accumulate, or explicitly using `reclaim`. A stalled
+  /// reader prevents all reclamation; see @ref cpl::hazard_domain for an
+  /// alternative which bounds the amount of unreclaimed memory.
+  class epoch_domain {
+    friend class epoch_guard;
+
+    /// The state of a thread.
+    struct record {
+      /// The epoch the thread entered, or zero if it is not in a guard.
+      std::atomic<uint64_t> epoch{ 0 };
+
+      /// The number of nested guards of the thread.
+      size_t depth = 0;
+    };
+
+    /// A retired node waiting to be deleted.
+    struct retired {
+      /// The epoch in which the node was retired.
+      uint64_t epoch;
+
+      /// The node.
+      retired_uref node;
+
+      /// Take ownership of a node retired in some epoch.
+      template <typename T>
+      inline retired(uint64_t retired_epoch, uref<T>&& retired_node) noexcept
+        : epoch(retired_epoch), node(std::move(retired_node)) {
+      }
+    };
+
+    /// The per-thread states.
+    thread_registry<record> m_records;
+
+    /// The current epoch.
+    std::atomic<uint64_t> m_epoch{ 1 };
+
+    /// Protect the retired nodes.
+    std::mutex m_mutex;
+
+    /// The retired nodes (in the order of their epochs).
+    std::vector<retired> m_retired;
+
+    /// The number of retired nodes which trigger an automatic reclamation.
+    size_t m_batch_size;
+
+    /// Remove the retired nodes which may be deleted (without deleting them).
+    inline std::vector<retired> collect() {
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      uint64_t oldest_epoch = m_epoch.load();
+      m_records.for_each([&oldest_epoch](const record& thread_record) {
+        uint64_t epoch = thread_record.epoch.load();
+        if (epoch != 0 && epoch < oldest_epoch) {
+          oldest_epoch = epoch;
+        }
+      });
+      std::lock_guard<std::mutex> lock(m_mutex);
+      auto end = std::find_if(m_retired.begin(), m_retired.end(), [oldest_epoch](const retired& retired_node) {
+        return retired_node.epoch >= oldest_epoch;
+      });
+      std::vector<retired> collected(m_retired.begin(), end);
+      m_retired.erase(m_retired.begin(), end);
+      return collected;
+    }
+
+  public:
+    /// A domain which automatically reclaims nodes in batches of some size.
+    inline explicit epoch_domain(size_t batch_size = 64) : m_batch_size(batch_size) {
+    }
+
+    /// Delete all the retired nodes.
+    ///
+    /// The domain must not be deleted while there are readers in it.
+    inline ~epoch_domain() {
+      for (retired& retired_node : m_retired) {
+        retired_node.node.destroy();
+      }
+    }
+
+    /// Pass ownership of an unlinked node to the domain.
+    ///
+    /// The node will be deleted once all the readers that may have reached it
+    /// have left their guards. If the domain fails to store it, the node
+    /// stays owned by the given @ref cpl::uref.
+    template <typename T> inline void retire(uref<T>&& node) {
+      size_t retired_count;
+      {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_retired.emplace_back(m_epoch.fetch_add(1), std::move(node));
+        retired_count = m_retired.size();
+      }
+      if (retired_count >= m_batch_size) {
+        reclaim();
+      }
+    }
+
+    /// Delete all the retired nodes which are no longer reachable by readers.
+    ///
+    /// Returns the number of deleted nodes.
+    inline size_t reclaim() {
+      std::vector<retired> collected = collect();
+      for (retired& retired_node : collected) {
+        retired_node.node.destroy();
+      }
+      return collected.size();
+    }
+
+    /// Wait until all the nodes retired so far are deleted.
+    ///
+    /// This must not be invoked by a thread which is inside a guard, as it
+    /// would wait forever.
+    inline void synchronize() {
+      CPL_ASSERT(m_records.local().depth == 0, "synchronizing an epoch domain inside a guard");
+      uint64_t epoch = m_epoch.load();
+      for (;;) {
+        reclaim();
+        {
+          std::lock_guard<std::mutex> lock(m_mutex);
+          if (m_retired.empty() || m_retired.front().epoch >= epoch) {
+            return;
+          }
+        }
+        std::this_thread::yield();
+      }
+    }
+
+    /// The number of retired nodes which were not deleted yet.
+    inline size_t retired_count() {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      return m_retired.size();
+    }
+  };
+
+  /// A scope in which a thread may access nodes of an @ref cpl::epoch_domain.
+  ///
+  /// In safe mode, the borrows given by `protect` expire when the guard is
+  /// destroyed, so using them outside the guard is detected.
+  class epoch_guard {
+    /// The domain of the nodes.
+    epoch_domain& m_domain;
+
+    /// The state of the current thread.
+    epoch_domain::record& m_record;
+
+#ifdef CPL_SAFE // {
+    /// Track the lifetime of the guard.
+    std::shared_ptr<void> m_token;
+#endif // } CPL_SAFE
+
+  public:
+    /// Enter the current epoch of a domain.
+    inline explicit epoch_guard(epoch_domain& domain)
+      : m_domain(domain),
+        m_record(domain.m_records.local())
+#ifdef CPL_SAFE // {
+        ,
+        m_token(this, no_delete<epoch_guard>())
+#endif // } CPL_SAFE
+    {
+      if (m_record.depth++ == 0) {
+        m_record.epoch.store(m_domain.m_epoch.load());
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+      }
+    }
+
+    /// Forbid copying.
+    epoch_guard(const epoch_guard&) = delete;
+
+    /// Forbid copying.
+    epoch_guard& operator=(const epoch_guard&) = delete;
+
+    /// Leave the epoch.
+    inline ~epoch_guard() {
+      if (--m_record.depth == 0) {
+        m_record.epoch.store(0, std::memory_order_release);
+      }
+    }
+
+    /// The domain whose epoch was entered.
+    inline epoch_domain& domain() const {
+      return m_domain;
+    }
+
+    /// Borrow a node which is reachable from some atomic pointer.
+    ///
+    /// In safe mode, the borrow expires when the guard is destroyed.
+    template <typename T> inline ptr<T> protect(const std::atomic<T*>& source) const {
+      return borrow(source.load(std::memory_order_acquire));
+    }
+
+    /// Borrow a node which was reached while in the guard.
+    ///
+    /// In safe mode, the borrow expires when the guard is destroyed.
+    template <typename T> inline ptr<T> borrow(T* raw_ptr) const {
+#ifdef CPL_FAST // {
+      return ptr<T>{ raw_ptr, unsafe_raw_t(0) };
+#endif          // } CPL_FAST
+#ifdef CPL_SAFE // {
+      if (!raw_ptr) {
+        return ptr<T>();
+      }
+      return ptr<T>(sptr<T>(std::shared_ptr<T>(m_token, raw_ptr)));
+#endif // } CPL_SAFE
+    }
+  };
+
+  /// A read-copy-update cell for read-mostly values.
+  ///
+  /// The current version of the value is held by a @ref cpl::sref. Readers
+  /// enter an @ref cpl::epoch_guard of the cell's domain and `read` the
+  /// current version, which only costs an atomic load (in fast mode). Writers
+  /// `update` a copy of the current version and publish it; the previous
+  /// version is retired into the domain, and is released once all the
+  /// readers which may be using it have left their guards. Writers are
+  /// serialized by a mutex.
+  ///
+  /// In safe mode, the borrow given by `read` expires when the guard is
+  /// destroyed, so using a version after its grace period is detected. A
+  /// version which must outlive the guard may be obtained using `load`.
+  template <typename T> class rcu {
+    /// The domain used for reclaiming old versions.
+    epoch_domain& m_domain;
+
+    /// The current version.
+    std::atomic<const T*> m_current;
+
+    /// Serialize the writers (and protect `m_owner`).
+    mutable std::mutex m_mutex;
+
+    /// Own the current version.
+    sref<const T> m_owner;
+
+    /// Publish a new version (while holding the mutex).
+    inline void publish(const sref<const T>& version) {
+      sref<const T> previous = m_owner;
+      m_owner = version;
+      m_current.store(version.get(), std::memory_order_release);
+      m_domain.retire(make_uref<sref<const T>>(std::move(previous)));
+    }
+
+  public:
+    /// A cell holding an initial version.
+    inline rcu(epoch_domain& domain, const sref<const T>& initial)
+      : m_domain(domain), m_current(initial.get()), m_owner(initial) {
+    }
+
+    /// Forbid copying.
+    rcu(const rcu&) = delete;
+
+    /// Forbid copying.
+    rcu& operator=(const rcu&) = delete;
+
+    /// The domain used for reclaiming old versions.
+    inline epoch_domain& domain() const {
+      return m_domain;
+    }
+
+    /// Borrow the current version.
+    ///
+    /// In safe mode, the borrow expires when the guard is destroyed.
+    inline ref<const T> read(const epoch_guard& guard) const {
+      CPL_ASSERT(&guard.domain() == &m_domain, "reading an rcu cell with a guard of a different domain");
+      return guard.borrow(m_current.load(std::memory_order_acquire)).ref();
+    }
+
+    /// Share the current version.
+    ///
+    /// This takes the writers' mutex, so it is much slower than `read`.
+    inline sref<const T> load() const {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      return m_owner;
+    }
+
+    /// Publish a new version.
+    inline void store(const sref<const T>& version) {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      publish(version);
+    }
+
+    /// Publish a modified copy of the current version.
+    ///
+    /// The modification function is given a `T&` of the copy.
+    template <typename F> inline void update(F modify) {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      sref<T> version = make_sref<T>(*m_owner);
+      modify(*version);
+      publish(version);
+    }
+  };
+
+  // Forward declare for the domain.
+  template <typename T> class hazard_ptr;
+
+  /// A domain of hazard-pointer-based memory reclamation.
+  ///
+  /// This is an alternative to @ref cpl::epoch_domain. A reader publishes
+  /// each node it accesses in a @ref cpl::hazard_ptr before using it. A writer
+  /// which unlinks a node from the data structure passes its ownership to
+  /// `retire`, which deletes the node once no hazard pointer protects it.
+  ///
+  /// Protecting a node costs a little more than entering an epoch, but a
+  /// stalled reader only prevents deleting the few nodes it protects. The
+  /// number of retired nodes which were not deleted yet is therefore bounded
+  /// by the batch size plus the number of hazard pointers.
+  class hazard_domain {
+    template <typename T> friend class hazard_ptr;
+
+    /// A published hazard.
+    struct alignas(CPL_CACHE_LINE_SIZE) slot {
+      /// The protected node, if any.
+      std::atomic<const void*> hazard{ nullptr };
+
+      /// Whether the slot is used by some hazard pointer.
+      std::atomic<bool> is_claimed{ true };
+
+      /// The next slot in the domain.
+      slot* next = nullptr;
+
+      /// Allocate aligned storage.
+      static inline void* operator new(size_t size) {
+        return allocate_aligned(size, CPL_CACHE_LINE_SIZE);
+      }
+
+      /// Free aligned storage.
+      static inline void operator delete(void* data) {
+        free_aligned(data);
+      }
+    };
+
+    /// All the slots.
+    std::atomic<slot*> m_slots{ nullptr };
+
+    /// Protect the retired nodes.
+    std::mutex m_mutex;
+
+    /// The retired nodes.
+    std::vector<retired_uref> m_retired;
+
+    /// The number of retired nodes which trigger an automatic reclamation.
+    size_t m_batch_size;
+
+    /// Claim an unused slot, or create a new one.
+    inline slot* claim() {
+      for (slot* claimed = m_slots.load(); claimed; claimed = claimed->next) {
+        bool is_claimed = false;
+        if (!claimed->is_claimed.load(std::memory_order_relaxed)
+            && claimed->is_claimed.compare_exchange_strong(is_claimed, true, std::memory_order_acquire)) {
+          return claimed;
+        }
+      }
+      slot* created = new slot();
+      created->next = m_slots.load();
+      while (!m_slots.compare_exchange_weak(created->next, created)) {
+      }
+      return created;
+    }
+
+  public:
+    /// A domain which automatically reclaims nodes in batches of some size.
+    inline explicit hazard_domain(size_t batch_size = 64) : m_batch_size(batch_size) {
+    }
+
+    /// Delete all the retired nodes and the slots.
+    ///
+    /// The domain must not be deleted while there are hazard pointers in it.
+    inline ~hazard_domain() {
+      for (retired_uref& retired_node : m_retired) {
+        retired_node.destroy();
+      }
+      slot* next = m_slots.load();
+      while (next) {
+        slot* deleted = next;
+        next = next->next;
+        delete deleted;
+      }
+    }
+
+    /// Forbid copying.
+    hazard_domain(const hazard_domain&) = delete;
+
+    /// Forbid copying.
+    hazard_domain& operator=(const hazard_domain&) = delete;
+
+    /// Pass ownership of an unlinked node to the domain.
+    ///
+    /// The node will be deleted once no hazard pointer protects it. If the
+    /// domain fails to store it, it stays owned by the given @ref cpl::uref.
+    template <typename T> inline void retire(uref<T>&& node) {
+      size_t retired_count;
+      {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_retired.emplace_back(std::move(node));
+        retired_count = m_retired.size();
+      }
+      if (retired_count >= m_batch_size) {
+        reclaim();
+      }
+    }
+
+    /// Delete all the retired nodes which are not protected by any hazard
+    /// pointer.
+    ///
+    /// Returns the number of deleted nodes.
+    inline size_t reclaim() {
+      std::vector<retired_uref> candidates;
+      {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        candidates.swap(m_retired);
+      }
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      std::vector<const void*> hazards;
+      for (slot* visited = m_slots.load(); visited; visited = visited->next) {
+        const void* hazard = visited->hazard.load();
+        if (hazard) {
+          hazards.push_back(hazard);
+        }
+      }
+      std::sort(hazards.begin(), hazards.end());
+      auto protected_end =
+        std::partition(candidates.begin(), candidates.end(), [&hazards](const retired_uref& retired_node) {
+          return std::binary_search(hazards.begin(), hazards.end(), retired_node.address());
+        });
+      if (protected_end != candidates.begin()) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_retired.insert(m_retired.end(), candidates.begin(), protected_end);
+      }
+      for (auto deleted = protected_end; deleted != candidates.end(); ++deleted) {
+        deleted->destroy();
+      }
+      return size_t(candidates.end() - protected_end);
+    }
+
+    /// The number of retired nodes which were not deleted yet.
+    inline size_t retired_count() {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      return m_retired.size();
+    }
+  };
+
+  /// A pointer which protects a node of a @ref cpl::hazard_domain.
+  ///
+  /// The hazard pointer claims a slot in the domain when it is created, and
+  /// releases it when it is destroyed, so it is best to keep it around (for
+  /// example, one per reader thread) and reuse it for protecting successive
+  /// nodes. A hazard pointer must only be used by one thread at a time.
+  ///
+  /// In safe mode, the borrows given by `protect` expire when the hazard
+  /// pointer protects a different node, is reset, or is destroyed.
+  template <typename T> class hazard_ptr {
+    /// The published hazard.
+    hazard_domain::slot* m_slot;
+
+#ifdef CPL_SAFE // {
+    /// Track the lifetime of the protection.
+    std::shared_ptr<void> m_token;
+#endif // } CPL_SAFE
+
+    /// Borrow the protected node.
+    inline ptr<T> borrow(T* raw_ptr) {
+#ifdef CPL_FAST // {
+      return ptr<T>{ raw_ptr, unsafe_raw_t(0) };
+#endif          // } CPL_FAST
+#ifdef CPL_SAFE // {
+      m_token.reset(this, no_delete<hazard_ptr>());
+      if (!raw_ptr) {
+        return ptr<T>();
+      }
+      return ptr<T>(sptr<T>(std::shared_ptr<T>(m_token, raw_ptr)));
+#endif // } CPL_SAFE
+    }
+
+  public:
+    /// Claim a slot in a domain.
+    inline explicit hazard_ptr(hazard_domain& domain) : m_slot(domain.claim()) {
+    }
+
+    /// Release the slot.
+    inline ~hazard_ptr() {
+      m_slot->hazard.store(nullptr, std::memory_order_release);
+      m_slot->is_claimed.store(false, std::memory_order_release);
+    }
+
+    /// Forbid copying.
+    hazard_ptr(const hazard_ptr&) = delete;
+
+    /// Forbid copying.
+    hazard_ptr& operator=(const hazard_ptr&) = delete;
+
+    /// Protect and borrow the node pointed to by some atomic pointer.
+    ///
+    /// This stops protecting any previously protected node.
+    inline ptr<T> protect(const std::atomic<T*>& source) {
+      T* raw_ptr = source.load(std::memory_order_relaxed);
+      for (;;) {
+        m_slot->hazard.store(raw_ptr);
+        T* validated_ptr = source.load();
+        if (validated_ptr == raw_ptr) {
+          return borrow(raw_ptr);
+        }
+        raw_ptr = validated_ptr;
+      }
+    }
+
+    /// Stop protecting the node.
+    inline void reset() {
+      m_slot->hazard.store(nullptr, std::memory_order_release);
+#ifdef CPL_SAFE // {
+      m_token.reset();
+#endif // } CPL_SAFE
+    }
+  };
+
+#endif // } CPL_WITHOUT_COLLECTIONS
+
+  /// A bounded queue moving ownership of values between threads.
+  ///
+  /// Any number of threads may concurrently send and receive @ref cpl::uref
+  /// values, without locking (this is Vyukov's bounded MPMC queue). The
+  /// capacity is rounded up to a power of two. The send and receive positions
+  /// are placed in separate cache lines.
+  ///
+  /// In safe mode, sending a value revokes all its borrows, so a sender which
+  /// still uses a @ref cpl::ref or @ref cpl::ptr to a value it has sent is
+  /// detected.
+  template <typename T> class channel {
+    /// Hold a sent value.
+    struct cell {
+      /// The position the cell is ready for.
+      std::atomic<size_t> sequence;
+
+      /// The sent value (if any).
+      uptr<T> value;
+    };
+
+    /// The cells holding the values.
+    uref<cell[]> m_cells;
+
+    /// The mask for converting a position to a cell index.
+    size_t m_mask;
+
+    /// The position of the next sent value.
+    padded<std::atomic<size_t>> m_send_position;
+
+    /// The position of the next received value.
+    padded<std::atomic<size_t>> m_receive_position;
+
+    /// The smallest power of two which is at least some capacity.
+    static inline size_t round_capacity(size_t capacity) {
+      CPL_ASSERT(capacity > 0, "creating an empty channel");
+      size_t rounded = 2;
+      while (rounded < capacity) {
+        rounded *= 2;
+      }
+      return rounded;
+    }
+
+  public:
+    /// A channel which may hold (at least) some number of values.
+    inline explicit channel(size_t capacity)
+      : m_cells(make_uref_array<cell>(round_capacity(capacity), CPL_CACHE_LINE_SIZE)),
+        m_mask(m_cells.size() - 1),
+        m_send_position(0),
+        m_receive_position(0) {
+      for (size_t index = 0; index < m_cells.size(); ++index) {
+        m_cells[index].sequence.store(index, std::memory_order_relaxed);
+      }
+    }
+
+    /// Forbid copying.
+    channel(const channel&) = delete;
+
+    /// Forbid copying.
+    channel& operator=(const channel&) = delete;
+
+    /// Allocate aligned storage.
+    static inline void* operator new(size_t size) {
+      return allocate_aligned(size, CPL_CACHE_LINE_SIZE);
+    }
+
+    /// Free aligned storage.
+    static inline void operator delete(void* data) {
+      free_aligned(data);
+    }
+
+    /// The maximal number of values held by the channel.
+    inline size_t capacity() const {
+      return m_mask + 1;
+    }
+
+    /// Send a value, unless the channel is full.
+    ///
+    /// The value is only moved from if it was sent.
+    inline bool try_send(uref<T>&& value) {
+      size_t position = m_send_position->load(std::memory_order_relaxed);
+      cell* target;
+      for (;;) {
+        target = &m_cells[position & m_mask];
+        size_t sequence = target->sequence.load(std::memory_order_acquire);
+        intptr_t difference = intptr_t(sequence) - intptr_t(position);
+        if (difference == 0) {
+          if (m_send_position->compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+            break;
+          }
+        } else if (difference < 0) {
+          return false;
+        } else {
+          position = m_send_position->load(std::memory_order_relaxed);
+        }
+      }
+      value.revoke();
+      unique<T>& sent = target->value;
+      sent = std::move(value);
+      target->sequence.store(position + 1, std::memory_order_release);
+      return true;
+    }
+
+    /// Receive a value, unless the channel is empty.
+    inline uptr<T> try_receive() {
+      size_t position = m_receive_position->load(std::memory_order_relaxed);
+      cell* source;
+      for (;;) {
+        source = &m_cells[position & m_mask];
+        size_t sequence = source->sequence.load(std::memory_order_acquire);
+        intptr_t difference = intptr_t(sequence) - intptr_t(position + 1);
+        if (difference == 0) {
+          if (m_receive_position->compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+            break;
+          }
+        } else if (difference < 0) {
+          return nullptr;
+        } else {
+          position = m_receive_position->load(std::memory_order_relaxed);
+        }
+      }
+      uptr<T> received(std::move(source->value));
+      source->sequence.store(position + m_mask + 1, std::memory_order_release);
+      return received;
+    }
+
+    /// Send a value, waiting while the channel is full.
+    inline void send(uref<T>&& value) {
+      while (!try_send(std::move(value))) {
+        std::this_thread::yield();
+      }
+    }
+
+    /// Receive a value, waiting while the channel is empty.
+    inline uref<T> receive() {
+      for (;;) {
+        uptr<T> received = try_receive();
+        if (received) {
+          return received.uref();
+        }
+        std::this_thread::yield();
+      }
+    }
+  };
+
+  /// A bounded ring of values from a single producer thread to a single
+  /// consumer thread.
+  ///
+  /// Pushing and popping values are wait-free. Each side caches the position
+  /// of the other side, and only reloads it when the ring seems full (or
+  /// empty), and the state of each side is placed in a separate cache line.
+  /// Values may also be pushed and popped in batches, by directly writing to
+  /// (or reading from) a @ref cpl::span of the ring's slots, and then
+  /// committing the number of values written (or read). The capacity is
+  /// rounded up to a power of two.
+  ///
+  /// Since the spans give direct access to the slots, these always hold
+  /// constructed values. Therefore `T` must be default-constructible (all the
+  /// slots are default-constructed when the ring is created), and a popped
+  /// value is moved out of (or, using a span, just read from) its slot, which
+  /// keeps the remains until a later push overwrites them. Values holding
+  /// resources should therefore release them when moved from.
+  ///
+  /// In safe mode, this verifies that all pushes are done by the same thread,
+  /// that all pops are done by the same thread, and that committing a batch
+  /// does not exceed the span given for it.
+  template <typename T> class spsc_ring {
+    /// The state of the producer.
+    struct alignas(CPL_CACHE_LINE_SIZE) producer_state {
+      /// The position of the next pushed value.
+      std::atomic<size_t> tail{ 0 };
+
+      /// The last loaded position of the next popped value.
+      size_t cached_head = 0;
+
+      /// The size of the last span given for pushing.
+      size_t prepared = 0;
+
+#ifdef CPL_SAFE // {
+      /// The thread pushing the values.
+      std::atomic<std::thread::id> thread{ std::thread::id() };
+#endif // } CPL_SAFE
+    };
+
+    /// The state of the consumer.
+    struct alignas(CPL_CACHE_LINE_SIZE) consumer_state {
+      /// The position of the next popped value.
+      std::atomic<size_t> head{ 0 };
+
+      /// The last loaded position of the next pushed value.
+      size_t cached_tail = 0;
+
+      /// The size of the last span given for popping.
+      size_t prepared = 0;
+
+#ifdef CPL_SAFE // {
+      /// The thread popping the values.
+      std::atomic<std::thread::id> thread{ std::thread::id() };
+#endif // } CPL_SAFE
+    };
+
+    /// The slots holding the values.
+    uref<T[]> m_slots;
+
+    /// The mask for converting a position to a slot index.
+    size_t m_mask;
+
+    /// The state of the producer.
+    producer_state m_producer;
+
+    /// The state of the consumer.
+    consumer_state m_consumer;
+
+    /// The smallest power of two which is at least some capacity.
+    static inline size_t round_capacity(size_t capacity) {
+      CPL_ASSERT(capacity > 0, "creating an empty ring");
+      size_t rounded = 1;
+      while (rounded < capacity) {
+        rounded *= 2;
+      }
+      return rounded;
+    }
+
+#ifdef CPL_SAFE // {
+    /// Whether the current thread is the (first) thread to use one side of
+    /// the ring.
+    static inline bool is_only_thread(std::atomic<std::thread::id>& thread) {
+      std::thread::id current = std::this_thread::get_id();
+      std::thread::id previous = std::thread::id();
+      return thread.compare_exchange_strong(previous, current) || previous == current;
+    }
+#endif // } CPL_SAFE
+
+    /// The number of free slots the producer may write to.
+    inline size_t free_count() {
+#ifdef CPL_SAFE // {
+      CPL_ASSERT(is_only_thread(m_producer.thread), "pushing to a ring from more than one thread");
+#endif // } CPL_SAFE
+      size_t tail = m_producer.tail.load(std::memory_order_relaxed);
+      if (tail - m_producer.cached_head > m_mask) {
+        m_producer.cached_head = m_consumer.head.load(std::memory_order_acquire);
+      }
+      return m_mask + 1 - (tail - m_producer.cached_head);
+    }
+
+    /// The number of pushed values the consumer may read from.
+    inline size_t ready_count() {
+#ifdef CPL_SAFE // {
+      CPL_ASSERT(is_only_thread(m_consumer.thread), "popping from a ring from more than one thread");
+#endif // } CPL_SAFE
+      size_t head = m_consumer.head.load(std::memory_order_relaxed);
+      if (m_consumer.cached_tail == head) {
+        m_consumer.cached_tail = m_producer.tail.load(std::memory_order_acquire);
+      }
+      return m_consumer.cached_tail - head;
+    }
+
+  public:
+    /// A ring which may hold (at least) some number of values.
+    inline explicit spsc_ring(size_t capacity)
+      : m_slots(make_uref_array<T>(round_capacity(capacity), CPL_CACHE_LINE_SIZE)), m_mask(m_slots.size() - 1) {
+    }
+
+    /// Forbid copying.
+    spsc_ring(const spsc_ring&) = delete;
+
+    /// Forbid copying.
+    spsc_ring& operator=(const spsc_ring&) = delete;
+
+    /// Allocate aligned storage.
+    static inline void* operator new(size_t size) {
+      return allocate_aligned(size, CPL_CACHE_LINE_SIZE);
+    }
+
+    /// Free aligned storage.
+    static inline void operator delete(void* data) {
+      free_aligned(data);
+    }
+
+    /// The maximal number of values held by the ring.
+    inline size_t capacity() const {
+      return m_mask + 1;
+    }
+
+    /// Push a value, unless the ring is full.
+    inline bool try_push(T value) {
+      if (free_count() == 0) {
+        return false;
+      }
+      size_t tail = m_producer.tail.load(std::memory_order_relaxed);
+      m_slots[tail & m_mask] = std::move(value);
+      m_producer.tail.store(tail + 1, std::memory_order_release);
+      return true;
+    }
+
+    /// Pop a value, unless the ring is empty.
+    inline bool try_pop(T& value) {
+      if (ready_count() == 0) {
+        return false;
+      }
+      size_t head = m_consumer.head.load(std::memory_order_relaxed);
+      value = std::move(m_slots[head & m_mask]);
+      m_consumer.head.store(head + 1, std::memory_order_release);
+      return true;
+    }
+
+    /// View free slots for pushing up to some number of values.
+    ///
+    /// The span is contiguous, so it may be shorter than the number of free
+    /// slots when these wrap around the end of the ring. It is empty if the
+    /// ring is full.
+    inline span<T> push_span(size_t count) {
+      size_t tail = m_producer.tail.load(std::memory_order_relaxed);
+      size_t index = tail & m_mask;
+      m_producer.prepared = std::min(std::min(count, free_count()), m_mask + 1 - index);
+      return span<T>(m_slots).subspan(index, m_producer.prepared);
+    }
+
+    /// View all the (contiguous) free slots for pushing values.
+    inline span<T> push_span() {
+      return push_span(m_mask + 1);
+    }
+
+    /// Publish values written to the start of the last push span.
+    inline void commit_push(size_t count) {
+      CPL_ASSERT(count <= m_producer.prepared, "committing more values than were prepared for pushing");
+      m_producer.prepared = 0;
+      m_producer.tail.store(m_producer.tail.load(std::memory_order_relaxed) + count, std::memory_order_release);
+    }
+
+    /// View pushed values for popping up to some number of them.
+    ///
+    /// The span is contiguous, so it may be shorter than the number of pushed
+    /// values when these wrap around the end of the ring. It is empty if the
+    /// ring is empty.
+    inline span<T> pop_span(size_t count) {
+      size_t head = m_consumer.head.load(std::memory_order_relaxed);
+      size_t index = head & m_mask;
+      m_consumer.prepared = std::min(std::min(count, ready_count()), m_mask + 1 - index);
+      return span<T>(m_slots).subspan(index, m_consumer.prepared);
+    }
+
+    /// View all the (contiguous) pushed values for popping.
+    inline span<T> pop_span() {
+      return pop_span(m_mask + 1);
+    }
+
+    /// Release values read from the start of the last pop span.
+    inline void commit_pop(size_t count) {
+      CPL_ASSERT(count <= m_consumer.prepared, "committing more values than were prepared for popping");
+      m_consumer.prepared = 0;
+      m_consumer.head.store(m_consumer.head.load(std::memory_order_relaxed) + count, std::memory_order_release);
+    }
+  };
+
+#ifndef CPL_WITHOUT_COLLECTIONS // {
+
+  /// A hash map which may be concurrently accessed by many threads.
+  ///
+  /// The entries are divided between shards (by their hash), each protected
+  /// by its own reader/writer lock and placed in separate cache lines, so
+  /// threads accessing different shards do not contend with each other.
+  ///
+  /// Looking up a key returns a guard which holds the shard lock (shared for
+  /// `read`, exclusive for `write`), and allows borrowing the value. As
+  /// usual, a thread holding a guard must not access the same shard again
+  /// (or call `size` or `clear`), or it may deadlock. In safe mode, borrows of
+  /// the value expire when the guard is released.
+  template <typename K, typename V, typename H = std::hash<K>, typename E = std::equal_to<K>> class concurrent_map {
+    /// A shard of the entries.
+    struct alignas(CPL_CACHE_LINE_SIZE) shard {
+      /// Protect the entries.
+      mutable std::shared_timed_mutex mutex;
+
+      /// The entries.
+      std::unordered_map<K, V, H, E> entries;
+    };
+
+    /// The shards of the entries.
+    uref<shard[]> m_shards;
+
+    /// The mask for converting a hash to a shard index.
+    size_t m_mask;
+
+    /// The smallest power of two which is at least some number of shards.
+    static inline size_t round_shard_count(size_t shard_count) {
+      CPL_ASSERT(shard_count > 0, "creating a map without shards");
+      size_t rounded = 1;
+      while (rounded < shard_count) {
+        rounded *= 2;
+      }
+      return rounded;
+    }
+
+    /// The shard holding a key.
+    inline shard& shard_of(const K& key) const {
+      size_t hash = H()(key);
+      hash ^= hash >> 17;
+      hash *= size_t(0x9E3779B97F4A7C15ull);
+      return m_shards[(hash >> 16) & m_mask];
+    }
+
+  public:
+    /// A lock on a shard, providing access to the value of some key (if it
+    /// exists).
+    template <typename U, typename L> class guard {
+      friend class concurrent_map;
+
+      /// The lock of the shard.
+      L m_lock;
+
+      /// The raw pointer to the value (null if the key does not exist).
+      U* m_raw_ptr;
+
+#ifdef CPL_SAFE // {
+      /// Track the lifetime of the guard.
+      std::shared_ptr<const void> m_token;
+#endif // } CPL_SAFE
+
+      /// Lock a shard and access a value in it.
+      inline guard(L&& lock, U* raw_ptr)
+        : m_lock(std::move(lock)), m_raw_ptr(raw_ptr)
+#ifdef CPL_SAFE // {
+          ,
+          m_token(raw_ptr ? std::shared_ptr<const void>(raw_ptr, no_delete<U>()) : std::shared_ptr<const void>())
+#endif // } CPL_SAFE
+      {
+      }
+
+    public:
+      /// Move a guard.
+      inline guard(guard&& other)
+        : m_lock(std::move(other.m_lock)), m_raw_ptr(other.m_raw_ptr)
+#ifdef CPL_SAFE // {
+          ,
+          m_token(std::move(other.m_token))
+#endif // } CPL_SAFE
+      {
+        other.m_raw_ptr = nullptr;
+      }
+
+      /// Forbid copying.
+      guard(const guard&) = delete;
+
+      /// Forbid copying.
+      guard& operator=(const guard&) = delete;
+
+      /// Release the lock (expiring all borrows of the value).
+      inline void reset() {
+#ifdef CPL_SAFE // {
+        m_token.reset();
+#endif // } CPL_SAFE
+        m_raw_ptr = nullptr;
+        if (m_lock) {
+          m_lock.unlock();
+        }
+      }
+
+      /// Whether the key exists.
+      inline explicit operator bool() const {
+        return !!m_raw_ptr;
+      }
+
+      /// Borrow the value (if the key exists).
+      inline ptr<U> get() const {
+#ifdef CPL_FAST // {
+        return ptr<U>{ m_raw_ptr, unsafe_raw_t(0) };
+#endif          // } CPL_FAST
+#ifdef CPL_SAFE // {
+        if (!m_raw_ptr) {
+          return ptr<U>();
+        }
+        return ptr<U>(sptr<U>(std::shared_ptr<U>(m_token, m_raw_ptr)));
+#endif // } CPL_SAFE
+      }
+
+      /// Borrow the value (which must exist).
+      inline ::cpl::ref<U> ref() const {
+        return get().ref();
+      }
+
+      /// Access the value.
+      inline U& operator*() const {
+        CPL_ASSERT(m_raw_ptr, "accessing the value of a missing key");
+        return *m_raw_ptr;
+      }
+
+      /// Access a data member.
+      inline U* operator->() const {
+        CPL_ASSERT(m_raw_ptr, "accessing the value of a missing key");
+        return m_raw_ptr;
+      }
+    };
+
+    /// A guard for reading a value.
+    typedef guard<const V, std::shared_lock<std::shared_timed_mutex>> read_guard;
+
+    /// A guard for modifying a value.
+    typedef guard<V, std::unique_lock<std::shared_timed_mutex>> write_guard;
+
+    /// An empty map, with some number of shards (rounded up to a power of
+    /// two).
+    inline explicit concurrent_map(size_t shard_count = 64)
+      : m_shards(make_uref_array<shard>(round_shard_count(shard_count), CPL_CACHE_LINE_SIZE)), m_mask(m_shards.size() - 1) {
+    }
+
+    /// Forbid copying.
+    concurrent_map(const concurrent_map&) = delete;
+
+    /// Forbid copying.
+    concurrent_map& operator=(const concurrent_map&) = delete;
+
+    /// Lock the shard of a key for reading its value.
+    inline read_guard read(const K& key) const {
+      shard& locked = shard_of(key);
+      std::shared_lock<std::shared_timed_mutex> lock(locked.mutex);
+      auto found = locked.entries.find(key);
+      return read_guard(std::move(lock), found == locked.entries.end() ? nullptr : &found->second);
+    }
+
+    /// Lock the shard of a key for modifying its value.
+    inline write_guard write(const K& key) {
+      shard& locked = shard_of(key);
+      std::unique_lock<std::shared_timed_mutex> lock(locked.mutex);
+      auto found = locked.entries.find(key);
+      return write_guard(std::move(lock), found == locked.entries.end() ? nullptr : &found->second);
+    }
+
+    /// Lock the shard of a key for modifying its value, inserting it if it
+    /// does not exist.
+    template <typename... Args> inline write_guard emplace(const K& key, Args&&... args) {
+      shard& locked = shard_of(key);
+      std::unique_lock<std::shared_timed_mutex> lock(locked.mutex);
+      auto found = locked.entries.find(key);
+      if (found == locked.entries.end()) {
+        found = locked.entries.emplace(key, V(std::forward<Args>(args)...)).first;
+      }
+      return write_guard(std::move(lock), &found->second);
+    }
+
+    /// Insert a value unless the key already exists.
+    inline bool insert(const K& key, V value) {
+      shard& locked = shard_of(key);
+      std::lock_guard<std::shared_timed_mutex> lock(locked.mutex);
+      return locked.entries.emplace(key, std::move(value)).second;
+    }
+
+    /// Set the value of a key, whether or not it exists.
+    inline void insert_or_assign(const K& key, V value) {
+      shard& locked = shard_of(key);
+      std::lock_guard<std::shared_timed_mutex> lock(locked.mutex);
+      auto found = locked.entries.find(key);
+      if (found == locked.entries.end()) {
+        locked.entries.emplace(key, std::move(value));
+      } else {
+        found->second = std::move(value);
+      }
+    }
+
+    /// Erase a key, returning whether it existed.
+    inline bool erase(const K& key) {
+      shard& locked = shard_of(key);
+      std::lock_guard<std::shared_timed_mutex> lock(locked.mutex);
+      return locked.entries.erase(key) > 0;
+    }
+
+    /// Whether a key exists.
+    inline bool contains(const K& key) const {
+      shard& locked = shard_of(key);
+      std::shared_lock<std::shared_timed_mutex> lock(locked.mutex);
+      return locked.entries.count(key) > 0;
+    }
+
+    /// The number of entries.
+    ///
+    /// The shards are counted one at a time, so this may not reflect any
+    /// single point in time if the map is concurrently modified.
+    inline size_t size() const {
+      size_t total = 0;
+      for (size_t index = 0; index <= m_mask; ++index) {
+        std::shared_lock<std::shared_timed_mutex> lock(m_shards[index].mutex);
+        total += m_shards[index].entries.size();
+      }
+      return total;
+    }
+
+    /// Erase all the entries.
+    inline void clear() {
+      for (size_t index = 0; index <= m_mask; ++index) {
+        std::lock_guard<std::shared_timed_mutex> lock(m_shards[index].mutex);
+        m_shards[index].entries.clear();
+      }
+    }
+  };
+
+#endif // } CPL_WITHOUT_COLLECTIONS
+
+  /// A value whose accesses are checked to be either shared or exclusive.
+  ///
+  /// Reading the value requires a `read` guard, and modifying it requires a
+  /// `write` guard. In safe mode, the cell counts its guards and verifies
+  /// there are either any number of read guards or a single write guard (in
+  /// any number of threads), and borrows of the value given by a guard expire
+  /// when the guard is released. Unlike a mutex, a conflicting access is
+  /// reported rather than waited for. In fast mode, the guards are just raw
+  /// pointers to the value.
+  template <typename T> class cell {
+    /// The value.
+    T m_value;
+
+#ifdef CPL_SAFE // {
+    /// The number of read guards, or -1 if there is a write guard.
+    mutable std::atomic<int> m_state;
+#endif // } CPL_SAFE
+
+  public:
+    /// Access to the value of a cell.
+    template <typename U> class guard {
+      friend class cell;
+
+      /// The guarded cell.
+      const cell* m_cell;
+
+#ifdef CPL_SAFE // {
+      /// Track the lifetime of the guard.
+      std::shared_ptr<U> m_token;
+#endif // } CPL_SAFE
+
+      /// Guard the value of a cell (which was already claimed).
+      inline explicit guard(const cell* guarded)
+        : m_cell(guarded)
+#ifdef CPL_SAFE // {
+          ,
+          m_token(const_cast<U*>(&guarded->m_value), no_delete<U>())
+#endif // } CPL_SAFE
+      {
+      }
+
+    public:
+      /// Move a guard.
+      inline guard(guard&& other)
+        : m_cell(other.m_cell)
+#ifdef CPL_SAFE // {
+          ,
+          m_token(std::move(other.m_token))
+#endif // } CPL_SAFE
+      {
+        other.m_cell = nullptr;
+      }
+
+      /// Forbid copying.
+      guard(const guard&) = delete;
+
+      /// Forbid copying.
+      guard& operator=(const guard&) = delete;
+
+      /// Release the guard.
+      inline ~guard() {
+        reset();
+      }
+
+      /// Release the guard (expiring all borrows of the value).
+      inline void reset() {
+#ifdef CPL_SAFE // {
+        if (m_cell) {
+          m_token.reset();
+          if (std::is_const<U>::value) {
+            m_cell->m_state.fetch_sub(1, std::memory_order_release);
+          } else {
+            m_cell->m_state.store(0, std::memory_order_release);
+          }
+        }
+#endif // } CPL_SAFE
+        m_cell = nullptr;
+      }
+
+      /// Borrow the value.
+      inline ptr<U> get() const {
+        CPL_ASSERT(m_cell, "accessing a cell using a released guard");
+#ifdef CPL_FAST // {
+        return ptr<U>{ const_cast<U*>(&m_cell->m_value), unsafe_raw_t(0) };
+#endif          // } CPL_FAST
+#ifdef CPL_SAFE // {
+        return ptr<U>(sptr<U>(m_token));
+#endif // } CPL_SAFE
+      }
+
+      /// Borrow the value.
+      inline ::cpl::ref<U> ref() const {
+        return get().ref();
+      }
+
+      /// Access the value.
+      inline U& operator*() const {
+        CPL_ASSERT(m_cell, "accessing a cell using a released guard");
+        return const_cast<U&>(m_cell->m_value);
+      }
+
+      /// Access a data member.
+      inline U* operator->() const {
+        CPL_ASSERT(m_cell, "accessing a cell using a released guard");
+        return const_cast<U*>(&m_cell->m_value);
+      }
+    };
+
+    /// A guard for reading the value.
+    typedef guard<const T> read_guard;
+
+    /// A guard for modifying the value.
+    typedef guard<T> write_guard;
+
+    /// Construct the value.
+    template <typename... Args>
+    inline explicit cell(Args&&... args)
+      : m_value(std::forward<Args>(args)...)
+#ifdef CPL_SAFE // {
+        ,
+        m_state(0)
+#endif // } CPL_SAFE
+    {
+    }
+
+    /// Forbid copying.
+    cell(const cell&) = delete;
+
+    /// Forbid copying.
+    cell& operator=(const cell&) = delete;
+
+    /// Start reading the value.
+    inline read_guard read() const {
+#ifdef CPL_SAFE // {
+      int state = m_state.load(std::memory_order_relaxed);
+      do {
+        CPL_ASSERT(state >= 0, "reading a cell while it is being written");
+      } while (!m_state.compare_exchange_weak(state, state + 1, std::memory_order_acquire));
+#endif // } CPL_SAFE
+      return read_guard(this);
+    }
+
+    /// Start modifying the value.
+    inline write_guard write() {
+#ifdef CPL_SAFE // {
+      int state = 0;
+      bool is_claimed = m_state.compare_exchange_strong(state, -1, std::memory_order_acquire);
+      CPL_ASSERT(is_claimed || state > 0, "writing a cell while it is being written");
+      CPL_ASSERT(is_claimed, "writing a cell while it is being read");
+#endif // } CPL_SAFE
+      return write_guard(this);
+    }
+  };
+
+  /// A small value which is read by many threads and written by one.
+  ///
+  /// Reading the value is optimistic: the reader copies the value, and
+  /// retries if it was modified while being copied. Readers do not write to
+  /// any shared memory, so they do not contend with each other. Therefore `T`
+  /// must be trivially copyable, and should be small (a few cache lines at
+  /// most). The value is held in atomic words, so the concurrent copying is
+  /// not a data race.
+  ///
+  /// `T` need not be default-constructible, unless the seqlock itself is
+  /// default-constructed.
+  ///
+  /// In safe mode, this verifies that all the writes are done by the same
+  /// thread.
+  template <typename T> class seqlock {
+    static_assert(std::is_trivially_copyable<T>::value, "a seqlock value must be trivially copyable");
+
+    /// The number of words holding the value.
+    static constexpr size_t word_count = (sizeof(T) + sizeof(uint64_t) - 1) / sizeof(uint64_t);
+
+    /// The number of writes started and completed (odd while writing).
+    alignas(CPL_CACHE_LINE_SIZE) std::atomic<uint64_t> m_sequence;
+
+    /// The words holding the value.
+    std::atomic<uint64_t> m_words[word_count];
+
+#ifdef CPL_SAFE // {
+    /// The thread writing the value.
+    std::atomic<std::thread::id> m_writer;
+#endif // } CPL_SAFE
+
+    /// Copy the value into the words (in the writer thread).
+    inline void set(const T& value) {
+      uint64_t words[word_count] = {};
+      std::memcpy(words, &value, sizeof(T));
+      for (size_t index = 0; index < word_count; ++index) {
+        m_words[index].store(words[index], std::memory_order_relaxed);
+      }
+    }
+
+    /// Copy the value from the words.
+    inline T get() const {
+      uint64_t words[word_count];
+      for (size_t index = 0; index < word_count; ++index) {
+        words[index] = m_words[index].load(std::memory_order_relaxed);
+      }
+      alignas(T) unsigned char storage[sizeof(T)];
+      std::memcpy(storage, words, sizeof(T));
+      return *reinterpret_cast<const T*>(storage);
+    }
+
+  public:
+    /// Hold a default-constructed value.
+    inline seqlock() : seqlock(T()) {
+    }
+
+    /// Hold an initial value.
+    inline explicit seqlock(const T& value)
+      : m_sequence(0)
+#ifdef CPL_SAFE // {
+        ,
+        m_writer(std::thread::id())
+#endif // } CPL_SAFE
+    {
+      set(value);
+    }
+
+    /// Forbid copying.
+    seqlock(const seqlock&) = delete;
+
+    /// Forbid copying.
+    seqlock& operator=(const seqlock&) = delete;
+
+    /// Allocate aligned storage.
+    static inline void* operator new(size_t size) {
+      return allocate_aligned(size, CPL_CACHE_LINE_SIZE);
+    }
+
+    /// Free aligned storage.
+    static inline void operator delete(void* data) {
+      free_aligned(data);
+    }
+
+    /// Copy the value.
+    inline T load() const {
+      for (;;) {
+        uint64_t sequence = m_sequence.load(std::memory_order_acquire);
+        if (sequence & 1) {
+          std::this_thread::yield();
+          continue;
+        }
+        T value = get();
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (m_sequence.load(std::memory_order_relaxed) == sequence) {
+          return value;
+        }
+      }
+    }
+
+    /// Replace the value.
+    inline void store(const T& value) {
+#ifdef CPL_SAFE // {
+      std::thread::id current = std::this_thread::get_id();
+      std::thread::id previous = std::thread::id();
+      bool is_writer = m_writer.compare_exchange_strong(previous, current) || previous == current;
+      CPL_ASSERT(is_writer, "writing a seqlock from more than one thread");
+#endif // } CPL_SAFE
+      uint64_t sequence = m_sequence.load(std::memory_order_relaxed);
+      m_sequence.store(sequence + 1, std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_release);
+      set(value);
+      m_sequence.store(sequence + 2, std::memory_order_release);
+    }
+
+    /// Modify the value.
+    ///
+    /// The modification function is given a `T&` of a copy of the value,
+    /// which is then stored. Since there's a single writer, the copy is made
+    /// without retrying.
+    template <typename F> inline void update(F modify) {
+      T value = get();
+      modify(value);
+      store(value);
+    }
+  };
+
+  template <typename T> constexpr size_t seqlock<T>::word_count;
+
+#ifndef CPL_WITHOUT_COLLECTIONS // {
+
+  /// A value with a separate instance for each thread.
+  ///
+  /// Each thread accessing the value gets its own (value-initialized)
+  /// instance, in its own cache line, so threads updating their instances
+  /// (for example, statistics counters) do not contend with each other. The
+  /// instances are kept after their thread exits (and are reused by new
+  /// threads), so combining them gives the total of all the updates.
+  ///
+  /// Combining the instances reads them while their threads may be updating
+  /// them, so `T` should be atomic (or the combining should only be done when
+  /// the threads are idle).
+  ///
+  /// In safe mode, the reference to the instance of the current thread
+  /// verifies it is not used by another thread.
+  template <typename T> class sharded {
+    /// The instance of a thread.
+    struct shard {
+      /// The value.
+      T value{};
+    };
+
+    /// The instances of all the threads.
+    thread_registry<shard> m_shards;
+
+  public:
+    /// A reference to the instance of some thread.
+    class local_ref {
+      friend class sharded;
+
+      /// The raw pointer to the instance.
+      T* m_raw_ptr;
+
+#ifdef CPL_SAFE // {
+      /// The thread owning the instance.
+      std::thread::id m_thread;
+#endif // } CPL_SAFE
+
+      /// Refer to the instance of the current thread.
+      inline explicit local_ref(T* raw_ptr)
+        : m_raw_ptr(raw_ptr)
+#ifdef CPL_SAFE // {
+          ,
+          m_thread(std::this_thread::get_id())
+#endif // } CPL_SAFE
+      {
+      }
+
+    public:
+      /// Access the raw pointer.
+      inline T* get() const {
+#ifdef CPL_SAFE // {
+        CPL_ASSERT(m_thread == std::this_thread::get_id(), "accessing a sharded value of a different thread");
+#endif // } CPL_SAFE
+        return m_raw_ptr;
+      }
+
+      /// Access the value.
+      inline T& operator*() const {
+        return *get();
+      }
+
+      /// Access a data member.
+      inline T* operator->() const {
+        return get();
+      }
+
+      /// Access the value.
+      inline operator T&() const {
+        return *get();
+      }
+    };
+
+    /// No instances yet.
+    inline sharded() = default;
+
+    /// Forbid copying.
+    sharded(const sharded&) = delete;
+
+    /// Forbid copying.
+    sharded& operator=(const sharded&) = delete;
+
+    /// Access the instance of the current thread.
+    inline local_ref local() {
+      return local_ref(&m_shards.local().value);
+    }
+
+    /// Invoke a function on all the instances.
+    template <typename F> inline void for_each(F function) const {
+      m_shards.for_each([&function](const shard& visited) { function(visited.value); });
+    }
+
+    /// Combine all the instances.
+    ///
+    /// The combining function is given the combined result so far and the
+    /// next instance, and returns the new combined result.
+    template <typename U, typename F> inline U combine(U initial, F function) const {
+      for_each([&initial, &function](const T& value) { initial = function(initial, value); });
+      return initial;
+    }
+  };
+
+  /// A pool of threads executing tasks, using work stealing.
+  ///
+  /// Each worker thread has its own queue of tasks. Tasks submitted by a
+  /// worker are pushed to its own queue, and it executes them last-in
+  /// first-out; other tasks are distributed between the queues. An idle worker
+  /// steals the oldest task of some other worker.
+  ///
+  /// Submitting a task gives a `std::future` of its result (which is
+  /// typically a @ref cpl::uref). A task may also take ownership of its input
+  /// @ref cpl::uref; in safe mode, this revokes all the borrows of the input,
+  /// so the submitting code can't keep using it while the task runs. Other
+  /// borrows captured by the task are tracked as usual, so if their data is
+  /// deleted before the task uses them, this is detected in safe mode.
+  class thread_pool {
+    /// A task waiting to be executed.
+    struct task {
+      /// Allow deleting a concrete task.
+      virtual ~task() = default;
+
+      /// Execute the task.
+      virtual void run() = 0;
+    };
+
+    /// A task executing some function.
+    template <typename F> struct function_task : task {
+      /// The function to execute.
+      F function;
+
+      /// Hold the function to execute.
+      inline explicit function_task(F&& function) : function(std::move(function)) {
+      }
+
+      /// Execute the function.
+      virtual void run() override {
+        function();
+      }
+    };
+
+    /// The queue of a worker.
+    struct alignas(CPL_CACHE_LINE_SIZE) worker {
+      /// Protect the tasks.
+      std::mutex mutex;
+
+      /// The queued tasks.
+      std::deque<uptr<task>> tasks;
+    };
+
+    /// The queues of the workers.
+    uref<worker[]> m_workers;
+
+    /// The worker threads.
+    std::vector<std::thread> m_threads;
+
+    /// The number of queued tasks.
+    std::atomic<size_t> m_queued_count;
+
+    /// The next queue for tasks submitted by non-worker threads.
+    std::atomic<size_t> m_next_worker;
+
+    /// Protect waiting for tasks.
+    std::mutex m_mutex;
+
+    /// Wake idle workers.
+    std::condition_variable m_wake;
+
+    /// Whether the pool is being destroyed.
+    bool m_is_stopping;
+
+    /// The pool and worker index of the current thread (if it is a worker).
+    static inline std::pair<const thread_pool*, size_t>& current_worker() {
+      static thread_local std::pair<const thread_pool*, size_t> current(nullptr, 0);
+      return current;
+    }
+
+    /// The worker index of the current thread (or the number of workers, if
+    /// it isn't a worker of this pool).
+    inline size_t current_index() const {
+      const std::pair<const thread_pool*, size_t>& current = current_worker();
+      return current.first == this ? current.second : m_workers.size();
+    }
+
+    /// Queue a task.
+    inline void push(uptr<task>&& queued) {
+      size_t index = current_index();
+      if (index == m_workers.size()) {
+        index = m_next_worker.fetch_add(1, std::memory_order_relaxed) % m_workers.size();
+      }
+      // Count the task before publishing it, so a concurrent `take` never
+      // decrements the count below zero.
+      m_queued_count.fetch_add(1);
+      {
+        std::lock_guard<std::mutex> lock(m_workers[index].mutex);
+        m_workers[index].tasks.push_back(std::move(queued));
+      }
+      {
+        // Synchronize with a worker which is about to wait, so it will not
+        // miss the notification.
+        std::lock_guard<std::mutex> lock(m_mutex);
+      }
+      m_wake.notify_one();
+    }
+
+    /// Take a task from the queue of some worker (or steal it from another).
+    inline uptr<task> take(size_t index) {
+      uptr<task> taken;
+      if (index < m_workers.size()) {
+        std::lock_guard<std::mutex> lock(m_workers[index].mutex);
+        if (!m_workers[index].tasks.empty()) {
+          taken = std::move(m_workers[index].tasks.back());
+          m_workers[index].tasks.pop_back();
+        }
+      }
+      for (size_t offset = 1; !taken && offset <= m_workers.size(); ++offset) {
+        worker& victim = m_workers[(index + offset) % m_workers.size()];
+        std::lock_guard<std::mutex> lock(victim.mutex);
+        if (!victim.tasks.empty()) {
+          taken = std::move(victim.tasks.front());
+          victim.tasks.pop_front();
+        }
+      }
+      if (taken) {
+        m_queued_count.fetch_sub(1);
+      }
+      return taken;
+    }
+
+    /// Execute tasks until the pool is destroyed.
+    inline void work(size_t index) {
+      current_worker() = std::make_pair(this, index);
+      for (;;) {
+        uptr<task> taken = take(index);
+        if (taken) {
+          taken->run();
+          continue;
+        }
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_wake.wait(lock, [this] { return m_is_stopping || m_queued_count.load() > 0; });
+        if (m_is_stopping && m_queued_count.load() == 0) {
+          return;
+        }
+      }
+    }
+
+  public:
+    /// A pool with some number of worker threads (by default, one per
+    /// hardware thread).
+    inline explicit thread_pool(size_t thread_count = std::thread::hardware_concurrency())
+      : m_workers(make_uref_array<worker>(std::max(thread_count, size_t(1)), CPL_CACHE_LINE_SIZE)),
+        m_queued_count(0),
+        m_next_worker(0),
+        m_is_stopping(false) {
+      for (size_t index = 0; index < m_workers.size(); ++index) {
+        m_threads.emplace_back([this, index] { work(index); });
+      }
+    }
+
+    /// Forbid copying.
+    thread_pool(const thread_pool&) = delete;
+
+    /// Forbid copying.
+    thread_pool& operator=(const thread_pool&) = delete;
+
+    /// Execute all the queued tasks, and stop the worker threads.
+    inline ~thread_pool() {
+      {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_is_stopping = true;
+      }
+      m_wake.notify_all();
+      for (std::thread& thread : m_threads) {
+        thread.join();
+      }
+    }
+
+    /// The number of worker threads.
+    inline size_t size() const {
+      return m_workers.size();
+    }
+
+    /// Submit a task executing a function.
+    template <typename F> inline std::future<decltype(std::declval<F&>()())> submit(F function) {
+      typedef decltype(std::declval<F&>()()) R;
+      std::packaged_task<R()> packaged(std::move(function));
+      std::future<R> result = packaged.get_future();
+      push(make_uref<function_task<std::packaged_task<R()>>>(std::move(packaged)));
+      return result;
+    }
+
+    /// Submit a task owning its input, and executing a function on it.
+    ///
+    /// The function is given a `T&` of the input.
+    template <typename T, typename F>
+    inline std::future<decltype(std::declval<F&>()(std::declval<T&>()))> submit(uref<T>&& input, F function) {
+      input.revoke();
+      return submit([ input = std::move(input), function ]() mutable { return function(*input); });
+    }
+
+    /// Wait for the result of a task, executing queued tasks meanwhile.
+    ///
+    /// This allows a task to wait for the tasks it submitted without
+    /// blocking its worker thread.
+    template <typename R> inline R wait(std::future<R>& result) {
+      size_t index = current_index();
+      while (result.wait_for(std::chrono::seconds(0)) != std::future_status::ready) {
+        uptr<task> taken = take(index);
+        if (taken) {
+          taken->run();
+        } else {
+          std::this_thread::yield();
+        }
+      }
+      return result.get();
+    }
+  };
+
+  /// Parallel algorithms over spans of elements.
+  ///
+  /// The elements are divided into chunks (see @ref cpl::parallel::chunking),
+  /// which are processed by the tasks of a @ref cpl::thread_pool. The calling
+  /// thread processes the first chunk, and then helps with the rest.
+  ///
+  /// In safe mode, each chunk is given its own span, which verifies that the
+  /// viewed container was not modified (reallocated or resized) before and
+  /// after processing the chunk, and that the chunk does not access elements
+  /// outside it (which may be concurrently written by another chunk).
+  namespace parallel {
+    /// The pool used by default, with one thread per hardware thread.
+    inline thread_pool& default_pool() {
+      static thread_pool pool;
+      return pool;
+    }
+
+    /// How the elements of a span are divided into chunks.
+    ///
+    /// All the chunks except for the first and the last have the same size,
+    /// which is a multiple of a cache line. If the size of the elements
+    /// divides the cache line size, the first chunk is extended so that the
+    /// following chunks start at a cache line boundary, so different chunks
+    /// never write to the same cache line. Otherwise, adjacent chunks may
+    /// share the cache line at their boundary.
+    class chunking {
+      /// The number of elements.
+      size_t m_size;
+
+      /// The number of extra elements in the first chunk.
+      size_t m_head_size;
+
+      /// The number of elements in each chunk.
+      size_t m_chunk_size;
+
+    public:
+      /// Divide the elements of a span between the threads of a pool.
+      template <typename T> inline chunking(const span<T>& elements, const thread_pool& pool) : m_size(elements.size()) {
+        size_t line_size = std::max(CPL_CACHE_LINE_SIZE / sizeof(T), size_t(1));
+        size_t chunk_count = 4 * (pool.size() + 1);
+        size_t lines_per_chunk = std::max((m_size + chunk_count * line_size - 1) / (chunk_count * line_size), size_t(1));
+        m_chunk_size = lines_per_chunk * line_size;
+        size_t skew = uintptr_t(elements.data()) % CPL_CACHE_LINE_SIZE;
+        bool is_alignable = CPL_CACHE_LINE_SIZE % sizeof(T) == 0 && skew % sizeof(T) == 0;
+        m_head_size = is_alignable ? (CPL_CACHE_LINE_SIZE - skew) % CPL_CACHE_LINE_SIZE / sizeof(T) : 0;
+      }
+
+      /// The number of chunks.
+      inline size_t count() const {
+        if (m_size <= m_head_size + m_chunk_size) {
+          return m_size > 0 ? 1 : 0;
+        }
+        return (m_size - m_head_size + m_chunk_size - 1) / m_chunk_size;
+      }
+
+      /// The offset of the first element of a chunk (or the number of
+      /// elements, for the index following the last chunk).
+      inline size_t first(size_t index) const {
+        return index == 0 ? 0 : std::min(m_head_size + index * m_chunk_size, m_size);
+      }
+
+      /// The index of the chunk starting at some offset.
+      inline size_t index_of(size_t first) const {
+        return first == 0 ? 0 : (first - m_head_size) / m_chunk_size;
+      }
+    };
+
+    /// Invoke a function on each index in a range, in parallel.
+    ///
+    /// This waits for all the invocations to complete, and then rethrows the
+    /// first exception thrown by any of them, if any.
+    template <typename F> inline void for_each_index(size_t count, F function, thread_pool& pool) {
+      std::mutex mutex;
+      std::exception_ptr error;
+      auto invoke = [&](size_t index) {
+        try {
+          function(index);
+        } catch (...) {
+          std::lock_guard<std::mutex> lock(mutex);
+          if (!error) {
+            error = std::current_exception();
+          }
+        }
+      };
+      std::vector<std::future<void>> pending;
+      for (size_t index = 1; index < count; ++index) {
+        pending.push_back(pool.submit([&invoke, index] { invoke(index); }));
+      }
+      if (count > 0) {
+        invoke(0);
+      }
+      for (std::future<void>& result : pending) {
+        pool.wait(result);
+      }
+      if (error) {
+        std::rethrow_exception(error);
+      }
+    }
+
+    /// Invoke a function on each chunk of a span, in parallel.
+    ///
+    /// The function is given the offset of the chunk in the span and a span of
+    /// the chunk's elements. In safe mode, the chunk's span is validated again
+    /// after the function returns.
+    template <typename T, typename F>
+    inline void for_each_chunk(const span<T>& elements, F function, thread_pool& pool = default_pool()) {
+      chunking chunks(elements, pool);
+      for_each_index(chunks.count(),
+                     [&](size_t index) {
+                       size_t first = chunks.first(index);
+                       span<T> chunk_elements = elements.subspan(first, chunks.first(index + 1) - first);
+                       function(first, chunk_elements);
+                       chunk_elements.validate();
+                     },
+                     pool);
+    }
+
+    /// Invoke a function on each element of a span, in parallel.
+    template <typename T, typename F>
+    inline void for_each(const span<T>& elements, F function, thread_pool& pool = default_pool()) {
+      for_each_chunk(elements,
+                     [&function](size_t, const span<T>& chunk) {
+                       for (T& element : chunk) {
+                         function(element);
+                       }
+                     },
+                     pool);
+    }
+
+    /// Set each element of an output span to the result of a function on the
+    /// matching element of an input span, in parallel.
+    ///
+    /// The spans must have the same size, and must either be disjoint or be
+    /// the same elements.
+    template <typename T, typename U, typename F>
+    inline void transform(const span<T>& input, const span<U>& output, F function, thread_pool& pool = default_pool()) {
+      CPL_ASSERT(input.size() == output.size(), "transforming spans of different sizes");
+#ifdef CPL_SAFE // {
+      uintptr_t input_begin = uintptr_t(input.data());
+      uintptr_t input_end = input_begin + input.size() * sizeof(T);
+      uintptr_t output_begin = uintptr_t(output.data());
+      uintptr_t output_end = output_begin + output.size() * sizeof(U);
+      CPL_ASSERT(input_begin == output_begin || input_end <= output_begin || output_end <= input_begin,
+                 "transforming partially overlapping spans");
+#endif // } CPL_SAFE
+      for_each_chunk(output,
+                     [&input, &function](size_t first, const span<U>& chunk) {
+                       span<T> chunk_input = input.subspan(first, chunk.size());
+                       for (size_t offset = 0; offset < chunk.size(); ++offset) {
+                         chunk[offset] = function(chunk_input[offset]);
+                       }
+                     },
+                     pool);
+    }
+
+    /// Combine all the elements of a span, in parallel.
+    ///
+    /// The combining function must be associative. It is given the combined
+    /// result so far and the next value, and returns the new combined result.
+    /// Each chunk starts from its first element, and the results of the
+    /// chunks are combined (in order) with the initial value.
+    template <typename T, typename U, typename F>
+    inline U reduce(const span<T>& elements, U initial, F function, thread_pool& pool = default_pool()) {
+      chunking chunks(elements, pool);
+      std::vector<std::experimental::optional<U>> results(chunks.count());
+      for_each_chunk(elements,
+                     [&results, &function, &chunks](size_t first, const span<T>& chunk_elements) {
+                       U result = chunk_elements[0];
+                       for (size_t offset = 1; offset < chunk_elements.size(); ++offset) {
+                         result = function(result, chunk_elements[offset]);
+                       }
+                       results[chunks.index_of(first)] = std::move(result);
+                     },
+                     pool);
+      for (std::experimental::optional<U>& result : results) {
+        initial = function(initial, *result);
+      }
+      return initial;
+    }
+
+    /// Sort the elements of a span, in parallel.
+    ///
+    /// The chunks are sorted in parallel, and then merged in parallel rounds,
+    /// each merging pairs of adjacent sorted runs.
+    template <typename T, typename C = std::less<T>>
+    inline void sort(const span<T>& elements, C compare = C(), thread_pool& pool = default_pool()) {
+      chunking chunks(elements, pool);
+      for_each_chunk(elements, [&compare](size_t, const span<T>& run) { std::sort(run.begin(), run.end(), compare); }, pool);
+      for (size_t run_chunks = 1; run_chunks < chunks.count(); run_chunks *= 2) {
+        for_each_index((chunks.count() + 2 * run_chunks - 1) / (2 * run_chunks),
+                       [&elements, &compare, &chunks, run_chunks](size_t pair_index) {
+                         size_t first = chunks.first(pair_index * 2 * run_chunks);
+                         size_t middle = chunks.first(pair_index * 2 * run_chunks + run_chunks);
+                         size_t last = chunks.first((pair_index + 1) * 2 * run_chunks);
+                         span<T> pair = elements.subspan(first, last - first);
+                         std::inplace_merge(pair.begin(), pair.begin() + (middle - first), pair.end(), compare);
+                       },
+                       pool);
+      }
+    }
+  }
+
+  /// Destroy values away from latency-critical code.
+  ///
+  /// Destroying the last @ref cpl::uref to a large graph of values runs the
+  /// whole destructor cascade, which may take a long time. Handing the value
+  /// to a reclaimer instead moves this cost elsewhere. By default, a
+  /// reclaimer has a background thread which destroys values as soon as they
+  /// are handed to it. Alternatively, it may have no thread, in which case the
+  /// values are destroyed by calling `reclaim` at convenient times, with some
+  /// time budget. Either way, the values must be safe to destroy on a
+  /// different thread than the one handing them off.
+  ///
+  /// In safe mode, all the borrows of a value become invalid when it is
+  /// handed off, rather than when it is actually destroyed, so the behavior
+  /// does not depend on the timing of the reclaimer.
+  class reclaimer {
+    /// A value waiting to be destroyed.
+    struct garbage {
+      /// Allow destroying a concrete value.
+      virtual ~garbage() = default;
+    };
+
+    /// A value of some type waiting to be destroyed.
+    template <typename T> struct garbage_of : garbage {
+      /// The value to destroy.
+      uref<T> value;
+
+      /// Hold the value to destroy.
+      inline explicit garbage_of(uref<T>&& value) : value(std::move(value)) {
+      }
+    };
+
+    /// Protect the pending values.
+    std::mutex m_mutex;
+
+    /// Wake the background thread.
+    std::condition_variable m_wake;
+
+    /// Notify waiting for the pending values to be destroyed.
+    std::condition_variable m_done;
+
+    /// The values waiting to be destroyed.
+    std::deque<uptr<garbage>> m_pending;
+
+    /// Whether the background thread is destroying values.
+    bool m_is_destroying;
+
+    /// Whether the reclaimer is being destroyed.
+    bool m_is_stopping;
+
+    /// The background thread, if any.
+    std::thread m_thread;
+
+    /// Destroy values until the reclaimer is destroyed.
+    inline void work() {
+      std::unique_lock<std::mutex> lock(m_mutex);
+      for (;;) {
+        m_wake.wait(lock, [this] { return m_is_stopping || !m_pending.empty(); });
+        if (m_pending.empty()) {
+          return;
+        }
+        std::deque<uptr<garbage>> batch;
+        batch.swap(m_pending);
+        m_is_destroying = true;
+        lock.unlock();
+        batch.clear();
+        lock.lock();
+        m_is_destroying = false;
+        m_done.notify_all();
+      }
+    }
+
+  public:
+    /// A reclaimer with a background thread (by default), or one which only
+    /// destroys values when `reclaim` is called.
+    inline explicit reclaimer(bool is_background = true) : m_is_destroying(false), m_is_stopping(false) {
+      if (is_background) {
+        m_thread = std::thread([this] { work(); });
+      }
+    }
+
+    /// Forbid copying.
+    reclaimer(const reclaimer&) = delete;
+
+    /// Forbid copying.
+    reclaimer& operator=(const reclaimer&) = delete;
+
+    /// Stop the background thread, and destroy all the pending values.
+    inline ~reclaimer() {
+      if (m_thread.joinable()) {
+        {
+          std::lock_guard<std::mutex> lock(m_mutex);
+          m_is_stopping = true;
+        }
+        m_wake.notify_one();
+        m_thread.join();
+      }
+    }
+
+    /// Hand off a value to be destroyed.
+    template <typename T> inline void destroy(uref<T>&& value) {
+      value.revoke();
+      uptr<garbage> pending = make_uref<garbage_of<T>>(std::move(value));
+      {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_pending.push_back(std::move(pending));
+      }
+      m_wake.notify_one();
+    }
+
+    /// The number of values waiting to be destroyed.
+    inline size_t pending_count() {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      return m_pending.size();
+    }
+
+    /// Destroy pending values on the current thread, until there are none
+    /// left or the time budget has elapsed, and return how many were
+    /// destroyed.
+    ///
+    /// At least one value is destroyed (if any are pending), to ensure
+    /// progress. A single value is never partially destroyed, so the budget
+    /// may be exceeded by the time it takes to destroy it.
+    template <typename R, typename P> inline size_t reclaim(const std::chrono::duration<R, P>& budget) {
+      std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() + budget;
+      size_t count = 0;
+      do {
+        uptr<garbage> taken;
+        {
+          std::lock_guard<std::mutex> lock(m_mutex);
+          if (m_pending.empty()) {
+            break;
+          }
+          taken = std::move(m_pending.front());
+          m_pending.pop_front();
+        }
+        ++count;
+      } while (std::chrono::steady_clock::now() < deadline);
+      return count;
+    }
+
+    /// Wait until all the values handed off so far were destroyed.
+    ///
+    /// If there is no background thread, this destroys them on the current
+    /// thread.
+    inline void flush() {
+      if (!m_thread.joinable()) {
+        while (reclaim(std::chrono::seconds(0)) > 0) {
+        }
+        return;
+      }
+      std::unique_lock<std::mutex> lock(m_mutex);
+      m_done.wait(lock, [this] { return m_pending.empty() && !m_is_destroying; });
+    }
+  };
+
+  /// The reclaimer used by @ref cpl::defer_destroy, with a background thread.
+  inline reclaimer& default_reclaimer() {
+    static reclaimer shared_reclaimer;
+    return shared_reclaimer;
+  }
+
+  /// Destroy a value on a background thread.
+  ///
+  /// In safe mode, all the borrows of the value become invalid immediately.
+  template <typename T> inline void defer_destroy(uref<T>&& value) {
+    default_reclaimer().destroy(std::move(value));
+  }
+
+#ifdef __cpp_impl_coroutine // {
+  /// An arena for allocating coroutine frames.
+  ///
+  /// An executor would typically own one arena and pass it to the coroutines
+  /// it runs. Frames are allocated in multiples of a cache line from large
+  /// chunks, and freed frames are kept in per-size free lists for reuse, so
+  /// steady-state frame allocation never touches the global heap. Frames
+  /// larger than `max_frame_size` are allocated from the heap.
+  ///
+  /// The arena is protected by a mutex, as a frame may be freed by a
+  /// different thread than the one which allocated it. It must outlive all
+  /// the frames allocated from it.
+  class frame_arena {
+    /// A freed frame, waiting to be reused.
+    struct free_frame {
+      /// The next freed frame of the same size.
+      free_frame* next;
+    };
+
+  public:
+    /// The largest frame allocated from the arena.
+    static constexpr size_t max_frame_size = 64 * CPL_CACHE_LINE_SIZE;
+
+  private:
+    /// The number of different frame sizes.
+    static constexpr size_t size_count = max_frame_size / CPL_CACHE_LINE_SIZE;
+
+    /// The size of the chunks frames are allocated from.
+    static constexpr size_t chunk_size = 16 * max_frame_size;
+
+    /// Protect the arena.
+    std::mutex m_mutex;
+
+    /// The freed frames of each size.
+    free_frame* m_free_frames[size_count] = {};
+
+    /// The chunks allocated so far.
+    std::vector<void*> m_chunks;
+
+    /// The unused part of the last chunk.
+    char* m_next = nullptr;
+
+    /// The end of the last chunk.
+    char* m_end = nullptr;
+
+    /// The number of frames allocated from the arena and not freed yet.
+    size_t m_frame_count = 0;
+
+  public:
+    /// Create an empty arena.
+    inline frame_arena() = default;
+
+    /// Frames can't be moved to another arena.
+    frame_arena(const frame_arena&) = delete;
+
+    /// Frames can't be moved to another arena.
+    frame_arena& operator=(const frame_arena&) = delete;
+
+    /// Release all the chunks.
+    inline ~frame_arena() {
+      for (void* chunk : m_chunks) {
+        free_aligned(chunk);
+      }
+    }
+
+    /// Allocate a frame.
+    inline void* allocate(size_t size) {
+      size_t index = (size + CPL_CACHE_LINE_SIZE - 1) / CPL_CACHE_LINE_SIZE - 1;
+      if (index >= size_count) {
+        return ::operator new(size);
+      }
+      std::lock_guard<std::mutex> lock(m_mutex);
+      ++m_frame_count;
+      if (free_frame* frame = m_free_frames[index]) {
+        m_free_frames[index] = frame->next;
+        return frame;
+      }
+      size_t rounded_size = (index + 1) * CPL_CACHE_LINE_SIZE;
+      if (size_t(m_end - m_next) < rounded_size) {
+        m_next = static_cast<char*>(allocate_aligned(chunk_size, CPL_CACHE_LINE_SIZE));
+        m_end = m_next + chunk_size;
+        m_chunks.push_back(m_next);
+      }
+      void* frame = m_next;
+      m_next += rounded_size;
+      return frame;
+    }
+
+    /// Free a frame of some size for reuse.
+    inline void deallocate(void* frame, size_t size) {
+      size_t index = (size + CPL_CACHE_LINE_SIZE - 1) / CPL_CACHE_LINE_SIZE - 1;
+      if (index >= size_count) {
+        ::operator delete(frame);
+        return;
+      }
+      std::lock_guard<std::mutex> lock(m_mutex);
+      --m_frame_count;
+      m_free_frames[index] = new (frame) free_frame{ m_free_frames[index] };
+    }
+
+    /// The number of frames allocated from the arena and not freed yet.
+    ///
+    /// This does not count frames larger than `max_frame_size`, which are
+    /// allocated from the heap.
+    inline size_t frame_count() {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      return m_frame_count;
+    }
+  };
+
+  /// The borrows held by a coroutine frame.
+  ///
+  /// In fast mode, this is empty. In safe mode, this tracks the lifetime of
+  /// the targets of the borrows passed as arguments to the coroutine, or
+  /// explicitly watched by it, so resuming the coroutine after any of them
+  /// was deleted is detected.
+  class coroutine_borrows {
+    /// Deduce the type of a borrow.
+    template <typename T> static void borrowed(const borrow<T>&);
+
+#ifdef CPL_SAFE // {
+    /// A watched borrow.
+    struct watched {
+      /// Identify the watch, or zero for an argument (which is watched until
+      /// the frame is destroyed).
+      size_t id;
+
+      /// The lifetime of the target of the borrow.
+      std::weak_ptr<const void> lifetime;
+    };
+
+    /// The watched borrows.
+    std::vector<watched> m_watched;
+
+    /// The identifier of the last scoped watch.
+    size_t m_last_id = 0;
+#endif // } CPL_SAFE
+
+  public:
+    /// Watch an argument of the coroutine, if it is a borrow.
+    template <typename A> inline void watch(const A& argument) {
+#ifdef CPL_FAST // {
+      (void)argument;
+#endif          // } CPL_FAST
+#ifdef CPL_SAFE // {
+      if constexpr (requires { borrowed(argument); }) {
+        std::shared_ptr<const void> lifetime = argument.m_weak_ptr.lock();
+        if (lifetime) {
+          m_watched.push_back(watched{ 0, lifetime });
+        }
+      }
+#endif // } CPL_SAFE
+    }
+
+#ifdef CPL_SAFE // {
+    /// Watch a borrow until `unwatch` is given the returned identifier.
+    ///
+    /// This returns zero if there is nothing to watch.
+    template <typename T> inline size_t watch_scoped(const borrow<T>& borrowed) {
+      std::shared_ptr<const void> lifetime = borrowed.m_weak_ptr.lock();
+      if (!lifetime) {
+        return 0;
+      }
+      m_watched.push_back(watched{ ++m_last_id, lifetime });
+      return m_last_id;
+    }
+
+    /// Stop watching a borrow given the identifier returned by `watch_scoped`.
+    inline void unwatch(size_t id) {
+      for (size_t index = m_watched.size(); id > 0 && index > 0; --index) {
+        if (m_watched[index - 1].id == id) {
+          m_watched.erase(m_watched.begin() + (index - 1));
+          return;
+        }
+      }
+    }
+#endif // } CPL_SAFE
+
+    /// Verify all the watched borrows are still valid.
+    inline void verify() const {
+#ifdef CPL_SAFE // {
+      for (const watched& borrow_watched : m_watched) {
+        CPL_ASSERT(!borrow_watched.lifetime.expired(), "resuming a coroutine holding an expired borrow");
+      }
+#endif // } CPL_SAFE
+    }
+  };
+
+  /// Keep verifying a borrow whenever a coroutine resumes, until this goes
+  /// out of scope.
+  ///
+  /// This is returned by `co_await cpl::watch_borrow(borrowed)`. In fast
+  /// mode, it is empty.
+  class [[nodiscard]] borrow_watch_scope {
+#ifdef CPL_SAFE // {
+    /// The borrows of the coroutine, if watching anything.
+    coroutine_borrows* m_borrows;
+
+    /// The identifier of the watch.
+    size_t m_id;
+#endif // } CPL_SAFE
+
+  public:
+#ifdef CPL_FAST // {
+    /// Watch nothing.
+    inline borrow_watch_scope() {
+    }
+#endif // } CPL_FAST
+
+#ifdef CPL_SAFE // {
+    /// Stop watching a borrow of a coroutine when destroyed.
+    inline borrow_watch_scope(coroutine_borrows* borrows, size_t id) : m_borrows(id ? borrows : nullptr), m_id(id) {
+    }
+
+    /// Take over the watch of another scope.
+    inline borrow_watch_scope(borrow_watch_scope&& other) : m_borrows(other.m_borrows), m_id(other.m_id) {
+      other.m_borrows = nullptr;
+    }
+
+    /// Forbid copying.
+    borrow_watch_scope(const borrow_watch_scope&) = delete;
+
+    /// Forbid assignment.
+    borrow_watch_scope& operator=(const borrow_watch_scope&) = delete;
+#endif // } CPL_SAFE
+
+    /// Stop watching the borrow.
+    inline ~borrow_watch_scope() {
+#ifdef CPL_SAFE // {
+      if (m_borrows) {
+        m_borrows->unwatch(m_id);
+      }
+#endif // } CPL_SAFE
+    }
+  };
+
+  /// Request that a suspended coroutine will verify a borrow is still valid
+  /// whenever it resumes (using `co_await cpl::watch_borrow(borrowed)`).
+  template <typename T> struct borrow_watch {
+    /// The watched borrow.
+    const borrow<T>& watched;
+
+#ifdef CPL_SAFE // {
+    /// The borrows of the awaiting coroutine (given by its promise).
+    coroutine_borrows* borrows = nullptr;
+#endif // } CPL_SAFE
+
+    /// Never suspend.
+    inline bool await_ready() const noexcept {
+      return true;
+    }
+
+    /// Never suspend.
+    inline void await_suspend(std::coroutine_handle<>) const noexcept {
+    }
+
+    /// Start watching the borrow, until the returned scope is destroyed.
+    inline borrow_watch_scope await_resume() const {
+#ifdef CPL_FAST // {
+      return borrow_watch_scope();
+#endif          // } CPL_FAST
+#ifdef CPL_SAFE // {
+      return borrow_watch_scope(borrows, borrows ? borrows->watch_scoped(watched) : 0);
+#endif // } CPL_SAFE
+    }
+  };
+
+  /// Verify a borrow held by a coroutine is still valid whenever it resumes.
+  ///
+  /// The borrow is watched for as long as the scope returned by awaiting this
+  /// (`cpl::borrow_watch_scope scope = co_await cpl::watch_borrow(borrowed)`)
+  /// exists.
+  template <typename T> inline borrow_watch<T> watch_borrow(const borrow<T>& watched) {
+    return borrow_watch<T>{ watched };
+  }
+
+  /// Whether some type is a @ref cpl::borrow_watch.
+  template <typename A> struct is_borrow_watch : std::false_type {};
+
+  /// Whether some type is a @ref cpl::borrow_watch.
+  template <typename T> struct is_borrow_watch<borrow_watch<T>> : std::true_type {};
+
+  /// Obtain the awaiter for some awaitable expression.
+  template <typename A> inline decltype(auto) awaiter_of(A&& awaitable) {
+    if constexpr (requires { std::forward<A>(awaitable).operator co_await(); }) {
+      return std::forward<A>(awaitable).operator co_await();
+    } else if constexpr (requires { operator co_await(std::forward<A>(awaitable)); }) {
+      return operator co_await(std::forward<A>(awaitable));
+    } else {
+      return std::forward<A>(awaitable);
+    }
+  }
+
+  /// Verify the borrows of a coroutine when it resumes from awaiting.
+  template <typename A> class checked_awaiter {
+    /// The borrows of the awaiting coroutine.
+    const coroutine_borrows& m_borrows;
+
+    /// The actual awaiter.
+    decltype(awaiter_of(std::declval<A>())) m_awaiter;
+
+  public:
+    /// Wrap the awaiter of some awaitable expression.
+    inline checked_awaiter(const coroutine_borrows& borrows, A&& awaitable)
+      : m_borrows(borrows), m_awaiter(awaiter_of(std::forward<A>(awaitable))) {
+    }
+
+    /// Whether to skip suspending.
+    inline bool await_ready() {
+      return m_awaiter.await_ready();
+    }
+
+    /// Suspend the coroutine.
+    template <typename P> inline decltype(auto) await_suspend(std::coroutine_handle<P> handle) {
+      return m_awaiter.await_suspend(handle);
+    }
+
+    /// Verify the borrows and return the result.
+    inline decltype(auto) await_resume() {
+      m_borrows.verify();
+      return m_awaiter.await_resume();
+    }
+  };
+
+  template <typename T> class task;
+
+  /// The common part of the promise of a @ref cpl::task.
+  class task_promise_base {
+  public:
+    /// The coroutine awaiting the task, if any.
+    std::coroutine_handle<> continuation;
+
+    /// The exception thrown by the task, if any.
+    std::exception_ptr error;
+
+    /// The borrows held by the task.
+    coroutine_borrows borrows;
+
+    /// Watch the borrow arguments of the task.
+    template <typename... Args> inline task_promise_base(const Args&... arguments) {
+      (borrows.watch(arguments), ...);
+    }
+
+    /// Verify the borrows when the task starts running.
+    struct initial_awaiter {
+      /// The borrows of the task.
+      const coroutine_borrows& borrows;
+
+      /// Tasks are lazy.
+      inline bool await_ready() const noexcept {
+        return false;
+      }
+
+      /// Tasks are lazy.
+      inline void await_suspend(std::coroutine_handle<>) const noexcept {
+      }
+
+      /// Verify the borrows.
+      inline void await_resume() const {
+        borrows.verify();
+      }
+    };
+
+    /// Resume the awaiting coroutine when the task is done.
+    struct final_awaiter {
+      /// Always suspend, so the result can be taken.
+      inline bool await_ready() const noexcept {
+        return false;
+      }
+
+      /// Transfer control to the awaiting coroutine, if any.
+      template <typename P> inline std::coroutine_handle<> await_suspend(std::coroutine_handle<P> handle) const noexcept {
+        std::coroutine_handle<> continuation = handle.promise().continuation;
+        return continuation ? continuation : std::noop_coroutine();
+      }
+
+      /// Never resumed.
+      inline void await_resume() const noexcept {
+      }
+    };
+
+    /// Tasks are lazy.
+    inline initial_awaiter initial_suspend() const noexcept {
+      return initial_awaiter{ borrows };
+    }
+
+    /// Resume the awaiting coroutine when done.
+    inline final_awaiter final_suspend() const noexcept {
+      return final_awaiter{};
+    }
+
+    /// Remember the exception to rethrow it to the awaiter.
+    inline void unhandled_exception() {
+      error = std::current_exception();
+    }
+
+#ifdef CPL_SAFE // {
+    /// Verify the borrows whenever the task resumes.
+    template <typename A> inline decltype(auto) await_transform(A&& awaitable) {
+      if constexpr (is_borrow_watch<typename std::decay<A>::type>::value) {
+        return typename std::decay<A>::type{ awaitable.watched, &borrows };
+      } else {
+        return checked_awaiter<A>(borrows, std::forward<A>(awaitable));
+      }
+    }
+#endif // } CPL_SAFE
+  };
+
+  /// The promise of a @ref cpl::task.
+  template <typename T> class task_promise : public task_promise_base {
+    /// The returned value.
+    std::experimental::optional<T> m_value;
+
+  public:
+    using task_promise_base::task_promise_base;
+
+    /// The task of the coroutine.
+    inline task<T> get_return_object() {
+      return task<T>(std::coroutine_handle<task_promise>::from_promise(*this));
+    }
+
+    /// Remember the returned value.
+    template <typename U> inline void return_value(U&& value) {
+      m_value.emplace(std::forward<U>(value));
+    }
+
+    /// Take the result of the task.
+    inline T result() {
+      if (error) {
+        std::rethrow_exception(error);
+      }
+      return std::move(*m_value);
+    }
+  };
+
+  /// The promise of a @ref cpl::task which doesn't return a value.
+  template <> class task_promise<void> : public task_promise_base {
+  public:
+    using task_promise_base::task_promise_base;
+
+    /// The task of the coroutine.
+    inline task<void> get_return_object();
+
+    /// Nothing to remember.
+    inline void return_void() {
+    }
+
+    /// Take the result of the task.
+    inline void result() {
+      if (error) {
+        std::rethrow_exception(error);
+      }
+    }
+  };
+
+  /// Whether a coroutine parameter type is a (mutable) @ref cpl::frame_arena.
+  template <typename A> struct is_frame_arena_parameter : std::is_same<typename std::remove_reference<A>::type, frame_arena> {};
+
+  /// The promise of a @ref cpl::task with a @ref cpl::frame_arena parameter.
+  ///
+  /// This is selected by specializing `std::coroutine_traits` for the
+  /// parameter types `Args` of the coroutine, so that the frame allocation and
+  /// deallocation functions are plain (non-template) members of the same
+  /// class.
+  template <typename T, typename... Args> class arena_task_promise : public task_promise<T> {
+    /// The size of the header holding the arena of the frame.
+    static constexpr size_t header_size = __STDCPP_DEFAULT_NEW_ALIGNMENT__;
+
+    /// A frame arena argument.
+    static inline frame_arena* arena_of(frame_arena& arena) {
+      return &arena;
+    }
+
+    /// Any other argument.
+    template <typename A> static inline frame_arena* arena_of(A&) {
+      return nullptr;
+    }
+
+  public:
+    using task_promise<T>::task_promise;
+
+    /// Allocate the frame from the first @ref cpl::frame_arena argument,
+    /// preceded by a header holding the arena.
+    static inline void* operator new(size_t size, Args&... arguments) {
+      frame_arena* arena = nullptr;
+      ((arena = arena ? arena : arena_of(arguments)), ...);
+      void* header = arena->allocate(header_size + size);
+      *static_cast<frame_arena**>(header) = arena;
+      return static_cast<char*>(header) + header_size;
+    }
+
+    /// Free the frame back to its arena.
+    static inline void operator delete(void* frame, size_t size) {
+      void* header = static_cast<char*>(frame) - header_size;
+      (*static_cast<frame_arena**>(header))->deallocate(header, header_size + size);
+    }
+  };
+
+  template <typename T, typename... Args> constexpr size_t arena_task_promise<T, Args...>::header_size;
+
+  /// A lazy coroutine computing a value of type `T`.
+  ///
+  /// The coroutine starts running when the task is awaited (using
+  /// `co_await`) or explicitly resumed. If the coroutine has a @ref
+  /// cpl::frame_arena argument, its frame is allocated from this arena
+  /// instead of from the heap.
+  ///
+  /// In safe mode, the task tracks the borrows passed to it as arguments (and
+  /// any borrows it watches using @ref cpl::watch_borrow, while their watch
+  /// scope exists). Resuming the task
+  /// after the target of any of them was deleted throws an exception at the
+  /// point of resumption, which is rethrown to whoever awaits the task.
+  template <typename T = void> class task {
+  public:
+    /// The promise of the coroutine.
+    typedef task_promise<T> promise_type;
+
+  private:
+    /// The handle of the coroutine.
+    std::coroutine_handle<promise_type> m_handle;
+
+    /// Await the task from another coroutine.
+    struct awaiter {
+      /// The handle of the awaited coroutine.
+      std::coroutine_handle<promise_type> handle;
+
+      /// Whether the task is already done.
+      inline bool await_ready() const noexcept {
+        return handle.done();
+      }
+
+      /// Run the task, resuming the awaiting coroutine when done.
+      inline std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) const noexcept {
+        handle.promise().continuation = awaiting;
+        return handle;
+      }
+
+      /// Take the result of the task.
+      inline T await_resume() const {
+        return handle.promise().result();
+      }
+    };
+
+  public:
+    /// Wrap the handle of a coroutine.
+    inline explicit task(std::coroutine_handle<promise_type> handle) : m_handle(handle) {
+    }
+
+    /// Move a task.
+    inline task(task&& other) : m_handle(std::exchange(other.m_handle, nullptr)) {
+    }
+
+    /// Move a task.
+    inline task& operator=(task&& other) {
+      std::swap(m_handle, other.m_handle);
+      return *this;
+    }
+
+    /// Destroy the coroutine frame.
+    inline ~task() {
+      if (m_handle) {
+        m_handle.destroy();
+      }
+    }
+
+    /// Whether the coroutine has completed.
+    inline bool done() const {
+      CPL_ASSERT(m_handle, "accessing a moved task");
+      return m_handle.done();
+    }
+
+    /// Resume (or start) running the coroutine.
+    ///
+    /// This should only be used for the outermost task, as awaiting a task
+    /// resumes it automatically.
+    inline void resume() {
+      CPL_ASSERT(m_handle && !m_handle.done(), "resuming a completed task");
+      m_handle.resume();
+    }
+
+    /// Take the result of a completed coroutine, rethrowing any exception it
+    /// threw.
+    inline T result() {
+      CPL_ASSERT(m_handle && m_handle.done(), "taking the result of an incomplete task");
+      return m_handle.promise().result();
+    }
+
+    /// Await the task from another coroutine.
+    inline awaiter operator co_await() const noexcept {
+      return awaiter{ m_handle };
+    }
+  };
+
+  inline task<void> task_promise<void>::get_return_object() {
+    return task<void>(std::coroutine_handle<task_promise>::from_promise(*this));
+  }
+#endif // } __cpp_impl_coroutine
+
+#endif // } CPL_WITHOUT_COLLECTIONS
+
+#ifdef DOXYGEN // {
+  /// A fixed-size vector of bits.
+  ///
+  /// This is compiled to either `std::bitset` or `__gnu_debug::bitset`
+  /// depending on the compilation mode.
+  template <size_t N> class bitset {};
+
+  /// A mapping from keys to values.
+  ///
+  /// This is compiled to either `std::map` or `__gnu_debug::map` depending on
+  /// the compilation mode.
+  template <typename K, typename T, typename C = std::less<K>, typename A = std::allocator<std::pair<const K, T>>> class map {};
+
+  /// A set of values.
+  ///
+  /// This is compiled to either `std::set` or `__gnu_debug::set` depending on
+  /// the compilation mode.
+  template <typename T, typename C = std::less<T>, typename A = std::allocator<T>> class set {};
+
+  /// Just a string.
+  ///
+  /// This is compiled to either `std::string` or `__gnu_debug::string`
+  /// depending on the compilation mode.
+  class string {};
+
+#endif // } DOXYGEN
+
+#ifndef CPL_WITHOUT_COLLECTIONS // {
+
+#ifdef CPL_FAST // {
+  // Compiles to the standard version of a bitset.
+  template <size_t N> using bitset = std::bitset<N>;
+
+  // Compiles to the standard version of a map.
+  //
+  // @todo Should we convert `at` to a faster, unchecked operation?
+  template <typename K, typename T, typename C = std::less<K>, typename A = std::allocator<std::pair<const K, T>>>
+  using map = std::map<K, T, C, A>;
+
+  // Compiles to the standard version of a set.
+  template <typename T, typename C = std::less<T>, typename A = std::allocator<T>> using set = std::set<T, C, A>;
+
+  // Compiles to the standard version of a string.
+  using string = std::string;
+
+  // The standard version of a vector is the base of @ref cpl::vector.
+  //
+  // @todo Should we convert `at` to a faster, unchecked operation?
+  template <typename T, typename A = std::allocator<T>> using vector_base = std::vector<T, A>;
+#endif // } CPL_FAST
+
+#ifdef CPL_SAFE // {
+  // Compiles to the debug version of a bitset.
+  template <size_t N> using bitset = __gnu_debug::bitset<N>;
+
+  // Compiles to the debug version of a map.
+  template <typename K, typename T, typename C = std::less<K>, typename A = std::allocator<std::pair<const K, T>>>
+  using map = __gnu_debug::map<K, T, C, A>;
+
+  // Compiles to the debug version of a set.
+  template <typename T, typename C = std::less<T>, typename A = std::allocator<T>> using set = __gnu_debug::set<T, C, A>;
+
+  // Compiles to the debug version of a string.
+  using string = __gnu_debug::string;
+
+  // The debug version of a vector is the base of @ref cpl::vector.
+  template <typename T, typename A = std::allocator<T>> using vector_base = __gnu_debug::vector<T, A>;
+#endif // } CPL_SAFE
+
+  /// A dynamic vector of values.
+  ///
+  /// This derives from either `std::vector` or `__gnu_debug::vector`
+  /// depending on the compilation mode. In addition, it allows to `borrow`
+  /// its elements as a @ref cpl::ref.
+  ///
+  /// In safe mode, the vector holds a single epoch, which is shared by all
+  /// such borrows. Whenever the vector reallocates its elements, or changes
+  /// their positions (by inserting or erasing elements), it starts a new
+  /// epoch, and all the existing borrows become invalid. This avoids the need
+  /// to wrap each element in an @ref cpl::is (with a separate control block
+  /// per element).
+  ///
+  /// Modifying the vector through a reference to its base class bypasses
+  /// this tracking, so existing borrows will not be invalidated.
+  template <typename T, typename A = std::allocator<T>> class vector : public vector_base<T, A> {
+#ifdef CPL_SAFE // {
+    /// Track the lifetime of the current positions of the elements.
+    ///
+    /// This is only created when some element is borrowed.
+    mutable std::shared_ptr<const void> m_epoch;
+
+    /// Start a new epoch if the elements were reallocated.
+    struct reallocation_guard {
+      /// The guarded vector.
+      vector& m_vector;
+
+      /// The elements before the operation.
+      const T* m_data;
+
+      /// Remember the elements before the operation.
+      inline reallocation_guard(vector& guarded) : m_vector(guarded), m_data(guarded.data()) {
+      }
+
+      /// Start a new epoch if the elements were reallocated.
+      inline ~reallocation_guard() {
+        if (m_vector.data() != m_data) {
+          m_vector.m_epoch.reset();
+        }
+      }
+    };
+
+    /// Start a new epoch after some operation moves the elements around.
+    struct relocation_guard {
+      /// The guarded vector.
+      vector& m_vector;
+
+      /// Remember which vector is guarded.
+      inline relocation_guard(vector& guarded) : m_vector(guarded) {
+      }
+
+      /// Start a new epoch.
+      inline ~relocation_guard() {
+        m_vector.m_epoch.reset();
+      }
+    };
+#endif // } CPL_SAFE
+
+    /// Borrow the vector or one of its elements, for the current epoch.
+    template <typename U> inline ::cpl::ref<U> borrow_in_epoch(U& target) const {
+#ifdef CPL_FAST // {
+      return ::cpl::ref<U>{ &target, unsafe_raw_t(0) };
+#endif          // } CPL_FAST
+#ifdef CPL_SAFE // {
+      if (!m_epoch) {
+        m_epoch.reset(static_cast<const void*>(this), no_delete<const void>());
+      }
+      return ::cpl::ref<U>(sptr<U>(std::shared_ptr<U>(m_epoch, &target)));
+#endif // } CPL_SAFE
+    }
+
+  public:
+    using vector_base<T, A>::vector_base;
+
+    /// Default constructor.
+    inline vector() = default;
+
+    /// Copy the elements of a base class vector.
+    inline vector(const vector_base<T, A>& other) : vector_base<T, A>(other) {
+    }
+
+    /// Move the elements of a base class vector.
+    inline vector(vector_base<T, A>&& other) : vector_base<T, A>(std::move(other)) {
+    }
+
+#ifdef CPL_SAFE // {
+    /// Copy the elements but not the epoch.
+    inline vector(const vector& other) : vector_base<T, A>(other) {
+    }
+
+    /// Move the elements, invalidating their borrows.
+    inline vector(vector&& other) noexcept : vector_base<T, A>(std::move(other)) {
+      other.m_epoch.reset();
+    }
+
+    /// Copy the elements but not the epoch.
+    inline vector& operator=(const vector& other) {
+      relocation_guard guard(*this);
+      vector_base<T, A>::operator=(other);
+      return *this;
+    }
+
+    /// Move the elements, invalidating their borrows.
+    inline vector& operator=(vector&& other) noexcept(std::is_nothrow_move_assignable<vector_base<T, A>>::value) {
+      relocation_guard guard(*this);
+      other.m_epoch.reset();
+      vector_base<T, A>::operator=(std::move(other));
+      return *this;
+    }
+
+    /// Track replacing the elements.
+    inline vector& operator=(std::initializer_list<T> elements) {
+      relocation_guard guard(*this);
+      vector_base<T, A>::operator=(elements);
+      return *this;
+    }
+
+    /// Track replacing the elements.
+    template <typename... Args> inline void assign(Args&&... args) {
+      relocation_guard guard(*this);
+      vector_base<T, A>::assign(std::forward<Args>(args)...);
+    }
+
+    /// Track replacing the elements.
+    inline void assign(std::initializer_list<T> elements) {
+      relocation_guard guard(*this);
+      vector_base<T, A>::assign(elements);
+    }
+
+    /// Track swapping the elements.
+    inline void swap(vector& other) {
+      relocation_guard guard(*this);
+      other.m_epoch.reset();
+      vector_base<T, A>::swap(other);
+    }
+
+    /// Track reallocation of the elements.
+    inline void reserve(size_t capacity) {
+      reallocation_guard guard(*this);
+      vector_base<T, A>::reserve(capacity);
+    }
+
+    /// Track reallocation of the elements.
+    inline void shrink_to_fit() {
+      reallocation_guard guard(*this);
+      vector_base<T, A>::shrink_to_fit();
+    }
+
+    /// Track reallocation and erasure of the elements.
+    inline void resize(size_t size) {
+      reallocation_guard guard(*this);
+      if (size < vector_base<T, A>::size()) {
+        m_epoch.reset();
+      }
+      vector_base<T, A>::resize(size);
+    }
+
+    /// Track reallocation and erasure of the elements.
+    inline void resize(size_t size, const T& value) {
+      reallocation_guard guard(*this);
+      if (size < vector_base<T, A>::size()) {
+        m_epoch.reset();
+      }
+      vector_base<T, A>::resize(size, value);
+    }
+
+    /// Track reallocation of the elements.
+    inline void push_back(const T& value) {
+      reallocation_guard guard(*this);
+      vector_base<T, A>::push_back(value);
+    }
+
+    /// Track reallocation of the elements.
+    inline void push_back(T&& value) {
+      reallocation_guard guard(*this);
+      vector_base<T, A>::push_back(std::move(value));
+    }
+
+    /// Track reallocation of the elements.
+    template <typename... Args>
+    inline auto emplace_back(Args&&... args) -> decltype(vector_base<T, A>::emplace_back(std::forward<Args>(args)...)) {
+      reallocation_guard guard(*this);
+      return vector_base<T, A>::emplace_back(std::forward<Args>(args)...);
+    }
+
+    /// Track moving of the elements.
+    template <typename... Args>
+    inline auto insert(Args&&... args) -> decltype(vector_base<T, A>::insert(std::forward<Args>(args)...)) {
+      relocation_guard guard(*this);
+      return vector_base<T, A>::insert(std::forward<Args>(args)...);
+    }
+
+    /// Track moving of the elements.
+    inline typename vector_base<T, A>::iterator insert(typename vector_base<T, A>::const_iterator position, const T& value) {
+      relocation_guard guard(*this);
+      return vector_base<T, A>::insert(position, value);
+    }
+
+    /// Track moving of the elements.
+    inline typename vector_base<T, A>::iterator insert(typename vector_base<T, A>::const_iterator position, T&& value) {
+      relocation_guard guard(*this);
+      return vector_base<T, A>::insert(position, std::move(value));
+    }
+
+    /// Track moving of the elements.
+    inline typename vector_base<T, A>::iterator insert(typename vector_base<T, A>::const_iterator position,
+                                                       std::initializer_list<T> elements) {
+      relocation_guard guard(*this);
+      return vector_base<T, A>::insert(position, elements);
+    }
+
+    /// Track moving of the elements.
+    template <typename... Args>
+    inline auto emplace(Args&&... args) -> decltype(vector_base<T, A>::emplace(std::forward<Args>(args)...)) {
+      relocation_guard guard(*this);
+      return vector_base<T, A>::emplace(std::forward<Args>(args)...);
+    }
+
+    /// Track erasure of the elements.
+    template <typename... Args>
+    inline auto erase(Args&&... args) -> decltype(vector_base<T, A>::erase(std::forward<Args>(args)...)) {
+      relocation_guard guard(*this);
+      return vector_base<T, A>::erase(std::forward<Args>(args)...);
+    }
+
+    /// Track erasure of the elements.
+    inline void pop_back() {
+      relocation_guard guard(*this);
+      vector_base<T, A>::pop_back();
+    }
+
+    /// Track erasure of the elements.
+    inline void clear() {
+      relocation_guard guard(*this);
+      vector_base<T, A>::clear();
+    }
+#endif // } CPL_SAFE
+
+    /// Borrow an element.
+    ///
+    /// In safe mode, the borrow becomes invalid when the vector reallocates
+    /// or moves its elements around, or is deleted.
+    inline ::cpl::ref<T> borrow(size_t index) {
+      return borrow_in_epoch(vector_base<T, A>::operator[](index));
+    }
+
+    /// Borrow an element.
+    inline ::cpl::ref<const T> borrow(size_t index) const {
+      return borrow_in_epoch(vector_base<T, A>::operator[](index));
+    }
+
+    /// Borrow the whole vector (e.g., to create a @ref cpl::span of it).
+    ///
+    /// In safe mode, the borrow becomes invalid when the vector reallocates
+    /// or moves its elements around, or is deleted.
+    inline ::cpl::ref<vector> borrow_all() {
+      return borrow_in_epoch(*this);
+    }
+
+    /// Borrow the whole vector (e.g., to create a @ref cpl::span of it).
+    inline ::cpl::ref<const vector> borrow_all() const {
+      return borrow_in_epoch(*this);
+    }
+  };
+
+  namespace parallel {
+    /// Invoke a function on each element of a vector, in parallel.
+    template <typename T, typename A, typename F>
+    inline void for_each(vector<T, A>& elements, F function, thread_pool& pool = default_pool()) {
+      for_each(span<T>(elements.borrow_all()), function, pool);
+    }
+
+    /// Set each element of an output vector to the result of a function on
+    /// the matching element of an input vector, in parallel.
+    template <typename T, typename A, typename U, typename B, typename F>
+    inline void transform(const vector<T, A>& input, vector<U, B>& output, F function, thread_pool& pool = default_pool()) {
+      transform(span<const T>(input.borrow_all()), span<U>(output.borrow_all()), function, pool);
+    }
+
+    /// Combine all the elements of a vector, in parallel.
+    template <typename T, typename A, typename U, typename F>
+    inline U reduce(const vector<T, A>& elements, U initial, F function, thread_pool& pool = default_pool()) {
+      return reduce(span<const T>(elements.borrow_all()), initial, function, pool);
+    }
+
+    /// Sort the elements of a vector, in parallel.
+    template <typename T, typename A, typename C = std::less<T>>
+    inline void sort(vector<T, A>& elements, C compare = C(), thread_pool& pool = default_pool()) {
+      sort(span<T>(elements.borrow_all()), compare, pool);
+    }
+  }
+
+  /// A container of values accessed by stable handles.
+  ///
+  /// The values are held contiguously (in some arbitrary order) so iterating
+  /// on them is as fast as iterating on a @ref cpl::vector. Each value is also
+  /// given a handle (an index and a generation), which remains valid until
+  /// the value is erased, regardless of any other insertions and erasures.
+  /// Both `insert` and `erase` are O(1).
+  ///
+  /// Testing whether a handle is still valid using `contains` works in both
+  /// variants. Accessing a value through a stale handle is only detected in
+  /// safe mode.
+  template <typename T> class slot_map {
+  public:
+    /// A stable handle to a value.
+    struct handle {
+      /// The index of the slot of the value.
+      uint32_t index;
+
+      /// The generation of the slot when the value was inserted.
+      ///
+      /// This is always odd for a valid handle. The generation of a slot is
+      /// incremented when a value is inserted into it, and again when the
+      /// value is erased from it.
+      uint32_t generation;
+
+      /// Compare handles.
+      inline bool operator==(const handle& other) const {
+        return index == other.index && generation == other.generation;
+      }
+
+      /// Compare handles.
+      inline bool operator!=(const handle& other) const {
+        return !(*this == other);
+      }
+    };
+
+  private:
+    /// Locate a value given its handle.
+    struct slot {
+      /// The position of the value in `m_values`, or the index of the next
+      /// free slot if this slot is free.
+      uint32_t position;
+
+      /// The current generation of the slot (odd if it holds a value).
+      uint32_t generation;
+    };
+
+    /// The values (in arbitrary order).
+    vector<T> m_values;
+
+    /// The slot index of each value.
+    vector<uint32_t> m_value_slots;
+
+    /// All the slots (used and free).
+    vector<slot> m_slots;
+
+    /// The index of the first free slot (or the number of slots if there are
+    /// no free slots).
+    uint32_t m_free_slot = 0;
+
+  public:
+    /// Iterate on the values.
+    typedef typename vector<T>::iterator iterator;
+
+    /// Iterate on the values.
+    typedef typename vector<T>::const_iterator const_iterator;
+
+    /// The number of values.
+    inline size_t size() const {
+      return m_values.size();
+    }
+
+    /// Whether there are no values.
+    inline bool empty() const {
+      return m_values.empty();
+    }
+
+    /// Reserve room for some values.
+    inline void reserve(size_t size) {
+      m_values.reserve(size);
+      m_value_slots.reserve(size);
+      m_slots.reserve(size);
+    }
+
+    /// Insert a new value, returning its handle.
+    ///
+    /// If this throws (e.g., when out of memory), the container is unchanged.
+    template <typename... Args> inline handle insert(Args&&... args) {
+      uint32_t position = uint32_t(m_values.size());
+      uint32_t index = m_free_slot;
+      bool is_new_slot = index == m_slots.size();
+      if (is_new_slot) {
+        m_slots.push_back(slot{ position, 0 });
+      }
+      try {
+        m_value_slots.push_back(index);
+        m_values.emplace_back(std::forward<Args>(args)...);
+      } catch (...) {
+        m_value_slots.resize(position);
+        if (is_new_slot) {
+          m_slots.pop_back();
+        }
+        throw;
+      }
+      if (is_new_slot) {
+        ++m_free_slot;
+      } else {
+        m_free_slot = m_slots[index].position;
+        m_slots[index].position = position;
+      }
+      uint32_t generation = ++m_slots[index].generation;
+      return handle{ index, generation };
+    }
+
+    /// Whether the handle refers to a value in the container.
+    inline bool contains(const handle& value_handle) const {
+      return value_handle.index < m_slots.size() && m_slots[value_handle.index].generation == value_handle.generation
+             && (value_handle.generation & 1);
+    }
+
+    /// Erase a value given its handle.
+    ///
+    /// This moves the last value into the position of the erased one.
+    inline void erase(const handle& value_handle) {
+      CPL_ASSERT(contains(value_handle), "erasing a stale slot map handle");
+      slot& erased_slot = m_slots[value_handle.index];
+      uint32_t position = erased_slot.position;
+      uint32_t last_position = uint32_t(m_values.size() - 1);
+      if (position != last_position) {
+        m_values[position] = std::move(m_values[last_position]);
+        m_value_slots[position] = m_value_slots[last_position];
+        m_slots[m_value_slots[position]].position = position;
+      }
+      m_values.pop_back();
+      m_value_slots.pop_back();
+      ++erased_slot.generation;
+      erased_slot.position = m_free_slot;
+      m_free_slot = value_handle.index;
+    }
+
+    /// Erase all the values, invalidating all the handles.
+    inline void clear() {
+      for (uint32_t index : m_value_slots) {
+        slot& erased_slot = m_slots[index];
+        ++erased_slot.generation;
+        erased_slot.position = m_free_slot;
+        m_free_slot = index;
+      }
+      m_values.clear();
+      m_value_slots.clear();
+    }
+
+    /// Access a value given its handle.
+    inline T& operator[](const handle& value_handle) {
+      CPL_ASSERT(contains(value_handle), "accessing a stale slot map handle");
+      return m_values[m_slots[value_handle.index].position];
+    }
+
+    /// Access a value given its handle.
+    inline const T& operator[](const handle& value_handle) const {
+      CPL_ASSERT(contains(value_handle), "accessing a stale slot map handle");
+      return m_values[m_slots[value_handle.index].position];
+    }
+
+    /// The handle of the value at some position in the iteration order.
+    inline handle handle_at(size_t position) const {
+      uint32_t index = m_value_slots[position];
+      return handle{ index, m_slots[index].generation };
+    }
+
+    /// Start iterating on the values.
+    inline iterator begin() {
+      return m_values.begin();
+    }
+
+    /// Stop iterating on the values.
+    inline iterator end() {
+      return m_values.end();
+    }
+
+    /// Start iterating on the values.
+    inline const_iterator begin() const {
+      return m_values.begin();
+    }
+
+    /// Stop iterating on the values.
+    inline const_iterator end() const {
+      return m_values.end();
+    }
+  };
+
+  /// A vector of records, which holds each field in a separate column.
+  ///
+  /// This "struct of arrays" layout means that code which only accesses a few
+  /// of the fields of each record only needs to bring these fields into the
+  /// cache. Each column is a @ref cpl::vector, and is accessed as a @ref
+  /// cpl::span using `column<I>()`. Such views are raw in fast mode. In safe
+  /// mode, indexing them is bounds-checked, and iterating on them verifies
+  /// the column was not deleted or shrunk since they were created.
+  ///
+  /// The column types must not be `bool`, since `cpl::vector<bool>` does not
+  /// provide contiguous storage.
+  template <typename... Ts> class soa_vector {
+    /// Iterate on the column indices.
+    typedef std::index_sequence_for<Ts...> column_indices;
+
+    /// The columns.
+    std::tuple<is<vector<Ts>>...> m_columns;
+
+    /// Invoke a function on each column.
+    template <typename F, size_t... Is> inline void for_each_column(F function, std::index_sequence<Is...>) {
+      int ignored[] = { 0, (function(std::get<Is>(m_columns)), 0)... };
+      (void)ignored;
+    }
+
+    /// Remove the fields beyond some number of records, to undo a partial
+    /// change of the columns.
+    inline void truncate(size_t size) {
+      for_each_column(
+        [size](auto& column) {
+          while (column.size() > size) {
+            column.pop_back();
+          }
+        },
+        column_indices());
+    }
+
+    /// Append a record given its fields.
+    ///
+    /// If constructing some field throws, the fields appended to the other
+    /// columns are removed, so all the columns keep the same size.
+    template <typename... Args, size_t... Is> inline void emplace_fields(std::index_sequence<Is...>, Args&&... fields) {
+      size_t old_size = size();
+      try {
+        int ignored[] = { 0, (std::get<Is>(m_columns).emplace_back(std::forward<Args>(fields)), 0)... };
+        (void)ignored;
+      } catch (...) {
+        truncate(old_size);
+        throw;
+      }
+    }
+
+  public:
+    /// The type of the fields in some column.
+    template <size_t I> using column_type = typename std::tuple_element<I, std::tuple<Ts...>>::type;
+
+    /// The number of records.
+    inline size_t size() const {
+      return std::get<0>(m_columns).size();
+    }
+
+    /// Whether there are no records.
+    inline bool empty() const {
+      return std::get<0>(m_columns).empty();
+    }
+
+    /// Reserve room for some records.
+    inline void reserve(size_t size) {
+      for_each_column([size](auto& column) { column.reserve(size); }, column_indices());
+    }
+
+    /// Change the number of records, default-constructing any new fields.
+    ///
+    /// If constructing some field throws, the records are left unchanged.
+    inline void resize(size_t size) {
+      size_t old_size = this->size();
+      try {
+        for_each_column([size](auto& column) { column.resize(size); }, column_indices());
+      } catch (...) {
+        truncate(old_size);
+        throw;
+      }
+    }
+
+    /// Remove all the records.
+    inline void clear() {
+      for_each_column([](auto& column) { column.clear(); }, column_indices());
+    }
+
+    /// Append a record given its fields.
+    template <typename... Args> inline void emplace_back(Args&&... fields) {
+      static_assert(sizeof...(Args) == sizeof...(Ts), "appending a record with the wrong number of fields");
+      emplace_fields(column_indices(), std::forward<Args>(fields)...);
+    }
+
+    /// Append a record given its fields.
+    inline void push_back(const Ts&... fields) {
+      emplace_fields(column_indices(), fields...);
+    }
+
+    /// Remove the last record.
+    inline void pop_back() {
+      CPL_ASSERT(!empty(), "popping from an empty soa_vector");
+      for_each_column([](auto& column) { column.pop_back(); }, column_indices());
+    }
+
+    /// Remove a record by moving the last record into its place.
+    inline void swap_remove(size_t index) {
+      CPL_ASSERT(index < size(), "removing a soa_vector record out of bounds");
+      size_t last = size() - 1;
+      for_each_column(
+        [index, last](auto& column) {
+          if (index != last) {
+            column[index] = std::move(column[last]);
+          }
+          column.pop_back();
+        },
+        column_indices());
+    }
+
+    /// Access a field of some record.
+    template <size_t I> inline column_type<I>& at(size_t index) {
+      CPL_ASSERT(index < size(), "accessing a soa_vector record out of bounds");
+      return std::get<I>(m_columns)[index];
+    }
+
+    /// Access a field of some record.
+    template <size_t I> inline const column_type<I>& at(size_t index) const {
+      CPL_ASSERT(index < size(), "accessing a soa_vector record out of bounds");
+      return std::get<I>(m_columns)[index];
+    }
+
+    /// View the fields of all the records in some column.
+    template <size_t I> inline span<column_type<I>> column() {
+      return span<column_type<I>>(std::get<I>(m_columns));
+    }
+
+    /// View the fields of all the records in some column.
+    template <size_t I> inline span<const column_type<I>> column() const {
+      return span<const column_type<I>>(std::get<I>(m_columns));
+    }
+  };
+
+  /// A dynamically sized vector of bits.
+  ///
+  /// Unlike @ref cpl::bitset, the size is given at run-time. The bits are
+  /// packed into 64-bit words, and the bulk operations (`count`, `find_first`,
+  /// `find_next` and combining whole bitsets) work on whole words at a time,
+  /// using AVX2 instructions when compiled with `-mavx2`.
+  ///
+  /// In safe mode, bit indices are verified to be within bounds, and combined
+  /// bitsets are verified to have the same size.
+  class dynamic_bitset {
+  public:
+    /// The type of the words holding the bits.
+    typedef uint64_t word_type;
+
+  private:
+    /// The number of bits in each word.
+    static constexpr size_t word_bits = 64;
+
+    /// The words holding the bits.
+    ///
+    /// The unused bits of the last word are always zero. This is an internal
+    /// detail, all accesses to it are verified explicitly, so there's no
+    /// point in using a @ref cpl::vector.
+    std::vector<word_type> m_words;
+
+    /// The number of bits.
+    size_t m_size;
+
+    /// The number of words needed to hold some bits.
+    static inline size_t words_for(size_t size) {
+      return (size + word_bits - 1) / word_bits;
+    }
+
+    /// Ensure the unused bits of the last word are zero.
+    inline void trim() {
+      size_t used_bits = m_size % word_bits;
+      if (used_bits != 0) {
+        m_words.back() &= (word_type(1) << used_bits) - 1;
+      }
+    }
+
+    /// The number of set bits in some words.
+    static inline size_t count_words(const word_type* words, size_t size) {
+      size_t count = 0;
+      size_t index = 0;
+#ifdef __AVX2__ // {
+      // Count the bits of each nibble using a lookup table (Mula's algorithm).
+      const __m256i lookup = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,  //
+                                              0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+      const __m256i low_mask = _mm256_set1_epi8(0x0F);
+      __m256i totals = _mm256_setzero_si256();
+      for (; index + 4 <= size; index += 4) {
+        __m256i chunk = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(words + index));
+        __m256i low_counts = _mm256_shuffle_epi8(lookup, _mm256_and_si256(chunk, low_mask));
+        __m256i high_counts = _mm256_shuffle_epi8(lookup, _mm256_and_si256(_mm256_srli_epi16(chunk, 4), low_mask));
+        __m256i byte_counts = _mm256_add_epi8(low_counts, high_counts);
+        totals = _mm256_add_epi64(totals, _mm256_sad_epu8(byte_counts, _mm256_setzero_si256()));
+      }
+      count += size_t(_mm256_extract_epi64(totals, 0)) + size_t(_mm256_extract_epi64(totals, 1))
+               + size_t(_mm256_extract_epi64(totals, 2)) + size_t(_mm256_extract_epi64(totals, 3));
+#endif // } __AVX2__
+      for (; index < size; ++index) {
+        count += size_t(__builtin_popcountll(words[index]));
+      }
+      return count;
+    }
+
+    /// The index of the first non-zero word starting at some word (or the
+    /// number of words if they are all zero).
+    inline size_t find_word(size_t index) const {
+      const word_type* words = m_words.data();
+      size_t size = m_words.size();
+#ifdef __AVX2__ // {
+      while (index < size && (index % 4) != 0 && words[index] == 0) {
+        ++index;
+      }
+      for (; index + 4 <= size; index += 4) {
+        __m256i chunk = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(words + index));
+        if (!_mm256_testz_si256(chunk, chunk)) {
+          break;
+        }
+      }
+#endif // } __AVX2__
+      while (index < size && words[index] == 0) {
+        ++index;
+      }
+      return index;
+    }
+
+    /// The position of the first set bit starting at some word.
+    inline size_t find_from_word(size_t index) const {
+      index = find_word(index);
+      return index == m_words.size() ? m_size : index * word_bits + size_t(__builtin_ctzll(m_words[index]));
+    }
+
+    /// Combine the words of another bitset into this one.
+    template <typename Scalar
+#ifdef __AVX2__ // {
+              ,
+              typename Vector
+#endif // } __AVX2__
+              >
+    inline void combine(const dynamic_bitset& other,
+                        Scalar scalar
+#ifdef __AVX2__ // {
+                        ,
+                        Vector vector
+#endif // } __AVX2__
+                        ) {
+      CPL_ASSERT(m_size == other.m_size, "combining bitsets of different sizes");
+      word_type* words = m_words.data();
+      const word_type* other_words = other.m_words.data();
+      size_t size = m_words.size();
+      size_t index = 0;
+#ifdef __AVX2__ // {
+      for (; index + 4 <= size; index += 4) {
+        __m256i chunk = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(words + index));
+        __m256i other_chunk = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(other_words + index));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(words + index), vector(chunk, other_chunk));
+      }
+#endif // } __AVX2__
+      for (; index < size; ++index) {
+        words[index] = scalar(words[index], other_words[index]);
+      }
+    }
+
+  public:
+    /// Create a bitset with some number of bits, all with the same value.
+    inline explicit dynamic_bitset(size_t size = 0, bool value = false)
+      : m_words(words_for(size), value ? ~word_type(0) : word_type(0)), m_size(size) {
+      trim();
+    }
+
+    /// The number of bits.
+    inline size_t size() const {
+      return m_size;
+    }
+
+    /// Whether there are no bits.
+    inline bool empty() const {
+      return m_size == 0;
+    }
+
+    /// Change the number of bits, setting the new bits to some value.
+    inline void resize(size_t size, bool value = false) {
+      size_t old_size = m_size;
+      m_words.resize(words_for(size), value ? ~word_type(0) : word_type(0));
+      m_size = size;
+      if (value && size > old_size && old_size % word_bits != 0) {
+        m_words[old_size / word_bits] |= ~word_type(0) << (old_size % word_bits);
+      }
+      trim();
+    }
+
+    /// Access the value of a bit.
+    inline bool test(size_t index) const {
+      CPL_ASSERT(index < m_size, "accessing a bitset out of bounds");
+      return (m_words[index / word_bits] >> (index % word_bits)) & 1;
+    }
+
+    /// Access the value of a bit.
+    inline bool operator[](size_t index) const {
+      return test(index);
+    }
+
+    /// Set the value of a bit.
+    inline dynamic_bitset& set(size_t index, bool value = true) {
+      CPL_ASSERT(index < m_size, "accessing a bitset out of bounds");
+      word_type mask = word_type(1) << (index % word_bits);
+      word_type& word = m_words[index / word_bits];
+      word = value ? word | mask : word & ~mask;
+      return *this;
+    }
+
+    /// Clear a bit.
+    inline dynamic_bitset& reset(size_t index) {
+      return set(index, false);
+    }
+
+    /// Flip the value of a bit.
+    inline dynamic_bitset& flip(size_t index) {
+      CPL_ASSERT(index < m_size, "accessing a bitset out of bounds");
+      m_words[index / word_bits] ^= word_type(1) << (index % word_bits);
+      return *this;
+    }
+
+    /// Set all the bits.
+    inline dynamic_bitset& set() {
+      std::fill(m_words.begin(), m_words.end(), ~word_type(0));
+      trim();
+      return *this;
+    }
+
+    /// Clear all the bits.
+    inline dynamic_bitset& reset() {
+      std::fill(m_words.begin(), m_words.end(), word_type(0));
+      return *this;
+    }
+
+    /// Flip all the bits.
+    inline dynamic_bitset& flip() {
+      for (word_type& word : m_words) {
+        word = ~word;
+      }
+      trim();
+      return *this;
+    }
+
+    /// The number of set bits.
+    inline size_t count() const {
+      return count_words(m_words.data(), m_words.size());
+    }
+
+    /// Whether any bit is set.
+    inline bool any() const {
+      return find_word(0) != m_words.size();
+    }
+
+    /// Whether no bit is set.
+    inline bool none() const {
+      return !any();
+    }
+
+    /// Whether all the bits are set.
+    inline bool all() const {
+      return count() == m_size;
+    }
+
+    /// The position of the first set bit (or the size if there is none).
+    inline size_t find_first() const {
+      return find_from_word(0);
+    }
+
+    /// The position of the first set bit after some position (or the size
+    /// if there is none).
+    inline size_t find_next(size_t position) const {
+      CPL_ASSERT(position < m_size, "accessing a bitset out of bounds");
+      size_t next = position + 1;
+      size_t index = next / word_bits;
+      if (index == m_words.size()) {
+        return m_size;
+      }
+      word_type word = m_words[index] & (~word_type(0) << (next % word_bits));
+      return word != 0 ? index * word_bits + size_t(__builtin_ctzll(word)) : find_from_word(index + 1);
+    }
+
+    /// Keep only the bits which are also set in another bitset.
+    inline dynamic_bitset& operator&=(const dynamic_bitset& other) {
+      combine(other,
+              [](word_type lhs, word_type rhs) { return lhs & rhs; }
+#ifdef __AVX2__ // {
+              ,
+              [](__m256i lhs, __m256i rhs) { return _mm256_and_si256(lhs, rhs); }
+#endif // } __AVX2__
+              );
+      return *this;
+    }
+
+    /// Also set the bits which are set in another bitset.
+    inline dynamic_bitset& operator|=(const dynamic_bitset& other) {
+      combine(other,
+              [](word_type lhs, word_type rhs) { return lhs | rhs; }
+#ifdef __AVX2__ // {
+              ,
+              [](__m256i lhs, __m256i rhs) { return _mm256_or_si256(lhs, rhs); }
+#endif // } __AVX2__
+              );
+      return *this;
+    }
+
+    /// Flip the bits which are set in another bitset.
+    inline dynamic_bitset& operator^=(const dynamic_bitset& other) {
+      combine(other,
+              [](word_type lhs, word_type rhs) { return lhs ^ rhs; }
+#ifdef __AVX2__ // {
+              ,
+              [](__m256i lhs, __m256i rhs) { return _mm256_xor_si256(lhs, rhs); }
+#endif // } __AVX2__
+              );
+      return *this;
+    }
+
+    /// Clear the bits which are set in another bitset.
+    inline dynamic_bitset& and_not(const dynamic_bitset& other) {
+      combine(other,
+              [](word_type lhs, word_type rhs) { return lhs & ~rhs; }
+#ifdef __AVX2__ // {
+              ,
+              [](__m256i lhs, __m256i rhs) { return _mm256_andnot_si256(rhs, lhs); }
+#endif // } __AVX2__
+              );
+      return *this;
+    }
+
+    /// A copy with all the bits flipped.
+    inline dynamic_bitset operator~() const {
+      dynamic_bitset result(*this);
+      return result.flip();
+    }
+
+    /// Compare bitsets.
+    inline bool operator==(const dynamic_bitset& other) const {
+      return m_size == other.m_size && m_words == other.m_words;
+    }
+
+    /// Compare bitsets.
+    inline bool operator!=(const dynamic_bitset& other) const {
+      return !(*this == other);
+    }
+  };
+
+  /// The bits set in both bitsets.
+  inline dynamic_bitset operator&(dynamic_bitset lhs, const dynamic_bitset& rhs) {
+    lhs &= rhs;
+    return lhs;
+  }
+
+  /// The bits set in either bitset.
+  inline dynamic_bitset operator|(dynamic_bitset lhs, const dynamic_bitset& rhs) {
+    lhs |= rhs;
+    return lhs;
+  }
+
+  /// The bits set in exactly one of the bitsets.
+  inline dynamic_bitset operator^(dynamic_bitset lhs, const dynamic_bitset& rhs) {
+    lhs ^= rhs;
+    return lhs;
+  }
+
+  // Forward declare for the hooks.
+  class intrusive_container;
+
+  /// The part of an element which links it into an intrusive container.
+  ///
+  /// This is the common base of @ref cpl::list_hook and @ref cpl::set_hook. In
+  /// fast mode it is empty. In safe mode it knows which container the element
+  /// is linked into, and tracks the lifetime of the element so that it may be
+  /// safely borrowed from the container.
+  class intrusive_hook {
+    friend class intrusive_container;
+
+  protected:
+#ifdef CPL_SAFE // {
+    /// The container the element is linked into, if any.
+    intrusive_container* m_owner = nullptr;
+
+    /// If the element was linked using an unsafe borrow, this will provide a
+    /// lifetime to `m_lifetime`.
+    std::shared_ptr<void> m_unsafe_lifetime;
+
+    /// Track the lifetime of the element.
+    std::weak_ptr<void> m_lifetime;
+
+    /// Report the element was destroyed while still linked.
+    inline void lost();
+#endif // } CPL_SAFE
+
+    /// An unlinked element.
+    inline intrusive_hook() = default;
+
+    /// Copying an element does not copy its links.
+    inline intrusive_hook(const intrusive_hook&) {
+    }
+
+    /// Copying an element does not copy its links.
+    inline intrusive_hook& operator=(const intrusive_hook&) {
+      return *this;
+    }
+  };
+
+  /// The common base of intrusive containers.
+  ///
+  /// An intrusive container does not own its elements, and does not allocate
+  /// anything when elements are linked into it. Instead, each element contains
+  /// a hook (by inheriting from it) which holds the links. The elements are
+  /// owned elsewhere (typically by @ref cpl::uref or @ref cpl::is).
+  ///
+  /// In fast mode, an element destroyed while still linked will leave a
+  /// dangling pointer in the container. In safe mode, the element unlinks
+  /// itself, and the container reports the problem on its next use.
+  class intrusive_container {
+    friend class intrusive_hook;
+
+  protected:
+    /// The number of linked elements.
+    size_t m_size = 0;
+
+#ifdef CPL_SAFE // {
+    /// Whether an element was destroyed while still linked.
+    bool m_is_corrupt = false;
+
+    /// Whether the hook is linked into this container.
+    inline bool owns(const intrusive_hook& hook) const {
+      return hook.m_owner == this;
+    }
+#endif // } CPL_SAFE
+
+    /// Record that an element was linked into this container.
+    template <typename T> inline void attach(intrusive_hook& hook, const borrow<T>& element) {
+      ++m_size;
+#ifdef CPL_FAST // {
+      (void)hook;
+      (void)element;
+#endif          // } CPL_FAST
+#ifdef CPL_SAFE // {
+      hook.m_owner = this;
+      hook.m_unsafe_lifetime = element.m_unsafe_ptr;
+      hook.m_lifetime = element.m_weak_ptr;
+#endif // } CPL_SAFE
+    }
+
+    /// Forget the container an element was linked into.
+    static inline void forget(intrusive_hook& hook) {
+#ifdef CPL_FAST // {
+      (void)hook;
+#endif          // } CPL_FAST
+#ifdef CPL_SAFE // {
+      hook.m_owner = nullptr;
+      hook.m_unsafe_lifetime.reset();
+      hook.m_lifetime.reset();
+#endif // } CPL_SAFE
+    }
+
+    /// Record that an element was unlinked from this container.
+    inline void detach(intrusive_hook& hook) {
+      --m_size;
+      forget(hook);
+    }
+
+    /// Borrow a linked element (as a @ref cpl::ref or a @ref cpl::ptr).
+    template <typename B, typename T> static inline B borrow_element(const intrusive_hook& hook, T& element) {
+#ifdef CPL_FAST // {
+      (void)hook;
+      return B{ &element, unsafe_raw_t(0) };
+#endif          // } CPL_FAST
+#ifdef CPL_SAFE // {
+      std::shared_ptr<void> lifetime = hook.m_unsafe_lifetime ? hook.m_unsafe_lifetime : hook.m_lifetime.lock();
+      return B(sptr<T>(std::shared_ptr<T>(lifetime, &element)));
+#endif // } CPL_SAFE
+    }
+
+    /// Intrusive containers are not copied or moved.
+    inline intrusive_container() = default;
+
+    /// Intrusive containers are not copied or moved.
+    intrusive_container(const intrusive_container&) = delete;
+
+    /// Intrusive containers are not copied or moved.
+    intrusive_container& operator=(const intrusive_container&) = delete;
+
+  public:
+    /// The number of linked elements.
+    inline size_t size() const {
+      return m_size;
+    }
+
+    /// Whether there are no linked elements.
+    inline bool empty() const {
+      return m_size == 0;
+    }
+
+    /// Verify the container may be used.
+    ///
+    /// In fast mode, this does nothing. In safe mode, this verifies that no
+    /// element was destroyed while linked into the container. This is done
+    /// automatically by all the operations of the container.
+    inline void validate() const {
+      CPL_ASSERT(!m_is_corrupt, "using an intrusive container whose element was destroyed while linked");
+    }
+  };
+
+#ifdef CPL_SAFE // {
+  inline void intrusive_hook::lost() {
+    --m_owner->m_size;
+    m_owner->m_is_corrupt = true;
   }
+#endif // } CPL_SAFE
 
-  /// A clever cast between pointer types.
+  // Forward declare for the hooks.
+  template <typename T, typename Tag> class intrusive_list;
+
+  /// A hook for linking an element into an @ref cpl::intrusive_list.
   ///
-  /// In safe mode, this verifies that the raw pointer value did not change,
-  /// which will always be true unless you use virtual base classes.
-  template <typename T, typename U> inline ptr<T> cast_clever(const ptr<U>& from_ptr) {
+  /// An element may be linked into several lists at once by inheriting from
+  /// several hooks with different `Tag` types.
+  template <typename Tag = void> class list_hook : public intrusive_hook {
+    template <typename T, typename U> friend class intrusive_list;
+
+    /// The previous element in the list (or the list itself).
+    list_hook* m_prev = nullptr;
+
+    /// The next element in the list (or the list itself).
+    list_hook* m_next = nullptr;
+
+    /// Remove the element from the list.
+    inline void unlink() {
+      m_prev->m_next = m_next;
+      m_next->m_prev = m_prev;
+      m_prev = m_next = nullptr;
+    }
+
+    /// Insert the element before another one.
+    inline void link_before(list_hook& next) {
+      m_prev = next.m_prev;
+      m_next = &next;
+      m_prev->m_next = this;
+      next.m_prev = this;
+    }
+
+  public:
+    /// An unlinked element.
+    inline list_hook() = default;
+
+    /// Copying an element does not copy its links.
+    inline list_hook(const list_hook& other) : intrusive_hook(other) {
+    }
+
+    /// Copying an element does not copy its links.
+    inline list_hook& operator=(const list_hook&) {
+      return *this;
+    }
+
+    /// Whether the element is linked into a list.
+    inline bool is_linked() const {
+      return m_next;
+    }
+
+#ifdef CPL_SAFE // {
+    /// Unlink an element which is destroyed while still linked.
+    inline ~list_hook() {
+      if (m_owner) {
+        unlink();
+        lost();
+      }
+    }
+#endif // } CPL_SAFE
+  };
+
+  /// A doubly-linked list whose links are inside the elements.
+  ///
+  /// The elements must inherit from `list_hook<Tag>`. Linking and unlinking
+  /// elements is O(1) and does not allocate anything, and an element may be
+  /// unlinked (or moved to either end of the list) given just a reference to
+  /// it, which makes this suitable for LRU lists, timer wheels and the like.
+  ///
+  /// Elements are linked using any CPL borrow, and the ends of the list are
+  /// accessed as a @ref cpl::ref (which in safe mode tracks the element's
+  /// lifetime). Iterating on the list gives plain `T&`.
+  template <typename T, typename Tag = void> class intrusive_list : public intrusive_container {
+    /// The list itself, which is the end of the circular chain of elements.
+    list_hook<Tag> m_root;
+
+    /// Access the hook of an element.
+    static inline list_hook<Tag>& hook_of(T& element) {
+      return static_cast<list_hook<Tag>&>(element);
+    }
+
+    /// Access the element of a hook.
+    static inline T& element_of(list_hook<Tag>* hook) {
+      return static_cast<T&>(*hook);
+    }
+
+    /// Link an element before some hook.
+    inline void link_before(const borrow<T>& element, list_hook<Tag>& next) {
+      validate();
+      list_hook<Tag>& hook = hook_of(*element);
+      CPL_ASSERT(!hook.is_linked(), "linking an already linked element");
+      hook.link_before(next);
+      attach(hook, element);
+    }
+
+    /// Access the hook of an element linked into this list.
+    inline list_hook<Tag>& linked_hook_of(T& element) {
+      validate();
+      list_hook<Tag>& hook = hook_of(element);
+      CPL_ASSERT(owns(hook), "accessing an element which is not linked into the list");
+      return hook;
+    }
+
+    /// Unlink an element.
+    inline void unlink(list_hook<Tag>& hook) {
+      hook.unlink();
+      detach(hook);
+    }
+
+  public:
+    /// Iterate on the elements.
+    template <typename V> class basic_iterator {
+      template <typename U> friend class basic_iterator;
+      friend class intrusive_list;
+
+      /// The current element's hook (or the list itself).
+      list_hook<Tag>* m_hook;
+
+      /// Construct an iterator.
+      inline basic_iterator(list_hook<Tag>* hook) : m_hook(hook) {
+      }
+
+    public:
+      /// The kind of iterator.
+      typedef std::bidirectional_iterator_tag iterator_category;
+
+      /// The type of the elements.
+      typedef typename std::remove_cv<V>::type value_type;
+
+      /// The distance between elements.
+      typedef ptrdiff_t difference_type;
+
+      /// A pointer to an element.
+      typedef V* pointer;
+
+      /// A reference to an element.
+      typedef V& reference;
+
+      /// Convert a mutable iterator to a constant one.
+      template <typename U, typename = typename std::enable_if<std::is_convertible<U*, V*>::value>::type>
+      inline basic_iterator(const basic_iterator<U>& other)
+        : m_hook(other.m_hook) {
+      }
+
+      /// Access the element.
+      inline V& operator*() const {
+        return element_of(m_hook);
+      }
+
+      /// Access a data member.
+      inline V* operator->() const {
+        return &element_of(m_hook);
+      }
+
+      /// Advance to the next element.
+      inline basic_iterator& operator++() {
+        m_hook = m_hook->m_next;
+        return *this;
+      }
+
+      /// Advance to the next element.
+      inline basic_iterator operator++(int) {
+        basic_iterator result = *this;
+        m_hook = m_hook->m_next;
+        return result;
+      }
+
+      /// Retreat to the previous element.
+      inline basic_iterator& operator--() {
+        m_hook = m_hook->m_prev;
+        return *this;
+      }
+
+      /// Retreat to the previous element.
+      inline basic_iterator operator--(int) {
+        basic_iterator result = *this;
+        m_hook = m_hook->m_prev;
+        return result;
+      }
+
+      /// Compare iterators.
+      inline bool operator==(const basic_iterator& other) const {
+        return m_hook == other.m_hook;
+      }
+
+      /// Compare iterators.
+      inline bool operator!=(const basic_iterator& other) const {
+        return m_hook != other.m_hook;
+      }
+    };
+
+    /// Iterate on the elements.
+    typedef basic_iterator<T> iterator;
+
+    /// Iterate on the elements.
+    typedef basic_iterator<const T> const_iterator;
+
+    /// An empty list.
+    inline intrusive_list() {
+      m_root.m_prev = m_root.m_next = &m_root;
+    }
+
+    /// Unlink all the elements.
+    inline ~intrusive_list() {
+      clear();
+    }
+
+    /// Link an element at the start of the list.
+    inline void push_front(const borrow<T>& element) {
+      link_before(element, *m_root.m_next);
+    }
+
+    /// Link an element at the end of the list.
+    inline void push_back(const borrow<T>& element) {
+      link_before(element, m_root);
+    }
+
+    /// Link an element before the one at some position.
+    inline iterator insert(const_iterator position, const borrow<T>& element) {
+      link_before(element, *position.m_hook);
+      return iterator(position.m_hook->m_prev);
+    }
+
+    /// Unlink the first element.
+    inline void pop_front() {
+      validate();
+      CPL_ASSERT(m_size > 0, "popping from an empty intrusive list");
+      unlink(*m_root.m_next);
+    }
+
+    /// Unlink the last element.
+    inline void pop_back() {
+      validate();
+      CPL_ASSERT(m_size > 0, "popping from an empty intrusive list");
+      unlink(*m_root.m_prev);
+    }
+
+    /// Unlink an element.
+    inline void erase(T& element) {
+      unlink(linked_hook_of(element));
+    }
+
+    /// Unlink the element at some position, returning the position of the
+    /// next one.
+    inline iterator erase(const_iterator position) {
+      validate();
+      list_hook<Tag>* next = position.m_hook->m_next;
+      unlink(linked_hook_of(element_of(position.m_hook)));
+      return iterator(next);
+    }
+
+    /// Unlink all the elements.
+    inline void clear() {
+      list_hook<Tag>* hook = m_root.m_next;
+      while (hook != &m_root) {
+        list_hook<Tag>* next = hook->m_next;
+        hook->m_prev = hook->m_next = nullptr;
+        forget(*hook);
+        hook = next;
+      }
+      m_root.m_prev = m_root.m_next = &m_root;
+      m_size = 0;
+#ifdef CPL_SAFE // {
+      m_is_corrupt = false;
+#endif // } CPL_SAFE
+    }
+
+    /// Move a linked element to the start of the list.
+    inline void move_to_front(T& element) {
+      list_hook<Tag>& hook = linked_hook_of(element);
+      hook.unlink();
+      hook.link_before(*m_root.m_next);
+    }
+
+    /// Move a linked element to the end of the list.
+    inline void move_to_back(T& element) {
+      list_hook<Tag>& hook = linked_hook_of(element);
+      hook.unlink();
+      hook.link_before(m_root);
+    }
+
+    /// Whether an element is linked into this list.
+    ///
+    /// In fast mode, this only tests whether the element is linked into some
+    /// list using the same hook.
+    inline bool contains(const T& element) const {
+      const list_hook<Tag>& hook = static_cast<const list_hook<Tag>&>(element);
+#ifdef CPL_FAST // {
+      return hook.is_linked();
+#endif          // } CPL_FAST
 #ifdef CPL_SAFE // {
-    U* from_raw = from_ptr.get();
-    T* to_dynamic = dynamic_cast<T*>(from_raw);
-    T* to_raw = static_cast<T*>(from_raw);
-    CPL_ASSERT(to_dynamic == to_raw, "clever cast gave the wrong result");
+      return owns(hook);
 #endif // } CPL_SAFE
-    return ptr<T>{ from_ptr, unsafe_static_t(0) };
-  }
+    }
 
-  /// A reinterpret cast between reference types.
-  template <typename T, typename U> inline sref<T> cast_reinterpret(const sref<U>& from_ref) {
-    return sref<T>{ from_ref, unsafe_raw_t(0) };
-  }
+    /// Borrow the first element.
+    inline ::cpl::ref<T> front() const {
+      validate();
+      CPL_ASSERT(m_size > 0, "accessing the front of an empty intrusive list");
+      return borrow_element<::cpl::ref<T>>(*m_root.m_next, element_of(m_root.m_next));
+    }
 
-  /// A reinterpret cast between pointer types.
-  template <typename T, typename U> inline sptr<T> cast_reinterpret(const sptr<U>& from_ptr) {
-    return sptr<T>{ from_ptr, unsafe_raw_t(0) };
-  }
+    /// Borrow the last element.
+    inline ::cpl::ref<T> back() const {
+      validate();
+      CPL_ASSERT(m_size > 0, "accessing the back of an empty intrusive list");
+      return borrow_element<::cpl::ref<T>>(*m_root.m_prev, element_of(m_root.m_prev));
+    }
 
-  /// A reinterpret cast between pointer types.
-  template <typename T, typename U> inline wptr<T> cast_reinterpret(const wptr<U>& from_ptr) {
-    return wptr<T>{ from_ptr, unsafe_raw_t(0) };
-  }
+    /// Start iterating on the elements.
+    inline iterator begin() {
+      validate();
+      return iterator(m_root.m_next);
+    }
 
-  /// A reinterpret cast between reference types.
-  template <typename T, typename U> inline uref<T> cast_reinterpret(uref<U>&& from_ref) {
-    return uref<T>{ std::move(from_ref), unsafe_raw_t(0) };
-  }
+    /// Stop iterating on the elements.
+    inline iterator end() {
+      return iterator(&m_root);
+    }
 
-  /// A reinterpret cast between pointer types.
-  template <typename T, typename U> inline uptr<T> cast_reinterpret(uptr<U>&& from_ptr) {
-    return uptr<T>{ std::move(from_ptr), unsafe_raw_t(0) };
-  }
+    /// Start iterating on the elements.
+    inline const_iterator begin() const {
+      validate();
+      return const_iterator(m_root.m_next);
+    }
 
-  /// A reinterpret cast between reference types.
-  template <typename T, typename U> inline ref<T> cast_reinterpret(const ref<U>& from_ref) {
-    return ref<T>{ from_ref, unsafe_raw_t(0) };
-  }
+    /// Stop iterating on the elements.
+    inline const_iterator end() const {
+      return const_iterator(const_cast<list_hook<Tag>*>(&m_root));
+    }
+  };
 
-  /// A reinterpret cast between pointer types.
-  template <typename T, typename U> inline ptr<T> cast_reinterpret(const ptr<U>& from_ptr) {
-    return ptr<T>{ from_ptr, unsafe_raw_t(0) };
-  }
+  // Forward declare for the hooks.
+  template <typename T, typename Tag, typename H, typename E> class intrusive_hash_set;
 
-  /// A dynamic cast between reference types.
-  template <typename T, typename U> inline sref<T> cast_dynamic(const sref<U>& from_ref) {
-    return sref<T>{ from_ref, unsafe_dynamic_t(0) };
-  }
+  /// A hook for linking an element into an @ref cpl::intrusive_hash_set.
+  ///
+  /// An element may be linked into several sets at once by inheriting from
+  /// several hooks with different `Tag` types.
+  template <typename Tag = void> class set_hook : public intrusive_hook {
+    template <typename T, typename U, typename H, typename E> friend class intrusive_hash_set;
+
+    /// The next element in the same bucket.
+    set_hook* m_next = nullptr;
+
+    /// The pointer to this element (in the bucket or in the previous element).
+    set_hook** m_prev_next = nullptr;
+
+    /// The cached hash of the element.
+    size_t m_hash = 0;
+
+    /// Insert the element at the start of a bucket.
+    inline void link_into(set_hook*& bucket) {
+      m_next = bucket;
+      m_prev_next = &bucket;
+      if (m_next) {
+        m_next->m_prev_next = &m_next;
+      }
+      bucket = this;
+    }
 
-  /// A dynamic cast between pointer types.
-  template <typename T, typename U> inline sptr<T> cast_dynamic(const sptr<U>& from_ptr) {
-    return sptr<T>{ from_ptr, unsafe_dynamic_t(0) };
-  }
+    /// Remove the element from its bucket.
+    inline void unlink() {
+      *m_prev_next = m_next;
+      if (m_next) {
+        m_next->m_prev_next = m_prev_next;
+      }
+      m_next = nullptr;
+      m_prev_next = nullptr;
+    }
 
-  /// A dynamic cast between pointer types.
-  template <typename T, typename U> inline wptr<T> cast_dynamic(const wptr<U>& from_ptr) {
-    return wptr<T>{ from_ptr, unsafe_dynamic_t(0) };
-  }
+  public:
+    /// An unlinked element.
+    inline set_hook() = default;
 
-  /// A dynamic cast between reference types.
-  template <typename T, typename U> inline uref<T> cast_dynamic(uref<U>&& from_ref) {
-    return uref<T>{ std::move(from_ref), unsafe_dynamic_t(0) };
-  }
+    /// Copying an element does not copy its links.
+    inline set_hook(const set_hook& other) : intrusive_hook(other) {
+    }
 
-  /// A dynamic cast between pointer types.
-  template <typename T, typename U> inline uptr<T> cast_dynamic(uptr<U>&& from_ptr) {
-    return uptr<T>{ std::move(from_ptr), unsafe_dynamic_t(0) };
-  }
+    /// Copying an element does not copy its links.
+    inline set_hook& operator=(const set_hook&) {
+      return *this;
+    }
 
-  /// A dynamic cast between reference types.
-  template <typename T, typename U> inline ref<T> cast_dynamic(const ref<U>& from_ref) {
-    return ref<T>{ from_ref, unsafe_dynamic_t(0) };
-  }
+    /// Whether the element is linked into a set.
+    inline bool is_linked() const {
+      return m_prev_next;
+    }
 
-  /// A dynamic cast between pointer types.
-  template <typename T, typename U> inline ptr<T> cast_dynamic(const ptr<U>& from_ptr) {
-    return ptr<T>{ from_ptr, unsafe_dynamic_t(0) };
-  }
+#ifdef CPL_SAFE // {
+    /// Unlink an element which is destroyed while still linked.
+    inline ~set_hook() {
+      if (m_owner) {
+        unlink();
+        lost();
+      }
+    }
+#endif // } CPL_SAFE
+  };
 
-  /// A static cast between reference types.
-  template <typename T, typename U> inline sref<T> cast_static(const sref<U>& from_ref) {
-    return sref<T>{ from_ref, unsafe_static_t(0) };
-  }
+  /// A hash set whose links are inside the elements.
+  ///
+  /// The elements must inherit from `set_hook<Tag>`. Linking and unlinking
+  /// elements does not allocate anything, except for growing the bucket array
+  /// (which may be avoided using `reserve`). The hash of each element is
+  /// computed once when it is linked, so the hashed parts of an element must
+  /// not be modified while it is linked.
+  ///
+  /// Lookups may use any key type `K` such that `H` accepts a `K`, and `E`
+  /// accepts a `T` and a `K`. By default, the key is the element itself.
+  template <typename T, typename Tag = void, typename H = std::hash<T>, typename E = std::equal_to<T>>
+  class intrusive_hash_set : public intrusive_container {
+    /// The first element in each bucket.
+    std::vector<set_hook<Tag>*> m_buckets;
+
+    /// Hash the elements.
+    H m_hash;
+
+    /// Compare elements to keys.
+    E m_equal;
+
+    /// Access the hook of an element.
+    static inline set_hook<Tag>& hook_of(T& element) {
+      return static_cast<set_hook<Tag>&>(element);
+    }
 
-  /// A static cast between pointer types.
-  template <typename T, typename U> inline sptr<T> cast_static(const sptr<U>& from_ptr) {
-    return sptr<T>{ from_ptr, unsafe_static_t(0) };
-  }
+    /// Access the element of a hook.
+    static inline T& element_of(set_hook<Tag>* hook) {
+      return static_cast<T&>(*hook);
+    }
 
-  /// A static cast between pointer types.
-  template <typename T, typename U> inline wptr<T> cast_static(const wptr<U>& from_ptr) {
-    return wptr<T>{ from_ptr, unsafe_static_t(0) };
-  }
+    /// The bucket of a hash.
+    inline set_hook<Tag>*& bucket_of(size_t hash) {
+      return m_buckets[hash & (m_buckets.size() - 1)];
+    }
 
-  /// A static cast between reference types.
-  template <typename T, typename U> inline uref<T> cast_static(uref<U>&& from_ref) {
-    return uref<T>{ std::move(from_ref), unsafe_static_t(0) };
-  }
+    /// Find the hook of an element equal to a key.
+    template <typename K> inline set_hook<Tag>* find_hook(const K& key, size_t hash) const {
+      if (m_buckets.empty()) {
+        return nullptr;
+      }
+      set_hook<Tag>* hook = m_buckets[hash & (m_buckets.size() - 1)];
+      while (hook && !(hook->m_hash == hash && m_equal(element_of(hook), key))) {
+        hook = hook->m_next;
+      }
+      return hook;
+    }
 
-  /// A static cast between pointer types.
-  template <typename T, typename U> inline uptr<T> cast_static(uptr<U>&& from_ptr) {
-    return uptr<T>{ std::move(from_ptr), unsafe_static_t(0) };
-  }
+    /// Move all the elements into a new bucket array.
+    inline void rehash(size_t bucket_count) {
+      std::vector<set_hook<Tag>*> buckets(bucket_count, nullptr);
+      m_buckets.swap(buckets);
+      for (set_hook<Tag>* hook : buckets) {
+        while (hook) {
+          set_hook<Tag>* next = hook->m_next;
+          hook->link_into(bucket_of(hook->m_hash));
+          hook = next;
+        }
+      }
+    }
 
-  /// A static cast between reference types.
-  template <typename T, typename U> inline ref<T> cast_static(const ref<U>& from_ref) {
-    return ref<T>{ from_ref, unsafe_static_t(0) };
-  }
+  public:
+    /// Iterate on the elements.
+    template <typename V> class basic_iterator {
+      template <typename U> friend class basic_iterator;
+      friend class intrusive_hash_set;
 
-  /// A static cast between pointer types.
-  template <typename T, typename U> inline ptr<T> cast_static(const ptr<U>& from_ptr) {
-    return ptr<T>{ from_ptr, unsafe_static_t(0) };
-  }
+      /// The buckets of the set.
+      set_hook<Tag>* const* m_bucket;
 
-  /// A const cast between reference types.
-  template <typename T, typename U> inline sref<T> cast_const(const sref<U>& from_ref) {
-    return sref<T>{ from_ref, unsafe_const_t(0) };
-  }
+      /// The end of the buckets of the set.
+      set_hook<Tag>* const* m_end;
 
-  /// A const cast between pointer types.
-  template <typename T, typename U> inline sptr<T> cast_const(const sptr<U>& from_ptr) {
-    return sptr<T>{ from_ptr, unsafe_const_t(0) };
-  }
+      /// The current element's hook.
+      set_hook<Tag>* m_hook;
 
-  /// A const cast between pointer types.
-  template <typename T, typename U> inline wptr<T> cast_const(const wptr<U>& from_ptr) {
-    return wptr<T>{ from_ptr, unsafe_const_t(0) };
-  }
+      /// Skip to the next non-empty bucket, if needed.
+      inline void skip_empty() {
+        while (!m_hook && m_bucket != m_end && ++m_bucket != m_end) {
+          m_hook = *m_bucket;
+        }
+      }
 
-  /// A const cast between reference types.
-  template <typename T, typename U> inline uref<T> cast_const(uref<U>&& from_ref) {
-    return uref<T>{ std::move(from_ref), unsafe_const_t(0) };
-  }
+      /// Construct an iterator.
+      inline basic_iterator(set_hook<Tag>* const* bucket, set_hook<Tag>* const* end)
+        : m_bucket(bucket), m_end(end), m_hook(bucket == end ? nullptr : *bucket) {
+        skip_empty();
+      }
 
-  /// A const cast between pointer types.
-  template <typename T, typename U> inline uptr<T> cast_const(uptr<U>&& from_ptr) {
-    return uptr<T>{ std::move(from_ptr), unsafe_const_t(0) };
-  }
+    public:
+      /// The kind of iterator.
+      typedef std::forward_iterator_tag iterator_category;
 
-  /// A const cast between reference types.
-  template <typename T, typename U> inline ref<T> cast_const(const ref<U>& from_ref) {
-    return ref<T>{ from_ref, unsafe_const_t(0) };
-  }
+      /// The type of the elements.
+      typedef typename std::remove_cv<V>::type value_type;
 
-  /// A const cast between pointer types.
-  template <typename T, typename U> inline ptr<T> cast_const(const ptr<U>& from_ptr) {
-    return ptr<T>{ from_ptr, unsafe_const_t(0) };
-  }
+      /// The distance between elements.
+      typedef ptrdiff_t difference_type;
 
-#ifdef DOXYGEN // {
-  /// A fixed-size vector of bits.
-  ///
-  /// This is compiled to either `std::bitset` or `__gnu_debug::bitset`
-  /// depending on the compilation mode.
-  template <size_t N> class bitset {};
+      /// A pointer to an element.
+      typedef V* pointer;
 
-  /// A mapping from keys to values.
-  ///
-  /// This is compiled to either `std::map` or `__gnu_debug::map` depending on
-  /// the compilation mode.
-  template <typename K, typename T, typename C = std::less<K>, typename A = std::allocator<std::pair<const K, T>>> class map {};
+      /// A reference to an element.
+      typedef V& reference;
 
-  /// A set of values.
-  ///
-  /// This is compiled to either `std::set` or `__gnu_debug::set` depending on
-  /// the compilation mode.
-  template <typename T, typename C = std::less<T>, typename A = std::allocator<T>> class set {};
+      /// Convert a mutable iterator to a constant one.
+      template <typename U, typename = typename std::enable_if<std::is_convertible<U*, V*>::value>::type>
+      inline basic_iterator(const basic_iterator<U>& other)
+        : m_bucket(other.m_bucket), m_end(other.m_end), m_hook(other.m_hook) {
+      }
 
-  /// Just a string.
-  ///
-  /// This is compiled to either `std::string` or `__gnu_debug::string`
-  /// depending on the compilation mode.
-  class string {};
+      /// Access the element.
+      inline V& operator*() const {
+        return element_of(m_hook);
+      }
 
-  /// A dynamic vector of values.
-  ///
-  /// This is compiled to either `std::vector` or `__gnu_debug::vector`
-  /// depending on the compilation mode.
-  template <typename T, typename A = std::allocator<T>> class vector {};
-#endif // } DOXYGEN
+      /// Access a data member.
+      inline V* operator->() const {
+        return &element_of(m_hook);
+      }
 
-#ifndef CPL_WITHOUT_COLLECTIONS // {
+      /// Advance to the next element.
+      inline basic_iterator& operator++() {
+        m_hook = m_hook->m_next;
+        skip_empty();
+        return *this;
+      }
 
-#ifdef CPL_FAST // {
-  // Compiles to the standard version of a bitset.
-  template <size_t N> using bitset = std::bitset<N>;
+      /// Advance to the next element.
+      inline basic_iterator operator++(int) {
+        basic_iterator result = *this;
+        ++*this;
+        return result;
+      }
 
-  // Compiles to the standard version of a map.
-  //
-  // @todo Should we convert `at` to a faster, unchecked operation?
-  template <typename K, typename T, typename C = std::less<K>, typename A = std::allocator<std::pair<const K, T>>>
-  using map = std::map<K, T, C, A>;
+      /// Compare iterators.
+      inline bool operator==(const basic_iterator& other) const {
+        return m_hook == other.m_hook;
+      }
 
-  // Compiles to the standard version of a set.
-  template <typename T, typename C = std::less<T>, typename A = std::allocator<T>> using set = std::set<T, C, A>;
+      /// Compare iterators.
+      inline bool operator!=(const basic_iterator& other) const {
+        return m_hook != other.m_hook;
+      }
+    };
 
-  // Compiles to the standard version of a string.
-  using string = std::string;
+    /// Iterate on the elements.
+    typedef basic_iterator<T> iterator;
 
-  // Compiles to the standard version of a vector.
-  //
-  // @todo Should we convert `at` to a faster, unchecked operation?
-  template <typename T, typename A = std::allocator<T>> using vector = std::vector<T, A>;
-#endif // } CPL_FAST
+    /// Iterate on the elements.
+    typedef basic_iterator<const T> const_iterator;
 
-#ifdef CPL_SAFE // {
-  // Compiles to the debug version of a bitset.
-  template <size_t N> using bitset = __gnu_debug::bitset<N>;
+    /// An empty set.
+    inline intrusive_hash_set(const H& hash = H(), const E& equal = E()) : m_hash(hash), m_equal(equal) {
+    }
 
-  // Compiles to the debug version of a map.
-  template <typename K, typename T, typename C = std::less<K>, typename A = std::allocator<std::pair<const K, T>>>
-  using map = __gnu_debug::map<K, T, C, A>;
+    /// Unlink all the elements.
+    inline ~intrusive_hash_set() {
+      clear();
+    }
 
-  // Compiles to the debug version of a set.
-  template <typename T, typename C = std::less<T>, typename A = std::allocator<T>> using set = __gnu_debug::set<T, C, A>;
+    /// Ensure some number of elements may be linked without growing the
+    /// bucket array.
+    inline void reserve(size_t size) {
+      size_t bucket_count = m_buckets.empty() ? 8 : m_buckets.size();
+      while (bucket_count < size) {
+        bucket_count *= 2;
+      }
+      if (bucket_count != m_buckets.size()) {
+        rehash(bucket_count);
+      }
+    }
 
-  // Compiles to the debug version of a string.
-  using string = __gnu_debug::string;
+    /// Link an element, unless an equal one is already linked.
+    ///
+    /// Returns whether the element was linked.
+    inline bool insert(const borrow<T>& element) {
+      validate();
+      set_hook<Tag>& hook = hook_of(*element);
+      CPL_ASSERT(!hook.is_linked(), "linking an already linked element");
+      size_t hash = m_hash(*element);
+      if (find_hook(*element, hash)) {
+        return false;
+      }
+      reserve(m_size + 1);
+      hook.m_hash = hash;
+      hook.link_into(bucket_of(hash));
+      attach(hook, element);
+      return true;
+    }
+
+    /// Unlink an element.
+    inline void erase(T& element) {
+      validate();
+      set_hook<Tag>& hook = hook_of(element);
+      CPL_ASSERT(owns(hook), "erasing an element which is not linked into the set");
+      hook.unlink();
+      detach(hook);
+    }
+
+    /// Unlink the element equal to a key, if any.
+    ///
+    /// Returns whether an element was unlinked.
+    template <typename K> inline bool erase_key(const K& key) {
+      validate();
+      set_hook<Tag>* hook = find_hook(key, m_hash(key));
+      if (!hook) {
+        return false;
+      }
+      hook->unlink();
+      detach(*hook);
+      return true;
+    }
 
-  // Compiles to the debug version of a vector.
-  template <typename T, typename A = std::allocator<T>> using vector = __gnu_debug::vector<T, A>;
+    /// Unlink all the elements.
+    inline void clear() {
+      for (set_hook<Tag>*& bucket : m_buckets) {
+        while (bucket) {
+          set_hook<Tag>* hook = bucket;
+          bucket = hook->m_next;
+          hook->m_next = nullptr;
+          hook->m_prev_next = nullptr;
+          forget(*hook);
+        }
+      }
+      m_size = 0;
+#ifdef CPL_SAFE // {
+      m_is_corrupt = false;
 #endif // } CPL_SAFE
+    }
+
+    /// Borrow the element equal to a key, if any.
+    template <typename K> inline ptr<T> find(const K& key) const {
+      validate();
+      set_hook<Tag>* hook = find_hook(key, m_hash(key));
+      if (!hook) {
+        return ptr<T>();
+      }
+      return borrow_element<ptr<T>>(*hook, element_of(hook));
+    }
+
+    /// Whether an element equal to a key is linked.
+    template <typename K> inline bool contains(const K& key) const {
+      validate();
+      return find_hook(key, m_hash(key));
+    }
+
+    /// Start iterating on the elements.
+    inline iterator begin() {
+      validate();
+      return iterator(m_buckets.data(), m_buckets.data() + m_buckets.size());
+    }
+
+    /// Stop iterating on the elements.
+    inline iterator end() {
+      return iterator(m_buckets.data() + m_buckets.size(), m_buckets.data() + m_buckets.size());
+    }
+
+    /// Start iterating on the elements.
+    inline const_iterator begin() const {
+      validate();
+      return const_iterator(m_buckets.data(), m_buckets.data() + m_buckets.size());
+    }
+
+    /// Stop iterating on the elements.
+    inline const_iterator end() const {
+      return const_iterator(m_buckets.data() + m_buckets.size(), m_buckets.data() + m_buckets.size());
+    }
+  };
 
 #endif // } CPL_WITHOUT_COLLECTIONS
 }
+
+#ifndef CPL_WITHOUT_COLLECTIONS // {
+#ifdef __cpp_impl_coroutine // {
+/// Allocate the frame of a @ref cpl::task which has a @ref cpl::frame_arena
+/// parameter from this arena.
+template <typename T, typename... Args>
+requires(cpl::is_frame_arena_parameter<Args>::value || ...)
+struct std::coroutine_traits<cpl::task<T>, Args...> {
+  /// The promise allocating the frame from the arena.
+  typedef cpl::arena_task_promise<T, Args...> promise_type;
+};
+#endif // } __cpp_impl_coroutine
+#endif // } CPL_WITHOUT_COLLECTIONS
@@ -5,6 +5,10 @@
 #include "cpl.hpp"
 #include "catch.hpp"
 
+#include <random>
+#include <stdexcept>
+#include <thread>
+
 #ifdef DOXYGEN // {
 /// Require that the expression will be checked in the safe variant but not in
 /// the fast variant.
@@ -1357,4 +1361,1749 @@ namespace test {
     }
     REQUIRE(Foo::live_objects.size() == 0);
   }
+
+  TEST_CASE("viewing a vector through a span") {
+    GIVEN("a held vector") {
+      auto numbers = std::make_unique<cpl::is<cpl::vector<int>>>(cpl::vector<int>{ 1, 2, 3 });
+      numbers->reserve(8);
+      cpl::span<int> numbers_span{ *numbers };
+      REQUIRE(numbers_span.size() == 3);
+      THEN("we can iterate on the elements") {
+        int sum = 0;
+        for (int number : numbers_span) {
+          sum += number;
+        }
+        REQUIRE(sum == 6);
+      }
+      THEN("we can modify the elements") {
+        numbers_span[1] = 20;
+        REQUIRE((*numbers)[1] == 20);
+        REQUIRE(numbers_span.front() == 1);
+        REQUIRE(numbers_span.back() == 3);
+      }
+      THEN("we can view some of the elements") {
+        cpl::span<const int> tail_span = numbers_span.last(2);
+        REQUIRE(tail_span.size() == 2);
+        REQUIRE(tail_span[0] == 2);
+        REQUIRE(numbers_span.first(1)[0] == 1);
+        REQUIRE(numbers_span.subspan(1, 1)[0] == 2);
+      }
+      THEN("accessing an element out of bounds will be " CPL_VARIANT) {
+        REQUIRE_CPL_THROWS(numbers_span[3]);
+      }
+      THEN("creating a span out of bounds will be " CPL_VARIANT) {
+        REQUIRE_CPL_THROWS(numbers_span.subspan(2, 2));
+        REQUIRE_CPL_THROWS(cpl::span<int>(cpl::ref<cpl::vector<int>>(*numbers), 1, 3));
+      }
+      THEN("iterating after the vector was shrunk will be " CPL_VARIANT) {
+        numbers->pop_back();
+        REQUIRE_CPL_THROWS(numbers_span.begin());
+      }
+      THEN("iterating after the vector was deleted will be " CPL_VARIANT) {
+        numbers.reset();
+        REQUIRE_CPL_THROWS(numbers_span.begin());
+      }
+    }
+    GIVEN("a uniquely owned vector") {
+      cpl::uref<cpl::vector<int>> numbers = cpl::make_uref<cpl::vector<int>>(4, 7);
+      cpl::span<const int> numbers_span{ numbers };
+      THEN("we can view its elements") {
+        REQUIRE(numbers_span.size() == 4);
+        REQUIRE(numbers_span.data() == numbers->data());
+      }
+    }
+  }
+
+  TEST_CASE("viewing a string through a string view") {
+    GIVEN("a held string") {
+      auto text = std::make_unique<cpl::is<cpl::string>>("key=value; other=thing");
+      cpl::string_view text_view{ *text };
+      REQUIRE(text_view.length() == text->size());
+      THEN("we can tokenize it without copying") {
+        cpl::string_view rest = text_view;
+        size_t separator = rest.find(';');
+        REQUIRE(separator == 9);
+        cpl::string_view first = rest.substr(0, separator);
+        REQUIRE(first == cpl::unsafe_string_view("key=value"));
+        REQUIRE(first.find(cpl::unsafe_string_view("=")) == 3);
+        REQUIRE(first.find(cpl::unsafe_string_view("value")) == 4);
+        REQUIRE(first.find(cpl::unsafe_string_view("nope")) == cpl::string_view::npos);
+        rest.remove_prefix(separator + 2);
+        REQUIRE(rest == cpl::unsafe_string_view("other=thing"));
+        REQUIRE(rest.starts_with(cpl::unsafe_string_view("other")));
+        REQUIRE(rest.ends_with(cpl::unsafe_string_view("thing")));
+        REQUIRE(rest > first);
+        rest.remove_suffix(6);
+        REQUIRE(cpl::string(rest.begin(), rest.end()) == "other");
+      }
+      THEN("using it after the string was reallocated will be " CPL_VARIANT) {
+        text->assign(1000, 'x');
+        REQUIRE_CPL_THROWS(text_view.data());
+      }
+      THEN("using it after the string was deleted will be " CPL_VARIANT) {
+        text.reset();
+        REQUIRE_CPL_THROWS(text_view.begin());
+      }
+    }
+  }
+
+  TEST_CASE("holding values in a slot map") {
+    REQUIRE(Foo::live_objects.size() == 0);
+    GIVEN("a slot map with some values") {
+      cpl::slot_map<Foo> foos;
+      cpl::slot_map<Foo>::handle first = foos.insert(1);
+      cpl::slot_map<Foo>::handle second = foos.insert(2);
+      cpl::slot_map<Foo>::handle third = foos.insert(3);
+      REQUIRE(foos.size() == 3);
+      REQUIRE(Foo::live_objects.size() == 3);
+      THEN("we can access the values by their handles") {
+        REQUIRE(foos[first].foo == 1);
+        REQUIRE(foos[second].foo == 2);
+        REQUIRE(foos[third].foo == 3);
+      }
+      THEN("we can iterate on the values") {
+        int sum = 0;
+        for (const Foo& foo : foos) {
+          sum += foo.foo;
+        }
+        REQUIRE(sum == 6);
+        REQUIRE(foos.handle_at(0) == first);
+      }
+      THEN("erasing a value keeps the other handles valid") {
+        foos.erase(first);
+        REQUIRE(foos.size() == 2);
+        REQUIRE(Foo::live_objects.size() == 2);
+        REQUIRE_FALSE(foos.contains(first));
+        REQUIRE(foos[second].foo == 2);
+        REQUIRE(foos[third].foo == 3);
+        THEN("a new value reuses the slot with a new generation") {
+          cpl::slot_map<Foo>::handle fourth = foos.insert(4);
+          REQUIRE(fourth.index == first.index);
+          REQUIRE(fourth != first);
+          REQUIRE_FALSE(foos.contains(first));
+          REQUIRE(foos[fourth].foo == 4);
+        }
+        THEN("accessing the erased value will be " CPL_VARIANT) {
+          foos.insert(4);
+          REQUIRE_CPL_THROWS(foos[first]);
+        }
+      }
+      THEN("clearing the map invalidates all the handles") {
+        foos.clear();
+        REQUIRE(foos.empty());
+        REQUIRE(Foo::live_objects.size() == 0);
+        REQUIRE_FALSE(foos.contains(second));
+        REQUIRE(foos[foos.insert(5)].foo == 5);
+      }
+      THEN("a failed insertion leaves the map unchanged") {
+        struct Failing {
+          operator Foo() const {
+            throw std::runtime_error("failed");
+          }
+        };
+        REQUIRE_THROWS(foos.insert(Failing()));
+        REQUIRE(foos.size() == 3);
+        REQUIRE(Foo::live_objects.size() == 3);
+        cpl::slot_map<Foo>::handle fourth = foos.insert(4);
+        REQUIRE(foos[fourth].foo == 4);
+        foos.erase(second);
+        REQUIRE(foos[first].foo == 1);
+        REQUIRE(foos[third].foo == 3);
+        REQUIRE(foos[fourth].foo == 4);
+      }
+    }
+    REQUIRE(Foo::live_objects.size() == 0);
+  }
+
+  TEST_CASE("borrowing vector elements") {
+    REQUIRE(Foo::live_objects.size() == 0);
+    GIVEN("a vector with some elements") {
+      int foo = __LINE__;
+      cpl::vector<Foo> foos;
+      foos.reserve(3);
+      foos.emplace_back(foo);
+      foos.emplace_back(foo + 1);
+      cpl::ref<Foo> foo_ref = foos.borrow(0);
+      cpl::ref<const Foo> const_foo_ref = static_cast<const cpl::vector<Foo>&>(foos).borrow(0);
+      REQUIRE(Foo::live_objects.size() == 2);
+      VERIFY_VALID_REF(foo_ref);
+      VERIFY_VALID_REF(const_foo_ref);
+      THEN("adding an element without reallocation keeps the borrows valid") {
+        foos.emplace_back(foo + 2);
+        VERIFY_VALID_REF(foo_ref);
+        VERIFY_VALID_REF(const_foo_ref);
+      }
+      THEN("the borrows will be " CPL_VARIANT " if the vector is reallocated") {
+        foos.reserve(100);
+        VERIFY_EXPIRED_REF(foo_ref);
+        VERIFY_EXPIRED_REF(const_foo_ref);
+      }
+      THEN("the borrows will be " CPL_VARIANT " if an element is erased") {
+        foos.erase(foos.begin());
+        VERIFY_EXPIRED_REF(foo_ref);
+        VERIFY_EXPIRED_REF(const_foo_ref);
+        THEN("new borrows will be valid") {
+          foo += 1;
+          cpl::ref<Foo> new_foo_ref = foos.borrow(0);
+          VERIFY_VALID_REF(new_foo_ref);
+        }
+      }
+      THEN("the borrows will be " CPL_VARIANT " if the vector is moved") {
+        cpl::vector<Foo> moved_foos{ std::move(foos) };
+        REQUIRE(moved_foos.size() == 2);
+        REQUIRE_CPL_THROWS(*foo_ref);
+      }
+      THEN("the vector may be constructed from its base class") {
+        cpl::vector_base<Foo> base_foos = foos;
+        cpl::vector<Foo> copied_foos{ base_foos };
+        REQUIRE(copied_foos.size() == 2);
+        cpl::vector<Foo> moved_foos{ std::move(base_foos) };
+        REQUIRE(moved_foos.size() == 2);
+      }
+    }
+    GIVEN("vectors modified using braced lists") {
+      cpl::vector<std::pair<int, int>> pairs;
+      pairs.push_back({ 1, 2 });
+      pairs.insert(pairs.cbegin(), { 3, 4 });
+      cpl::vector<int> ints;
+      ints.assign({ 1, 2, 3 });
+      ints.insert(ints.cend(), { 4, 5 });
+      THEN("they hold the listed elements") {
+        REQUIRE(pairs.size() == 2);
+        REQUIRE(pairs[0].first == 3);
+        REQUIRE(pairs[1].second == 2);
+        REQUIRE(ints.size() == 5);
+        REQUIRE(ints[4] == 5);
+      }
+    }
+    REQUIRE(Foo::live_objects.size() == 0);
+  }
+
+  static_assert(std::is_nothrow_move_constructible<cpl::vector<int>>::value, "moving a vector may throw");
+  static_assert(std::is_nothrow_move_assignable<cpl::vector<int>>::value, "moving a vector may throw");
+
+  TEST_CASE("using a dynamic bitset") {
+    GIVEN("a bitset with some set bits") {
+      cpl::dynamic_bitset bits(1000);
+      size_t positions[] = { 3, 64, 65, 511, 999 };
+      for (size_t position : positions) {
+        bits.set(position);
+      }
+      THEN("we can count the set bits") {
+        REQUIRE(bits.count() == 5);
+        REQUIRE(bits.any());
+        REQUIRE_FALSE(bits.none());
+        REQUIRE_FALSE(bits.all());
+      }
+      THEN("we can scan the set bits") {
+        size_t found = 0;
+        for (size_t position = bits.find_first(); position < bits.size(); position = bits.find_next(position)) {
+          REQUIRE(position == positions[found++]);
+        }
+        REQUIRE(found == 5);
+      }
+      THEN("we can combine it with another bitset") {
+        cpl::dynamic_bitset other(1000);
+        other.set(64).set(500).set(999);
+        REQUIRE((bits & other).count() == 2);
+        REQUIRE((bits | other).count() == 6);
+        REQUIRE((bits ^ other).count() == 4);
+        REQUIRE(cpl::dynamic_bitset(bits).and_not(other).count() == 3);
+        REQUIRE((~bits).count() == 995);
+      }
+      THEN("we can resize it") {
+        bits.resize(1100, true);
+        REQUIRE(bits.count() == 105);
+        REQUIRE(bits.test(1000));
+        bits.resize(64);
+        REQUIRE(bits.count() == 1);
+        REQUIRE(bits.find_next(3) == 64);
+      }
+      THEN("accessing a bit out of bounds will be " CPL_VARIANT) {
+        REQUIRE_CPL_THROWS(bits.test(1000));
+      }
+      THEN("combining it with a bitset of a different size will be " CPL_VARIANT) {
+        cpl::dynamic_bitset other(1000 + 1);
+        REQUIRE_CPL_THROWS(bits &= other);
+      }
+    }
+    GIVEN("a bitset with all bits set") {
+      cpl::dynamic_bitset bits(130, true);
+      THEN("all the bits are set") {
+        REQUIRE(bits.all());
+        REQUIRE(bits.count() == 130);
+        bits.reset(129);
+        REQUIRE_FALSE(bits.all());
+        REQUIRE(bits.flip().count() == 1);
+      }
+    }
+  }
+
+  /// A sample element of intrusive containers.
+  struct Timer : cpl::list_hook<>, cpl::set_hook<> {
+    /// Identify the timer.
+    int id;
+
+    /// Construct a timer.
+    Timer(int id) : id(id) {
+    }
+  };
+
+  /// Hash timers by their identifier.
+  struct TimerHash {
+    /// Hash an identifier.
+    size_t operator()(int id) const {
+      return size_t(id);
+    }
+
+    /// Hash a timer.
+    size_t operator()(const Timer& timer) const {
+      return size_t(timer.id);
+    }
+  };
+
+  /// Compare timers by their identifier.
+  struct TimerEqual {
+    /// Compare a timer to an identifier.
+    bool operator()(const Timer& timer, int id) const {
+      return timer.id == id;
+    }
+
+    /// Compare timers.
+    bool operator()(const Timer& timer, const Timer& other) const {
+      return timer.id == other.id;
+    }
+  };
+
+  TEST_CASE("linking elements into intrusive containers") {
+    GIVEN("some timers linked into a list and a set") {
+      cpl::uref<Timer> first = cpl::make_uref<Timer>(1);
+      cpl::uref<Timer> second = cpl::make_uref<Timer>(2);
+      cpl::is<Timer> third(3);
+      cpl::intrusive_list<Timer> timers;
+      cpl::intrusive_hash_set<Timer, void, TimerHash, TimerEqual> index;
+      timers.push_back(first);
+      timers.push_back(second);
+      timers.push_front(third);
+      REQUIRE(index.insert(first));
+      REQUIRE(index.insert(second));
+      REQUIRE(index.insert(third));
+      REQUIRE(timers.size() == 3);
+      REQUIRE(index.size() == 3);
+      THEN("we can iterate on the list in order") {
+        std::vector<int> ids;
+        for (const Timer& timer : timers) {
+          ids.push_back(timer.id);
+        }
+        REQUIRE(ids == std::vector<int>({ 3, 1, 2 }));
+        REQUIRE(timers.front()->id == 3);
+        REQUIRE(timers.back()->id == 2);
+      }
+      THEN("we can find the elements in the set") {
+        REQUIRE(index.find(2)->id == 2);
+        REQUIRE(index.contains(3));
+        REQUIRE_FALSE(index.find(4));
+        int sum = 0;
+        for (const Timer& timer : index) {
+          sum += timer.id;
+        }
+        REQUIRE(sum == 6);
+      }
+      THEN("an equal element is not linked into the set") {
+        cpl::is<Timer> other(2);
+        REQUIRE_FALSE(index.insert(other));
+        REQUIRE_FALSE(other.cpl::set_hook<>::is_linked());
+        REQUIRE(index.size() == 3);
+      }
+      THEN("we can move an element to the end of the list") {
+        timers.move_to_back(*first);
+        REQUIRE(timers.front()->id == 3);
+        REQUIRE(timers.back()->id == 1);
+      }
+      THEN("we can unlink elements") {
+        timers.erase(*first);
+        REQUIRE(index.erase_key(1));
+        REQUIRE_FALSE(index.erase_key(1));
+        REQUIRE(timers.size() == 2);
+        REQUIRE(index.size() == 2);
+        REQUIRE_FALSE(timers.contains(*first));
+        REQUIRE_FALSE(first->cpl::list_hook<>::is_linked());
+        REQUIRE_FALSE(first->cpl::set_hook<>::is_linked());
+        timers.pop_front();
+        REQUIRE(timers.front()->id == 2);
+        THEN("an unlinked element may be linked again") {
+          timers.push_front(first);
+          REQUIRE(timers.front()->id == 1);
+        }
+      }
+      THEN("the set survives growing") {
+        std::vector<cpl::uref<Timer>> more;
+        for (int id = 4; id < 100; ++id) {
+          more.push_back(cpl::make_uref<Timer>(id));
+          REQUIRE(index.insert(more.back()));
+        }
+        REQUIRE(index.size() == 99);
+        for (int id = 1; id < 100; ++id) {
+          REQUIRE(index.find(id)->id == id);
+        }
+        index.clear();
+        REQUIRE(index.empty());
+        REQUIRE_FALSE(more.front()->cpl::set_hook<>::is_linked());
+      }
+#ifdef CPL_SAFE // {
+      THEN("linking an element twice will be detected") {
+        REQUIRE_THROWS(timers.push_back(first));
+      }
+      THEN("a borrowed element expires when the element is deleted") {
+        cpl::ref<Timer> back_ref = timers.back();
+        timers.erase(*second);
+        index.erase(*second);
+        second = cpl::make_uref<Timer>(4);
+        REQUIRE_THROWS(back_ref->id);
+      }
+      THEN("destroying a linked element will be detected") {
+        second = cpl::make_uref<Timer>(4);
+        REQUIRE(timers.size() == 2);
+        REQUIRE_THROWS(timers.front());
+        REQUIRE_THROWS(index.find(1));
+        timers.clear();
+        REQUIRE(timers.empty());
+        REQUIRE_NOTHROW(timers.push_back(second));
+      }
+#endif // } CPL_SAFE
+    }
+  }
+
+  TEST_CASE("holding records in a struct of arrays") {
+    GIVEN("a soa vector with some records") {
+      cpl::soa_vector<int, double, std::string> records;
+      records.reserve(4);
+      records.push_back(1, 0.5, "one");
+      records.emplace_back(2, 1.5, "two");
+      records.emplace_back(3, 2.5, "three");
+      REQUIRE(records.size() == 3);
+      THEN("we can access the fields of each record") {
+        REQUIRE(records.at<0>(1) == 2);
+        REQUIRE(records.at<1>(1) == 1.5);
+        REQUIRE(records.at<2>(1) == "two");
+      }
+      THEN("we can scan a column") {
+        double sum = 0;
+        for (double value : records.column<1>()) {
+          sum += value;
+        }
+        REQUIRE(sum == 4.5);
+        const cpl::soa_vector<int, double, std::string>& const_records = records;
+        cpl::span<const int> ids = const_records.column<0>();
+        REQUIRE(ids.size() == 3);
+        REQUIRE(ids[2] == 3);
+      }
+      THEN("removing a record moves the last record into its place") {
+        records.swap_remove(0);
+        REQUIRE(records.size() == 2);
+        REQUIRE(records.at<0>(0) == 3);
+        REQUIRE(records.at<2>(0) == "three");
+        records.pop_back();
+        REQUIRE(records.size() == 1);
+        REQUIRE(records.at<2>(0) == "three");
+      }
+      THEN("accessing a record out of bounds will be " CPL_VARIANT) {
+        REQUIRE_CPL_THROWS(records.column<0>()[3]);
+#ifdef CPL_SAFE // {
+        REQUIRE_THROWS(records.at<1>(3));
+#endif // } CPL_SAFE
+      }
+      THEN("iterating on a column after it was shrunk will be " CPL_VARIANT) {
+        cpl::span<int> ids = records.column<0>();
+        records.clear();
+        REQUIRE_CPL_THROWS(ids.begin());
+      }
+    }
+    GIVEN("a soa vector with a field whose construction may throw") {
+      struct Boom {
+        Boom(bool explode = true) {
+          if (explode) {
+            throw std::runtime_error("boom");
+          }
+        }
+      };
+      cpl::soa_vector<int, Boom> records;
+      records.emplace_back(1, false);
+      THEN("a failed append leaves all the columns with the same size") {
+        REQUIRE_THROWS(records.emplace_back(2, true));
+        REQUIRE(records.size() == 1);
+        REQUIRE(records.column<0>().size() == 1);
+        REQUIRE(records.column<1>().size() == 1);
+        REQUIRE(records.at<0>(0) == 1);
+      }
+      THEN("a failed resize leaves all the columns with the same size") {
+        REQUIRE_THROWS(records.resize(3));
+        REQUIRE(records.size() == 1);
+        REQUIRE(records.column<0>().size() == 1);
+        REQUIRE(records.column<1>().size() == 1);
+      }
+    }
+  }
+
+  TEST_CASE("owning an array") {
+    REQUIRE(Foo::live_objects.size() == 0);
+    GIVEN("a uniquely owned array") {
+      cpl::uref<Foo[]> foos = cpl::make_uref_array<Foo>(3);
+      REQUIRE(foos.size() == 3);
+      foos[0].foo = 1;
+      foos[2].foo = 3;
+      THEN("the elements are value-initialized") {
+        REQUIRE(foos[1].foo == 0);
+      }
+      THEN("accessing an element out of bounds will be " CPL_VARIANT) {
+#ifdef CPL_SAFE // {
+        REQUIRE_THROWS(foos[3]);
+#endif // } CPL_SAFE
+      }
+      THEN("we can view it through a span") {
+        cpl::span<const Foo> foos_span{ foos };
+        REQUIRE(foos_span.size() == 3);
+        REQUIRE(foos_span.back().foo == 3);
+        THEN("iterating after the array was deleted will be " CPL_VARIANT) {
+          cpl::uref<Foo[]> other = cpl::make_uref_array<Foo>(1);
+          foos = std::move(other);
+          REQUIRE_CPL_THROWS(foos_span.begin());
+        }
+      }
+      THEN("we can move it into a pointer and a shared reference") {
+        cpl::uptr<Foo[]> foos_ptr{ std::move(foos) };
+        REQUIRE(foos_ptr.size() == 3);
+        cpl::sref<Foo[]> shared_foos{ cpl::uref<Foo[]>(std::move(foos_ptr)) };
+        cpl::sref<Foo[]> more_shared_foos = shared_foos;
+        REQUIRE(more_shared_foos[2].foo == 3);
+        cpl::span<Foo> foos_span{ more_shared_foos };
+        REQUIRE(foos_span[0].foo == 1);
+      }
+      THEN("iterating after resetting a pointer to it will be " CPL_VARIANT) {
+        cpl::uptr<Foo[]> foos_ptr{ std::move(foos) };
+        cpl::span<const Foo> foos_span{ foos_ptr };
+        foos_ptr.reset();
+        REQUIRE(foos_ptr.size() == 0);
+        REQUIRE(Foo::live_objects.size() == 0);
+        REQUIRE_CPL_THROWS(foos_span.begin());
+      }
+    }
+    GIVEN("a too large array size") {
+      THEN("allocating it throws") {
+        REQUIRE_THROWS_AS(cpl::make_uptr_array<int>(size_t(-1) / 2), std::bad_array_new_length);
+      }
+    }
+    GIVEN("an aligned uninitialized array") {
+      cpl::uref<double[]> numbers = cpl::make_uref_array_uninitialized<double>(100, 64);
+      THEN("it is aligned") {
+        REQUIRE(reinterpret_cast<uintptr_t>(numbers.data()) % 64 == 0);
+        std::fill(numbers.begin(), numbers.end(), 0.5);
+        double sum = 0;
+        for (double number : numbers) {
+          sum += number;
+        }
+        REQUIRE(sum == 50);
+      }
+    }
+    GIVEN("a shared array") {
+      cpl::sref<int[]> numbers = cpl::make_sref_array<int>(4, 32);
+      THEN("it is aligned and initialized") {
+        REQUIRE(reinterpret_cast<uintptr_t>(numbers.data()) % 32 == 0);
+        REQUIRE(numbers[3] == 0);
+      }
+    }
+    REQUIRE(Foo::live_objects.size() == 0);
+  }
+
+  TEST_CASE("aligning values") {
+    REQUIRE(Foo::live_objects.size() == 0);
+    GIVEN("padded counters") {
+      cpl::vector<cpl::padded<int>, cpl::aligned_allocator<cpl::padded<int>>> counters(3);
+      THEN("each occupies its own cache lines") {
+        REQUIRE(sizeof(cpl::padded<int>) == CPL_CACHE_LINE_SIZE);
+        REQUIRE(reinterpret_cast<uintptr_t>(&counters[0]) % CPL_CACHE_LINE_SIZE == 0);
+        REQUIRE(reinterpret_cast<uintptr_t>(&counters[1].get()) - reinterpret_cast<uintptr_t>(&counters[0].get())
+                == CPL_CACHE_LINE_SIZE);
+        *counters[1] += 2;
+        REQUIRE(counters[1].get() == 2);
+      }
+      THEN("they may be copied") {
+        cpl::padded<int> counter = counters[1];
+        *counter += 1;
+        REQUIRE(counter.get() == 1);
+      }
+    }
+    GIVEN("an aligned unique reference") {
+      int foo = __LINE__;
+      cpl::uref<cpl::aligned<Foo, 128>> aligned_foo = cpl::make_uref_aligned<Foo, 128>(foo);
+      REQUIRE(reinterpret_cast<uintptr_t>(aligned_foo.get()) % 128 == 0);
+      REQUIRE((*aligned_foo)->foo == foo);
+      REQUIRE(Foo::live_objects.size() == 1);
+      THEN("a borrow expires when it is deleted") {
+        cpl::ref<cpl::aligned<Foo, 128>> aligned_ref = aligned_foo;
+        REQUIRE((*aligned_ref)->foo == foo);
+        aligned_foo = cpl::make_uref_aligned<Foo, 128>(foo + 1);
+        REQUIRE(Foo::live_objects.size() == 1);
+        REQUIRE_CPL_THROWS(*aligned_ref);
+      }
+    }
+    GIVEN("an aligned shared reference") {
+      int foo = __LINE__;
+      cpl::sref<Foo> foo_sref = cpl::make_sref_aligned<Foo>(256, foo);
+      REQUIRE(reinterpret_cast<uintptr_t>(foo_sref.get()) % 256 == 0);
+      REQUIRE(foo_sref->foo == foo);
+      THEN("a borrow expires when it is deleted") {
+        cpl::ref<Foo> foo_ref = foo_sref;
+        VERIFY_VALID_REF(foo_ref);
+        foo_sref = cpl::make_sref_aligned<Foo>(256, foo);
+        VERIFY_EXPIRED_REF(foo_ref);
+      }
+    }
+    GIVEN("a huge aligned allocation") {
+      THEN("it fails instead of wrapping around") {
+        REQUIRE_THROWS_AS(cpl::allocate_aligned(size_t(-1) - 8, 64), std::bad_alloc);
+      }
+    }
+    REQUIRE(Foo::live_objects.size() == 0);
+  }
+
+  TEST_CASE("publishing values atomically") {
+    REQUIRE(Foo::live_objects.size() == 0);
+    GIVEN("an atomic shared pointer") {
+      int foo = __LINE__;
+      cpl::atomic_sptr<Foo> published;
+      REQUIRE(!published.load());
+      published.store(cpl::make_sptr<Foo>(foo));
+      REQUIRE(Foo::live_objects.size() == 1);
+      THEN("we can load the value") {
+        cpl::sptr<Foo> foo_sptr = published.load();
+        REQUIRE(foo_sptr->foo == foo);
+        THEN("a borrow of the loaded value survives replacing it") {
+          cpl::ref<Foo> foo_ref{ foo_sptr };
+          published.store(cpl::make_sptr<Foo>(foo + 1));
+          VERIFY_VALID_REF(foo_ref);
+          REQUIRE(Foo::live_objects.size() == 2);
+          THEN("it expires when the loaded value is released") {
+            foo_sptr.reset();
+            REQUIRE(Foo::live_objects.size() == 1);
+            VERIFY_EXPIRED_REF(foo_ref);
+          }
+        }
+      }
+      THEN("we can exchange the value") {
+        cpl::sptr<Foo> previous = published.exchange(cpl::sptr<Foo>());
+        REQUIRE(previous->foo == foo);
+        REQUIRE(!published.load());
+      }
+      THEN("we can compare and exchange the value") {
+        cpl::sptr<Foo> expected;
+        REQUIRE_FALSE(published.compare_exchange_strong(expected, cpl::make_sptr<Foo>(foo + 1)));
+        REQUIRE(expected->foo == foo);
+        REQUIRE(published.compare_exchange_strong(expected, cpl::make_sptr<Foo>(foo + 2)));
+        REQUIRE(published.load()->foo == foo + 2);
+        REQUIRE(Foo::live_objects.size() == 2);
+      }
+      THEN("comparing the value also compares its ownership") {
+        cpl::sptr<Foo> current = published.load();
+        cpl::sptr<Foo> alias{ std::shared_ptr<Foo>(std::make_shared<int>(0), current.get()) };
+        REQUIRE_FALSE(published.compare_exchange_strong(alias, cpl::make_sptr<Foo>(foo + 1)));
+        REQUIRE(alias == current);
+        REQUIRE(published.compare_exchange_strong(alias, cpl::make_sptr<Foo>(foo + 1)));
+        REQUIRE(published.load()->foo == foo + 1);
+      }
+    }
+    GIVEN("an atomic shared reference read by many threads") {
+      cpl::atomic_sref<int> published{ cpl::make_sref<int>(1) };
+      std::atomic<bool> is_done{ false };
+      std::atomic<int> bad_reads{ 0 };
+      std::vector<std::thread> readers;
+      for (int index = 0; index < 4; ++index) {
+        readers.emplace_back([&]() {
+          while (!is_done) {
+            cpl::sref<int> number = published.load();
+            if (*number < 1) {
+              ++bad_reads;
+            }
+          }
+        });
+      }
+      for (int number = 2; number < 2000; ++number) {
+        cpl::sref<int> expected = published.load();
+        REQUIRE(published.compare_exchange_strong(expected, cpl::make_sref<int>(number)));
+      }
+      is_done = true;
+      for (std::thread& reader : readers) {
+        reader.join();
+      }
+      THEN("the readers always see a valid value") {
+        REQUIRE(bad_reads == 0);
+        REQUIRE(*published.load() == 1999);
+      }
+    }
+    REQUIRE(Foo::live_objects.size() == 0);
+  }
+
+  /// A node of a lock-free stack.
+  struct Link {
+    /// Some meaningless data.
+    int value;
+
+    /// The next node in the stack.
+    Link* next;
+  };
+
+  TEST_CASE("reclaiming nodes using epochs") {
+    REQUIRE(Foo::live_objects.size() == 0);
+    GIVEN("a node published in an epoch domain") {
+      int foo = __LINE__;
+      cpl::epoch_domain domain;
+      std::atomic<Foo*> published{ cpl::make_uref<Foo>(foo).release() };
+      THEN("a reader may borrow it inside a guard") {
+        cpl::epoch_guard guard(domain);
+        cpl::ptr<Foo> foo_ptr = guard.protect(published);
+        VERIFY_VALID_PTR(foo_ptr);
+      }
+      THEN("deleting a retired node waits for the readers to leave") {
+        {
+          cpl::epoch_guard guard(domain);
+          cpl::ptr<Foo> foo_ptr = guard.protect(published);
+          domain.retire(cpl::uref<Foo>(published.exchange(nullptr), cpl::unsafe_raw_t(0)));
+          REQUIRE(domain.reclaim() == 0);
+          REQUIRE(domain.retired_count() == 1);
+          VERIFY_VALID_PTR(foo_ptr);
+        }
+        REQUIRE(domain.reclaim() == 1);
+        REQUIRE(Foo::live_objects.size() == 0);
+      }
+      THEN("using a borrow after leaving the guard will be " CPL_VARIANT) {
+        cpl::ptr<Foo> escaped_ptr;
+        {
+          cpl::epoch_guard guard(domain);
+          escaped_ptr = guard.protect(published);
+        }
+        REQUIRE_CPL_THROWS(escaped_ptr->foo);
+      }
+      if (published.load()) {
+        domain.retire(cpl::uref<Foo>(published.load(), cpl::unsafe_raw_t(0)));
+      }
+      domain.synchronize();
+      REQUIRE(domain.retired_count() == 0);
+    }
+    REQUIRE(Foo::live_objects.size() == 0);
+    GIVEN("a lock-free stack accessed by several threads") {
+      cpl::epoch_domain domain(16);
+      std::atomic<Link*> head{ nullptr };
+      std::atomic<int> popped_sum{ 0 };
+      std::atomic<int> bad_reads{ 0 };
+      std::vector<std::thread> threads;
+      for (int index = 0; index < 4; ++index) {
+        threads.emplace_back([&, index]() {
+          for (int value = 1; value <= 1000; ++value) {
+            cpl::epoch_guard guard(domain);
+            if (index % 2 == 0) {
+              Link* link = cpl::make_uref<Link>(Link{ value, head.load() }).release();
+              while (!head.compare_exchange_weak(link->next, link)) {
+              }
+            }
+            cpl::ptr<Link> top = guard.protect(head);
+            if (top && top->value <= 0) {
+              ++bad_reads;
+            }
+            Link* popped = head.load();
+            while (popped && !head.compare_exchange_weak(popped, popped->next)) {
+            }
+            if (popped) {
+              popped_sum += popped->value;
+              domain.retire(cpl::uref<Link>(popped, cpl::unsafe_raw_t(0)));
+            }
+          }
+        });
+      }
+      for (std::thread& thread : threads) {
+        thread.join();
+      }
+      THEN("all the nodes were popped and reclaimed") {
+        REQUIRE(bad_reads == 0);
+        REQUIRE(head.load() == nullptr);
+        REQUIRE(popped_sum == 2 * 1000 * 1001 / 2);
+        domain.synchronize();
+        REQUIRE(domain.retired_count() == 0);
+      }
+    }
+  }
+
+  TEST_CASE("reclaiming nodes using hazard pointers") {
+    REQUIRE(Foo::live_objects.size() == 0);
+    GIVEN("a node published in a hazard domain") {
+      int foo = __LINE__;
+      cpl::hazard_domain domain;
+      std::atomic<Foo*> published{ cpl::make_uref<Foo>(foo).release() };
+      cpl::hazard_ptr<Foo> hazard(domain);
+      THEN("deleting a retired node waits until it is no longer protected") {
+        cpl::ptr<Foo> foo_ptr = hazard.protect(published);
+        VERIFY_VALID_PTR(foo_ptr);
+        domain.retire(cpl::uref<Foo>(published.exchange(nullptr), cpl::unsafe_raw_t(0)));
+        REQUIRE(domain.reclaim() == 0);
+        VERIFY_VALID_PTR(foo_ptr);
+        hazard.reset();
+        REQUIRE(domain.reclaim() == 1);
+        REQUIRE(Foo::live_objects.size() == 0);
+      }
+      THEN("only the protected nodes are kept") {
+        hazard.protect(published);
+        domain.retire(cpl::make_uref<Foo>(foo + 1));
+        REQUIRE(Foo::live_objects.size() == 2);
+        REQUIRE(domain.reclaim() == 1);
+        REQUIRE(Foo::live_objects.size() == 1);
+      }
+      THEN("using a borrow after resetting the hazard pointer will be " CPL_VARIANT) {
+        cpl::ptr<Foo> foo_ptr = hazard.protect(published);
+        hazard.reset();
+        REQUIRE_CPL_THROWS(foo_ptr->foo);
+      }
+      if (published.load()) {
+        domain.retire(cpl::uref<Foo>(published.load(), cpl::unsafe_raw_t(0)));
+      }
+    }
+    REQUIRE(Foo::live_objects.size() == 0);
+    GIVEN("a lock-free stack accessed by several threads") {
+      cpl::hazard_domain domain(16);
+      std::atomic<Link*> head{ nullptr };
+      std::atomic<int> popped_sum{ 0 };
+      std::vector<std::thread> threads;
+      for (int index = 0; index < 4; ++index) {
+        threads.emplace_back([&, index]() {
+          cpl::hazard_ptr<Link> hazard(domain);
+          for (int value = 1; value <= 1000; ++value) {
+            if (index % 2 == 0) {
+              Link* link = cpl::make_uref<Link>(Link{ value, head.load() }).release();
+              while (!head.compare_exchange_weak(link->next, link)) {
+              }
+            }
+            for (;;) {
+              cpl::ptr<Link> top = hazard.protect(head);
+              if (!top) {
+                break;
+              }
+              Link* popped = top.get();
+              if (head.compare_exchange_strong(popped, top->next)) {
+                popped_sum += top->value;
+                hazard.reset();
+                domain.retire(cpl::uref<Link>(popped, cpl::unsafe_raw_t(0)));
+                break;
+              }
+            }
+          }
+        });
+      }
+      for (std::thread& thread : threads) {
+        thread.join();
+      }
+      THEN("all the nodes were popped and reclaimed") {
+        REQUIRE(head.load() == nullptr);
+        REQUIRE(popped_sum == 2 * 1000 * 1001 / 2);
+        domain.reclaim();
+        REQUIRE(domain.retired_count() == 0);
+      }
+    }
+  }
+
+  TEST_CASE("reading and updating a value using RCU") {
+    REQUIRE(Foo::live_objects.size() == 0);
+    GIVEN("an RCU cell") {
+      int foo = __LINE__;
+      cpl::epoch_domain domain;
+      cpl::rcu<Foo> cell(domain, cpl::make_sref<Foo>(foo));
+      THEN("a reader sees the current version") {
+        cpl::epoch_guard guard(domain);
+        cpl::ref<const Foo> foo_ref = cell.read(guard);
+        VERIFY_VALID_REF(foo_ref);
+      }
+      THEN("an old version is kept until its readers leave") {
+        {
+          cpl::epoch_guard guard(domain);
+          cpl::ref<const Foo> foo_ref = cell.read(guard);
+          cell.update([](Foo& next) { next.foo += 1; });
+          VERIFY_VALID_REF(foo_ref);
+          REQUIRE(cell.read(guard)->foo == foo + 1);
+          REQUIRE(Foo::live_objects.size() == 2);
+        }
+        domain.synchronize();
+        REQUIRE(Foo::live_objects.size() == 1);
+        REQUIRE(cell.load()->foo == foo + 1);
+      }
+      THEN("a shared version outlives its grace period") {
+        cpl::sref<const Foo> foo_sref = cell.load();
+        cell.store(cpl::make_sref<Foo>(foo + 2));
+        domain.synchronize();
+        REQUIRE(Foo::live_objects.size() == 2);
+        REQUIRE(foo_sref->foo == foo);
+      }
+      THEN("using a version after its grace period will be " CPL_VARIANT) {
+        std::experimental::optional<cpl::ref<const Foo>> escaped_ref;
+        {
+          cpl::epoch_guard guard(domain);
+          escaped_ref.emplace(cell.read(guard));
+        }
+        REQUIRE_CPL_THROWS((*escaped_ref)->foo);
+      }
+      THEN("reading with a guard of a different domain will be " CPL_VARIANT) {
+        cpl::epoch_domain other_domain;
+        cpl::epoch_guard guard(other_domain);
+        REQUIRE_CPL_THROWS(cell.read(guard));
+      }
+    }
+    REQUIRE(Foo::live_objects.size() == 0);
+  }
+
+  TEST_CASE("sharing a value within a thread") {
+    REQUIRE(Foo::live_objects.size() == 0);
+    GIVEN("a counted reference") {
+      int foo = __LINE__;
+      cpl::rc<Foo> foo_rc = cpl::make_rc<Foo>(foo);
+      THEN("copies share the value") {
+        cpl::rc<Foo> copy_rc = foo_rc;
+        REQUIRE(copy_rc == foo_rc);
+        REQUIRE(foo_rc.use_count() == 2);
+        REQUIRE(copy_rc->foo == foo);
+        REQUIRE(Foo::live_objects.size() == 1);
+      }
+      THEN("the value is deleted with the last copy") {
+        cpl::rptr<Foo> foo_rptr{ foo_rc };
+        foo_rc = cpl::make_rc<Foo>(foo + 1);
+        REQUIRE(Foo::live_objects.size() == 2);
+        foo_rptr = nullptr;
+        REQUIRE(!foo_rptr);
+        REQUIRE(Foo::live_objects.size() == 1);
+        REQUIRE(foo_rc->foo == foo + 1);
+      }
+      THEN("it may be cast") {
+        cpl::rc<Foo> bar_as_foo_rc = cpl::make_rc<Bar>(foo, foo + 1);
+        cpl::rc<Bar> bar_rc = cpl::cast_static<Bar>(bar_as_foo_rc);
+        REQUIRE(bar_rc->bar == foo + 1);
+        REQUIRE(bar_as_foo_rc.use_count() == 2);
+        REQUIRE(cpl::cast_dynamic<Bar>(cpl::rptr<Foo>{ foo_rc }) == nullptr);
+        cpl::rc<const Foo> const_rc = foo_rc;
+        REQUIRE(cpl::cast_const<Foo>(const_rc)->foo == foo);
+      }
+      THEN("a borrow of it will expire with the value") {
+        cpl::ptr<Foo> foo_ptr = foo_rc;
+        cpl::ref<Foo> foo_ref = foo_rc;
+        VERIFY_VALID_PTR(foo_ptr);
+        VERIFY_VALID_REF(foo_ref);
+        foo_rc = cpl::make_rc<Foo>(foo + 1);
+        VERIFY_EXPIRED_PTR(foo_ptr);
+        VERIFY_EXPIRED_REF(foo_ref);
+      }
+      THEN("accessing it from another thread will be " CPL_VARIANT) {
+        bool did_throw = false;
+        std::thread([&] {
+          try {
+            (void)foo_rc->foo;
+          } catch (...) {
+            did_throw = true;
+          }
+        }).join();
+#ifdef CPL_SAFE // {
+        REQUIRE(did_throw);
+#else  // } CPL_SAFE {
+        REQUIRE(!did_throw);
+#endif // } CPL_SAFE
+      }
+    }
+    REQUIRE(Foo::live_objects.size() == 0);
+  }
+
+  TEST_CASE("biasing a shared reference towards a thread") {
+    REQUIRE(Foo::live_objects.size() == 0);
+    GIVEN("a shared reference") {
+      int foo = __LINE__;
+      cpl::sref<Foo> foo_sref = cpl::make_sref<Foo>(foo);
+      THEN("biased copies hold a single shared count") {
+        cpl::bsref<Foo> foo_bsref{ foo_sref };
+        long shared_count = foo_sref.use_count();
+        cpl::bsref<Foo> copy_bsref = foo_bsref;
+        cpl::rc<const Foo> const_rc = copy_bsref;
+        REQUIRE(foo_sref.use_count() == shared_count);
+        REQUIRE(foo_bsref.use_count() == 3);
+        REQUIRE(const_rc->foo == foo);
+      }
+      THEN("the value outlives the biased references") {
+        cpl::ptr<Foo> foo_ptr;
+        {
+          cpl::bsref<Foo> foo_bsref{ foo_sref };
+          foo_ptr = foo_bsref;
+          foo_sref = cpl::make_sref<Foo>(foo + 1);
+          REQUIRE(Foo::live_objects.size() == 2);
+          VERIFY_VALID_PTR(foo_ptr);
+          REQUIRE(foo_bsref.sref()->foo == foo);
+        }
+        REQUIRE(Foo::live_objects.size() == 1);
+        VERIFY_EXPIRED_PTR(foo_ptr);
+      }
+      THEN("each thread may bias its own references") {
+        std::vector<std::thread> threads;
+        std::atomic<int> total(0);
+        for (int thread_index = 0; thread_index < 4; ++thread_index) {
+          threads.emplace_back([&total](cpl::sref<Foo> thread_sref) {
+            cpl::bsref<Foo> thread_bsref{ thread_sref };
+            for (int copy_index = 0; copy_index < 1000; ++copy_index) {
+              cpl::bsref<Foo> copy_bsref = thread_bsref;
+              total += copy_bsref->foo > 0;
+            }
+          }, foo_sref);
+        }
+        for (std::thread& thread : threads) {
+          thread.join();
+        }
+        REQUIRE(total == 4000);
+        REQUIRE(foo_sref.use_count() == 1);
+      }
+      THEN("sharing a moved biased reference will be " CPL_VARIANT) {
+        cpl::bsref<Foo> foo_bsref{ foo_sref };
+        cpl::bsref<Foo> moved_bsref{ std::move(foo_bsref) };
+        REQUIRE(moved_bsref.sref()->foo == foo);
+#ifdef CPL_SAFE // {
+        REQUIRE_THROWS(foo_bsref.sref());
+#endif // } CPL_SAFE
+      }
+      THEN("using a biased reference from another thread will be " CPL_VARIANT) {
+        cpl::bsref<Foo> foo_bsref{ foo_sref };
+        bool did_throw = false;
+        std::thread([&] {
+          try {
+            (void)foo_bsref.sref();
+          } catch (...) {
+            did_throw = true;
+          }
+        }).join();
+#ifdef CPL_SAFE // {
+        REQUIRE(did_throw);
+#else  // } CPL_SAFE {
+        REQUIRE(!did_throw);
+#endif // } CPL_SAFE
+      }
+    }
+    REQUIRE(Foo::live_objects.size() == 0);
+  }
+
+  TEST_CASE("sending values through a channel") {
+    REQUIRE(Foo::live_objects.size() == 0);
+    GIVEN("a channel") {
+      cpl::channel<Foo> channel(3);
+      int foo = __LINE__;
+      THEN("its capacity is rounded to a power of two") {
+        REQUIRE(channel.capacity() == 4);
+      }
+      THEN("values are received in the order they were sent") {
+        REQUIRE(!channel.try_receive());
+        for (int index = 0; index < 4; ++index) {
+          REQUIRE(channel.try_send(cpl::make_uref<Foo>(foo + index)));
+        }
+        cpl::uref<Foo> rejected = cpl::make_uref<Foo>(foo + 4);
+        REQUIRE(!channel.try_send(std::move(rejected)));
+        REQUIRE(rejected->foo == foo + 4);
+        for (int index = 0; index < 4; ++index) {
+          REQUIRE(channel.receive()->foo == foo + index);
+        }
+        REQUIRE(!channel.try_receive());
+      }
+      THEN("values left in the channel are deleted with it") {
+        channel.send(cpl::make_uref<Foo>(foo));
+        REQUIRE(Foo::live_objects.size() == 1);
+      }
+      THEN("using a sent value will be " CPL_VARIANT) {
+        cpl::uref<Foo> foo_uref = cpl::make_uref<Foo>(foo);
+        cpl::ref<Foo> foo_ref = foo_uref;
+        channel.send(std::move(foo_uref));
+        REQUIRE_CPL_THROWS(foo_ref->foo);
+        cpl::uref<Foo> received_uref = channel.receive();
+        REQUIRE(received_uref->foo == foo);
+      }
+    }
+    GIVEN("many producers and consumers") {
+      cpl::uref<cpl::channel<int>> channel = cpl::make_uref<cpl::channel<int>>(16);
+      std::atomic<int> total(0);
+      std::vector<std::thread> threads;
+      for (int thread_index = 0; thread_index < 4; ++thread_index) {
+        threads.emplace_back([&channel] {
+          for (int value = 1; value <= 1000; ++value) {
+            channel->send(cpl::make_uref<int>(value));
+          }
+        });
+        threads.emplace_back([&channel, &total] {
+          for (int count = 0; count < 1000; ++count) {
+            total += *channel->receive();
+          }
+        });
+      }
+      for (std::thread& thread : threads) {
+        thread.join();
+      }
+      THEN("each value is received exactly once") {
+        REQUIRE(total == 4 * 500500);
+        REQUIRE(!channel->try_receive());
+      }
+    }
+    REQUIRE(Foo::live_objects.size() == 0);
+  }
+
+  TEST_CASE("streaming values through a ring") {
+    GIVEN("a ring") {
+      cpl::spsc_ring<int> ring(3);
+      THEN("its capacity is rounded to a power of two") {
+        REQUIRE(ring.capacity() == 4);
+      }
+      THEN("values are popped in the order they were pushed") {
+        int value = 0;
+        REQUIRE(!ring.try_pop(value));
+        for (int index = 0; index < 4; ++index) {
+          REQUIRE(ring.try_push(index));
+        }
+        REQUIRE(!ring.try_push(4));
+        for (int index = 0; index < 4; ++index) {
+          REQUIRE(ring.try_pop(value));
+          REQUIRE(value == index);
+        }
+        REQUIRE(!ring.try_pop(value));
+      }
+      THEN("values may be pushed and popped in batches") {
+        int value = 0;
+        REQUIRE(ring.try_push(0));
+        REQUIRE(ring.try_pop(value));
+        cpl::span<int> pushed = ring.push_span();
+        REQUIRE(pushed.size() == 3);
+        pushed[0] = 1;
+        pushed[1] = 2;
+        ring.commit_push(2);
+        REQUIRE(ring.push_span().size() == 1);
+        ring.commit_push(0);
+        cpl::span<int> popped = ring.pop_span(1);
+        REQUIRE(popped.size() == 1);
+        REQUIRE(popped[0] == 1);
+        ring.commit_pop(1);
+        REQUIRE(ring.pop_span().size() == 1);
+        ring.commit_pop(1);
+        REQUIRE(ring.pop_span().size() == 0);
+      }
+      THEN("committing more than was prepared will be " CPL_VARIANT) {
+        REQUIRE(ring.push_span(1).size() == 1);
+        REQUIRE_CPL_THROWS(ring.commit_push(2));
+      }
+      THEN("pushing from a second thread will be " CPL_VARIANT) {
+        REQUIRE(ring.try_push(0));
+        bool did_throw = false;
+        std::thread([&] {
+          try {
+            ring.try_push(1);
+          } catch (...) {
+            did_throw = true;
+          }
+        }).join();
+#ifdef CPL_SAFE // {
+        REQUIRE(did_throw);
+#else  // } CPL_SAFE {
+        REQUIRE(!did_throw);
+#endif // } CPL_SAFE
+      }
+    }
+    GIVEN("a producer and a consumer") {
+      cpl::uref<cpl::spsc_ring<int>> ring = cpl::make_uref<cpl::spsc_ring<int>>(64);
+      long total = 0;
+      std::thread producer([&ring] {
+        int next = 1;
+        while (next <= 100000) {
+          cpl::span<int> pushed = ring->push_span(100000 - next + 1);
+          for (int& value : pushed) {
+            value = next++;
+          }
+          ring->commit_push(pushed.size());
+        }
+      });
+      std::thread consumer([&ring, &total] {
+        int count = 0;
+        int value = 0;
+        while (count < 100000) {
+          if (ring->try_pop(value)) {
+            total += value;
+            ++count;
+          }
+        }
+      });
+      producer.join();
+      consumer.join();
+      THEN("each value is popped exactly once") {
+        REQUIRE(total == 100000L * 100001L / 2);
+      }
+    }
+  }
+
+  TEST_CASE("sharing a map between threads") {
+    REQUIRE(Foo::live_objects.size() == 0);
+    GIVEN("a concurrent map") {
+      cpl::concurrent_map<int, Foo> map(4);
+      int foo = __LINE__;
+      REQUIRE(map.insert(1, Foo(foo)));
+      THEN("keys may be looked up") {
+        REQUIRE(map.contains(1));
+        REQUIRE(!map.contains(2));
+        REQUIRE(map.read(1)->foo == foo);
+        REQUIRE(!map.read(2));
+        REQUIRE(map.size() == 1);
+      }
+      THEN("values may be modified in place") {
+        map.write(1)->foo = foo + 1;
+        map.emplace(2, foo + 2)->foo += 1;
+        REQUIRE(!map.insert(2, Foo(foo)));
+        map.insert_or_assign(1, Foo(foo + 4));
+        REQUIRE(map.read(1)->foo == foo + 4);
+        REQUIRE(map.read(2)->foo == foo + 3);
+        REQUIRE(map.erase(1));
+        REQUIRE(!map.erase(1));
+        REQUIRE(map.size() == 1);
+        map.clear();
+        REQUIRE(map.size() == 0);
+      }
+      THEN("a borrowed value is valid while the guard is held") {
+        cpl::concurrent_map<int, Foo>::read_guard guard = map.read(1);
+        cpl::ref<const Foo> foo_ref = guard.ref();
+        VERIFY_VALID_REF(foo_ref);
+      }
+      THEN("using a borrowed value after its guard is released will be " CPL_VARIANT) {
+        cpl::ptr<Foo> foo_ptr = map.write(1).get();
+        REQUIRE_CPL_THROWS(foo_ptr->foo);
+      }
+    }
+    GIVEN("many threads updating a map") {
+      cpl::concurrent_map<int, int> map;
+      std::vector<std::thread> threads;
+      for (int thread_index = 0; thread_index < 4; ++thread_index) {
+        threads.emplace_back([&map] {
+          for (int key = 0; key < 1000; ++key) {
+            *map.emplace(key, 0) += 1;
+          }
+        });
+      }
+      for (std::thread& thread : threads) {
+        thread.join();
+      }
+      THEN("no update is lost") {
+        REQUIRE(map.size() == 1000);
+        for (int key = 0; key < 1000; ++key) {
+          REQUIRE(*map.read(key) == 4);
+        }
+      }
+    }
+    REQUIRE(Foo::live_objects.size() == 0);
+  }
+
+  TEST_CASE("checking accesses to a cell") {
+    REQUIRE(Foo::live_objects.size() == 0);
+    GIVEN("a cell") {
+      int foo = __LINE__;
+      cpl::cell<Foo> foo_cell(foo);
+      THEN("it may be read by many guards") {
+        cpl::cell<Foo>::read_guard first_guard = foo_cell.read();
+        cpl::cell<Foo>::read_guard second_guard = foo_cell.read();
+        REQUIRE(first_guard->foo == foo);
+        REQUIRE(second_guard.ref()->foo == foo);
+      }
+      THEN("it may be written by one guard at a time") {
+        foo_cell.write()->foo = foo + 1;
+        {
+          cpl::cell<Foo>::write_guard guard = foo_cell.write();
+          guard->foo += 1;
+        }
+        REQUIRE(foo_cell.read()->foo == foo + 2);
+      }
+      THEN("writing it while it is read will be " CPL_VARIANT) {
+        cpl::cell<Foo>::read_guard guard = foo_cell.read();
+        REQUIRE_CPL_THROWS(foo_cell.write());
+      }
+      THEN("reading it while it is written will be " CPL_VARIANT) {
+        cpl::cell<Foo>::write_guard guard = foo_cell.write();
+        REQUIRE_CPL_THROWS(foo_cell.read());
+        REQUIRE_CPL_THROWS(foo_cell.write());
+      }
+      THEN("using a borrow after its guard is released will be " CPL_VARIANT) {
+        cpl::ptr<Foo> foo_ptr = foo_cell.write().get();
+        REQUIRE_CPL_THROWS(foo_ptr->foo);
+        REQUIRE(foo_cell.read()->foo == foo);
+      }
+    }
+    REQUIRE(Foo::live_objects.size() == 0);
+  }
+
+  /// A small trivially copyable value.
+  struct Point {
+    /// Some meaningless data.
+    int x;
+
+    /// More meaningless data.
+    int y;
+
+    /// Even more meaningless data.
+    int z;
+  };
+
+  TEST_CASE("polling a value protected by a sequence lock") {
+    GIVEN("a sequence lock") {
+      cpl::uref<cpl::seqlock<Point>> point = cpl::make_uref<cpl::seqlock<Point>>(Point{ 1, 2, 3 });
+      THEN("it holds the initial value") {
+        REQUIRE(point->load().z == 3);
+      }
+      THEN("it may be updated") {
+        point->store(Point{ 4, 5, 6 });
+        point->update([](Point& value) { value.x += 1; });
+        Point loaded = point->load();
+        REQUIRE(loaded.x == 5);
+        REQUIRE(loaded.y == 5);
+        REQUIRE(loaded.z == 6);
+      }
+      THEN("readers never see a partial write") {
+        std::atomic<bool> is_done(false);
+        std::atomic<int> torn_count(0);
+        std::vector<std::thread> readers;
+        for (int thread_index = 0; thread_index < 3; ++thread_index) {
+          readers.emplace_back([&] {
+            while (!is_done) {
+              Point loaded = point->load();
+              if (loaded.y != loaded.x + 1 || loaded.z != loaded.x + 2) {
+                ++torn_count;
+              }
+            }
+          });
+        }
+        for (int value = 0; value < 100000; ++value) {
+          point->store(Point{ value, value + 1, value + 2 });
+        }
+        is_done = true;
+        for (std::thread& reader : readers) {
+          reader.join();
+        }
+        REQUIRE(torn_count == 0);
+      }
+      THEN("writing from a second thread will be " CPL_VARIANT) {
+        point->store(Point{ 1, 2, 3 });
+        bool did_throw = false;
+        std::thread([&] {
+          try {
+            point->store(Point{ 4, 5, 6 });
+          } catch (...) {
+            did_throw = true;
+          }
+        }).join();
+#ifdef CPL_SAFE // {
+        REQUIRE(did_throw);
+#else  // } CPL_SAFE {
+        REQUIRE(!did_throw);
+#endif // } CPL_SAFE
+      }
+    }
+    GIVEN("a sequence lock of a value without a default constructor") {
+      struct Reading {
+        int value;
+
+        explicit Reading(int initial) : value(initial) {
+        }
+      };
+      cpl::seqlock<Reading> reading(Reading(1));
+      THEN("it may be loaded and updated") {
+        REQUIRE(reading.load().value == 1);
+        reading.store(Reading(2));
+        reading.update([](Reading& updated) { updated.value *= 3; });
+        REQUIRE(reading.load().value == 6);
+      }
+    }
+  }
+
+  TEST_CASE("counting using per-thread instances") {
+    GIVEN("a sharded counter") {
+      cpl::sharded<std::atomic<long>> counter;
+      THEN("it starts at zero") {
+        REQUIRE(counter.local()->load() == 0);
+      }
+      THEN("the updates of all the threads are combined") {
+        std::vector<std::thread> threads;
+        for (int thread_index = 0; thread_index < 4; ++thread_index) {
+          threads.emplace_back([&counter] {
+            cpl::sharded<std::atomic<long>>::local_ref local = counter.local();
+            for (int count = 0; count < 1000; ++count) {
+              local->fetch_add(1, std::memory_order_relaxed);
+            }
+          });
+        }
+        for (std::thread& thread : threads) {
+          thread.join();
+        }
+        counter.local()->fetch_add(1);
+        long total = counter.combine(0L, [](long sum, const std::atomic<long>& value) { return sum + value.load(); });
+        REQUIRE(total == 4001);
+        size_t shard_count = 0;
+        counter.for_each([&shard_count](const std::atomic<long>&) { ++shard_count; });
+        REQUIRE(shard_count >= 1);
+        REQUIRE(shard_count <= 5);
+      }
+      THEN("using the instance of another thread will be " CPL_VARIANT) {
+        cpl::sharded<std::atomic<long>>::local_ref local = counter.local();
+        bool did_throw = false;
+        std::thread([&] {
+          try {
+            local->fetch_add(1);
+          } catch (...) {
+            did_throw = true;
+          }
+        }).join();
+#ifdef CPL_SAFE // {
+        REQUIRE(did_throw);
+#else  // } CPL_SAFE {
+        REQUIRE(!did_throw);
+#endif // } CPL_SAFE
+      }
+    }
+  }
+
+  TEST_CASE("executing tasks in a thread pool") {
+    GIVEN("a thread pool") {
+      cpl::thread_pool pool(4);
+      THEN("it has the requested number of threads") {
+        REQUIRE(pool.size() == 4);
+      }
+      THEN("tasks return their results through futures") {
+        std::future<cpl::uref<int>> result = pool.submit([] { return cpl::make_uref<int>(7); });
+        REQUIRE(*result.get() == 7);
+      }
+      THEN("tasks may own their input") {
+        std::future<cpl::uref<int>> result
+          = pool.submit(cpl::make_uref<int>(6), [](int& input) { return cpl::make_uref<int>(input * 7); });
+        REQUIRE(*pool.wait(result) == 42);
+      }
+      THEN("tasks may wait for the tasks they submit") {
+        std::function<long(long, long)> sum = [&pool, &sum](long first, long last) -> long {
+          if (last - first <= 100) {
+            long total = 0;
+            for (long value = first; value < last; ++value) {
+              total += value;
+            }
+            return total;
+          }
+          long middle = (first + last) / 2;
+          std::future<long> left = pool.submit([&sum, first, middle] { return sum(first, middle); });
+          long right = sum(middle, last);
+          return pool.wait(left) + right;
+        };
+        std::future<long> total = pool.submit([&sum] { return sum(0, 100000); });
+        REQUIRE(pool.wait(total) == 100000L * 99999L / 2);
+      }
+      THEN("using a submitted input will be " CPL_VARIANT) {
+        cpl::uref<int> input = cpl::make_uref<int>(1);
+        cpl::ref<int> input_ref = input;
+        std::promise<void> is_started;
+        std::future<void> started = is_started.get_future();
+        std::promise<void> is_done;
+        std::future<void> done = is_done.get_future();
+        std::future<int> result = pool.submit(std::move(input), [&is_started, &done](int& value) {
+          is_started.set_value();
+          done.wait();
+          return value;
+        });
+        started.wait();
+        REQUIRE_CPL_THROWS(*input_ref);
+        is_done.set_value();
+        REQUIRE(result.get() == 1);
+      }
+    }
+  }
+
+  TEST_CASE("parallel algorithms") {
+    GIVEN("a thread pool and a vector") {
+      cpl::thread_pool pool(4);
+      cpl::vector<int> ints;
+      for (int value = 0; value < 10000; ++value) {
+        ints.push_back(value);
+      }
+      THEN("for_each invokes the function on each element") {
+        cpl::parallel::for_each(ints, [](int& value) { value *= 2; }, pool);
+        for (int value = 0; value < 10000; ++value) {
+          REQUIRE(ints[value] == 2 * value);
+        }
+      }
+      THEN("for_each works on a span") {
+        cpl::span<int> some(ints.borrow_all(), 100, 1000);
+        cpl::parallel::for_each(some, [](int& value) { value = -1; }, pool);
+        REQUIRE(ints[99] == 99);
+        REQUIRE(ints[100] == -1);
+        REQUIRE(ints[1099] == -1);
+        REQUIRE(ints[1100] == 1100);
+      }
+      THEN("transform sets each output element") {
+        cpl::vector<long> longs(ints.size());
+        cpl::parallel::transform(ints, longs, [](int value) { return long(value) * 3; }, pool);
+        for (int value = 0; value < 10000; ++value) {
+          REQUIRE(longs[value] == 3L * value);
+        }
+      }
+      THEN("reduce combines all the elements") {
+        long total = cpl::parallel::reduce(ints, 1L, [](long sum, long value) { return sum + value; }, pool);
+        REQUIRE(total == 1L + 10000L * 9999L / 2);
+      }
+      THEN("sort sorts the elements") {
+        std::mt19937 random(17);
+        std::shuffle(ints.begin(), ints.end(), random);
+        cpl::parallel::sort(ints, std::greater<int>(), pool);
+        for (int value = 0; value < 10000; ++value) {
+          REQUIRE(ints[value] == 9999 - value);
+        }
+      }
+      THEN("chunks after the first start at a cache line boundary") {
+        cpl::uref<int[]> aligned_ints = cpl::make_uref_array<int>(10000, CPL_CACHE_LINE_SIZE);
+        cpl::span<int> some = cpl::span<int>(aligned_ints).subspan(3, 9000);
+        cpl::parallel::chunking chunks(some, pool);
+        REQUIRE(chunks.count() > 1);
+        for (size_t index = 1; index < chunks.count(); ++index) {
+          REQUIRE(reinterpret_cast<uintptr_t>(some.data() + chunks.first(index)) % CPL_CACHE_LINE_SIZE == 0);
+          REQUIRE(chunks.index_of(chunks.first(index)) == index);
+        }
+        REQUIRE(chunks.first(chunks.count()) == 9000);
+      }
+      THEN("exceptions are propagated") {
+        REQUIRE_THROWS(cpl::parallel::for_each(ints,
+                                               [](int& value) {
+                                                 if (value == 5000) {
+                                                   throw std::runtime_error("oops");
+                                                 }
+                                               },
+                                               pool));
+      }
+      THEN("accessing another chunk will be " CPL_VARIANT) {
+        cpl::span<int> some(ints.borrow_all(), 0, 10);
+        REQUIRE_CPL_THROWS(cpl::parallel::for_each_chunk(some, [](size_t, const cpl::span<int>& chunk) { chunk[10] = 0; }, pool));
+      }
+      THEN("transforming partially overlapping spans will be " CPL_VARIANT) {
+        cpl::span<int> input(ints.borrow_all(), 0, 10);
+        cpl::span<int> output(ints.borrow_all(), 5, 10);
+        REQUIRE_CPL_THROWS(cpl::parallel::transform(input, output, [](int value) { return value; }, pool));
+      }
+      THEN("modifying the vector during the algorithm will be " CPL_VARIANT) {
+        ints.resize(10);
+        REQUIRE_CPL_THROWS(cpl::parallel::for_each(ints,
+                                                   [&ints](int& value) {
+                                                     if (&value == &ints.back()) {
+                                                       ints.reserve(100000);
+                                                     }
+                                                   },
+                                                   pool));
+      }
+    }
+  }
+
+  /// Remember which thread destroyed it.
+  struct DestroyedBy {
+    /// Where to store the destroying thread.
+    std::thread::id& destroyer;
+
+    /// Remember where to store the destroying thread.
+    explicit DestroyedBy(std::thread::id& destroyer) : destroyer(destroyer) {
+    }
+
+    /// Store the destroying thread.
+    ~DestroyedBy() {
+      destroyer = std::this_thread::get_id();
+    }
+  };
+
+  TEST_CASE("deferred destruction") {
+    GIVEN("a background reclaimer") {
+      cpl::reclaimer reclaimer;
+      THEN("values are destroyed by the background thread") {
+        std::thread::id destroyer;
+        reclaimer.destroy(cpl::make_uref<DestroyedBy>(destroyer));
+        reclaimer.flush();
+        REQUIRE(reclaimer.pending_count() == 0);
+        REQUIRE(destroyer != std::thread::id());
+        REQUIRE(destroyer != std::this_thread::get_id());
+      }
+      THEN("defer_destroy uses the default reclaimer") {
+        std::thread::id destroyer;
+        cpl::defer_destroy(cpl::make_uref<DestroyedBy>(destroyer));
+        cpl::default_reclaimer().flush();
+        REQUIRE(destroyer != std::thread::id());
+        REQUIRE(destroyer != std::this_thread::get_id());
+      }
+    }
+    GIVEN("a reclaimer without a background thread") {
+      cpl::reclaimer reclaimer(false);
+      cpl::uref<Foo> foo = cpl::make_uref<Foo>(1);
+      cpl::ref<Foo> foo_ref = foo;
+      reclaimer.destroy(std::move(foo));
+      reclaimer.destroy(cpl::make_uref<Foo>(2));
+      reclaimer.destroy(cpl::make_uref<Foo>(3));
+      THEN("using a handed off value will be " CPL_VARIANT) {
+        REQUIRE_CPL_THROWS(foo_ref->foo);
+        REQUIRE(Foo::live_objects.size() == 3);
+      }
+      THEN("values are destroyed within the time budget") {
+        REQUIRE(reclaimer.reclaim(std::chrono::seconds(0)) == 1);
+        REQUIRE(reclaimer.pending_count() == 2);
+        REQUIRE(Foo::live_objects.size() == 2);
+        REQUIRE(reclaimer.reclaim(std::chrono::seconds(10)) == 2);
+        REQUIRE(Foo::live_objects.size() == 0);
+      }
+      THEN("flushing destroys all the values") {
+        reclaimer.flush();
+        REQUIRE(Foo::live_objects.size() == 0);
+      }
+    }
+    REQUIRE(Foo::live_objects.size() == 0);
+  }
+
+#ifdef __cpp_impl_coroutine // {
+  /// Suspend a coroutine until it is explicitly resumed.
+  struct Event {
+    /// The suspended coroutine.
+    std::coroutine_handle<> waiting;
+
+    /// Always suspend.
+    bool await_ready() {
+      return false;
+    }
+
+    /// Remember the suspended coroutine.
+    void await_suspend(std::coroutine_handle<> handle) {
+      waiting = handle;
+    }
+
+    /// Nothing to return.
+    void await_resume() {
+    }
+  };
+
+  /// A coroutine allocated from an arena.
+  static cpl::task<int> add_in_arena(cpl::frame_arena&, int left, int right) {
+    co_return left + right;
+  }
+
+  /// A coroutine awaiting another one.
+  static cpl::task<int> double_in_arena(cpl::frame_arena& arena, int value) {
+    int result = co_await add_in_arena(arena, value, value);
+    co_return result;
+  }
+
+  /// A coroutine holding a borrow argument while suspended.
+  static cpl::task<int> suspend_with_argument(Event& event, cpl::ref<Foo> foo) {
+    int before = foo->foo;
+    co_await event;
+    co_return before;
+  }
+
+  /// A coroutine holding a borrow local while suspended.
+  static cpl::task<int> suspend_with_local(Event& event, cpl::is<Foo>& foo) {
+    cpl::ref<Foo> foo_ref = foo;
+    cpl::borrow_watch_scope watch = co_await cpl::watch_borrow(foo_ref);
+    int before = foo_ref->foo;
+    co_await event;
+    co_return before;
+  }
+
+  /// A coroutine which is done with a watched borrow local before suspending.
+  static cpl::task<int> suspend_after_local(Event& event, cpl::is<Foo>& foo) {
+    int before;
+    {
+      cpl::ref<Foo> foo_ref = foo;
+      cpl::borrow_watch_scope watch = co_await cpl::watch_borrow(foo_ref);
+      before = foo_ref->foo;
+    }
+    co_await event;
+    co_return before;
+  }
+
+  /// A coroutine which throws an exception.
+  static cpl::task<> throw_in_coroutine() {
+    throw std::runtime_error("oops");
+    co_return;
+  }
+
+  TEST_CASE("coroutine tasks") {
+    GIVEN("a frame arena") {
+      cpl::frame_arena arena;
+      THEN("tasks run lazily and may await each other") {
+        cpl::task<int> task = double_in_arena(arena, 21);
+        REQUIRE(!task.done());
+        task.resume();
+        REQUIRE(task.done());
+        REQUIRE(task.result() == 42);
+      }
+      THEN("task frames are allocated from the arena") {
+        {
+          cpl::task<int> task = add_in_arena(arena, 1, 2);
+          REQUIRE(arena.frame_count() == 1);
+          task.resume();
+          REQUIRE(task.result() == 3);
+        }
+        REQUIRE(arena.frame_count() == 0);
+      }
+      THEN("frames are reused") {
+        void* first = arena.allocate(100);
+        arena.deallocate(first, 100);
+        void* second = arena.allocate(90);
+        REQUIRE(second == first);
+        arena.deallocate(second, 90);
+      }
+    }
+    GIVEN("a task which throws an exception") {
+      cpl::task<> task = throw_in_coroutine();
+      THEN("the exception is rethrown by the result") {
+        task.resume();
+        REQUIRE_THROWS(task.result());
+      }
+    }
+    GIVEN("a suspended task holding a borrow argument") {
+      Event event;
+      std::experimental::optional<cpl::is<Foo>> foo;
+      foo.emplace(1);
+      cpl::task<int> task = suspend_with_argument(event, *foo);
+      task.resume();
+      REQUIRE(!task.done());
+      THEN("resuming it while the borrow is valid works") {
+        event.waiting.resume();
+        REQUIRE(task.result() == 1);
+      }
+      THEN("resuming it after the borrow expired will be " CPL_VARIANT) {
+        foo = std::experimental::nullopt;
+        event.waiting.resume();
+        REQUIRE(task.done());
+        REQUIRE_CPL_THROWS(task.result());
+      }
+    }
+    GIVEN("a suspended task watching a local borrow") {
+      Event event;
+      std::experimental::optional<cpl::is<Foo>> foo;
+      foo.emplace(1);
+      cpl::task<int> task = suspend_with_local(event, *foo);
+      task.resume();
+      REQUIRE(!task.done());
+      THEN("resuming it after the borrow expired will be " CPL_VARIANT) {
+        foo = std::experimental::nullopt;
+        event.waiting.resume();
+        REQUIRE(task.done());
+        REQUIRE_CPL_THROWS(task.result());
+      }
+    }
+    GIVEN("a suspended task which is done watching a local borrow") {
+      Event event;
+      std::experimental::optional<cpl::is<Foo>> foo;
+      foo.emplace(1);
+      cpl::task<int> task = suspend_after_local(event, *foo);
+      task.resume();
+      REQUIRE(!task.done());
+      THEN("resuming it after the borrow expired works") {
+        foo = std::experimental::nullopt;
+        event.waiting.resume();
+        REQUIRE(task.done());
+        REQUIRE(task.result() == 1);
+      }
+    }
+    REQUIRE(Foo::live_objects.size() == 0);
+  }
+#endif // } __cpp_impl_coroutine
 }